@@ -0,0 +1,10 @@
+-- Deep plan: each execution passes through a dozen of nodes
+\set id random(1, 99000)
+SELECT count(*)
+FROM pto_bench a
+	JOIN pto_bench b ON b.id = a.id + 1
+	JOIN pto_bench c ON c.id = b.id + 1
+	JOIN pto_bench d ON d.id = c.id + 1
+	JOIN pto_bench e ON e.id = d.id + 1
+	JOIN pto_bench f ON f.id = e.id + 1
+WHERE a.id BETWEEN :id AND :id + 100 AND a.val % 3 = 0;
@@ -0,0 +1,3 @@
+-- Parallel plan: instrumentation of workers is gathered by the leader
+\set val random(1, 1000)
+SELECT count(*), avg(id) FROM pto_bench WHERE val = :val;
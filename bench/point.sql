@@ -0,0 +1,3 @@
+-- Primary key lookup: the shortest plan, the highest rate of queries
+\set id random(1, 100000)
+SELECT * FROM pto_bench WHERE id = :id;
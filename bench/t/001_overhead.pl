@@ -0,0 +1,183 @@
+# Copyright (c) 2024 Andrei Lepikhov
+#
+# This software may be modified and distributed under the terms
+# of the MIT license. See the LICENSE file for details.
+
+# Overhead of the tracking hooks: TPS and latency percentiles of pgbench
+# scripts in each mode of the extension, with and without sampling, for
+# different plan shapes and numbers of clients.
+#
+# The run is driven by environment variables:
+#   PTO_BENCH_DURATION - seconds per run (10)
+#   PTO_BENCH_CLIENTS  - list of client counts ("1 4 16 64 256")
+#   PTO_BENCH_SCRIPTS  - list of scripts from the bench directory
+#                        ("point join parallel")
+#   PTO_BENCH_OUTPUT   - file for the results, one JSON object per run
+#                        (tmp_check/bench_results.json)
+
+use strict;
+use warnings FATAL => 'all';
+
+use IPC::Run;
+use JSON::PP;
+use List::Util qw(min);
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $duration = $ENV{PTO_BENCH_DURATION} // 10;
+my @clients = split(' ', $ENV{PTO_BENCH_CLIENTS} // '1 4 16 64 256');
+my @scripts = split(' ', $ENV{PTO_BENCH_SCRIPTS} // 'point join parallel');
+my $output = $ENV{PTO_BENCH_OUTPUT}
+  // "$PostgreSQL::Test::Utils::tmp_check/bench_results.json";
+
+# Settings of the extension compared against each other. Normal mode with an
+# unreachable threshold pays for the instrumentation and the analysis of the
+# plan, but not for the storage.
+my @configs = (
+	{ name => 'disabled', mode => 'disabled' },
+	{ name => 'normal', mode => 'normal', log_min_error => 1e6 },
+	{ name => 'forced', mode => 'forced' },
+	{ name => 'normal_sampled', mode => 'normal', log_min_error => 1e6,
+	  sample_rate => 0.1 },
+	{ name => 'forced_sampled', mode => 'forced', sample_rate => 0.1 },
+	{ name => 'forced_rows', mode => 'forced', instrumentation => 'rows' });
+
+my $max_clients = (sort { $b <=> $a } @clients)[0];
+
+my $node = PostgreSQL::Test::Cluster->new('bench');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_track_optimizer'
+compute_query_id = on
+max_connections = @{[ $max_clients + 10 ]}
+shared_buffers = 256MB
+pg_track_optimizer.hash_mem = 64MB
+max_worker_processes = 16
+max_parallel_workers = 8
+max_parallel_workers_per_gather = 2
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_track_optimizer;
+CREATE TABLE pto_bench (id integer PRIMARY KEY, val integer, payload text);
+INSERT INTO pto_bench
+  SELECT gs, gs % 1000 + 1, repeat('x', 64) FROM generate_series(1, 100000) AS gs;
+VACUUM ANALYZE pto_bench;
+});
+
+# Parse per-transaction logs of pgbench and return latency percentiles, ms.
+sub latency_percentiles
+{
+	my ($prefix) = @_;
+	my @latencies;
+
+	foreach my $file (glob("$prefix.*"))
+	{
+		open(my $fh, '<', $file) or die "could not open \"$file\": $!";
+		while (my $line = <$fh>)
+		{
+			my @fields = split(' ', $line);
+			push @latencies, $fields[2] / 1000.0;
+		}
+		close($fh);
+		unlink($file);
+	}
+
+	return {} if !@latencies;
+
+	@latencies = sort { $a <=> $b } @latencies;
+	my %result;
+	foreach my $p (50, 90, 99, 99.9)
+	{
+		my $idx = min($#latencies, int($p / 100.0 * scalar(@latencies)));
+		$result{"p$p"} = $latencies[$idx];
+	}
+	return \%result;
+}
+
+open(my $out, '>', $output) or die "could not open \"$output\": $!";
+my $json = JSON::PP->new->canonical;
+
+foreach my $script (@scripts)
+{
+	foreach my $config (@configs)
+	{
+		foreach my $nclients (@clients)
+		{
+			my $prefix = "$PostgreSQL::Test::Utils::tmp_check/pgbench_log";
+			my @options = ("-c pg_track_optimizer.mode=$config->{mode}");
+			my ($stdout, $stderr);
+
+			push @options,
+			  "-c pg_track_optimizer.log_min_error=$config->{log_min_error}"
+			  if defined $config->{log_min_error};
+			push @options,
+			  "-c pg_track_optimizer.sample_rate=$config->{sample_rate}"
+			  if defined $config->{sample_rate};
+			push @options,
+			  "-c pg_track_optimizer.instrumentation=$config->{instrumentation}"
+			  if defined $config->{instrumentation};
+
+			# Make the planner choose the parallel plan for the small table
+			push @options,
+			  '-c parallel_setup_cost=0', '-c parallel_tuple_cost=0',
+			  '-c min_parallel_table_scan_size=0'
+			  if $script eq 'parallel';
+
+			$node->safe_psql('postgres', 'SELECT pg_track_optimizer_reset()');
+
+			local $ENV{PGOPTIONS} = join(' ', @options);
+			my $ok = IPC::Run::run(
+				[
+					'pgbench', '-n',
+					'-M', 'prepared',
+					'-T', $duration,
+					'-c', $nclients,
+					'-j', min($nclients, 16),
+					'-f', "bench/$script.sql",
+					'-l', '--log-prefix', $prefix,
+					'-h', $node->host,
+					'-p', $node->port,
+					'postgres'
+				],
+				'>', \$stdout, '2>', \$stderr);
+
+			my ($tps) = $stdout =~ /tps = ([\d.]+)/;
+			ok($ok && defined $tps,
+				"pgbench $script, $config->{name}, $nclients clients")
+			  or diag($stderr);
+
+			my $result = {
+				script => $script,
+				config => $config->{name},
+				clients => $nclients + 0,
+				duration => $duration + 0,
+				tps => defined $tps ? $tps + 0 : undef,
+				latency_ms => latency_percentiles($prefix),
+			};
+			print $out $json->encode($result), "\n";
+			note $json->encode($result);
+		}
+	}
+}
+
+close($out);
+
+# Make sure forced mode really has tracked the benchmark queries
+if (grep { $_->{mode} eq 'forced' } @configs)
+{
+	is( $node->safe_psql(
+			'postgres',
+			"SELECT count(*) > 0 FROM pg_track_optimizer()
+			 WHERE querytext LIKE '%pto_bench%'"),
+		't',
+		'benchmark queries are tracked');
+}
+
+$node->stop;
+
+done_testing();
@@ -5,24 +5,237 @@
 CREATE OR REPLACE FUNCTION pg_track_optimizer(
 	OUT dboid			Oid,
 	OUT queryid			bigint,
+	OUT toplevel		bool,
 	OUT querytext       text,
 	OUT relative_error	float8,
 	OUT error2          float8,
 	OUT nodes_assessed  integer,
 	OUT nodes_total     integer,
 	OUT exec_time       float8,
-	OUT nexecs          bigint
+	OUT nexecs          bigint,
+	OUT est_nexecs      float8,
+	OUT min_relative_error		float8,
+	OUT max_relative_error		float8,
+	OUT stddev_relative_error	float8,
+	OUT min_error2		float8,
+	OUT max_error2		float8,
+	OUT stddev_error2	float8,
+	OUT min_exec_time	float8,
+	OUT max_exec_time	float8,
+	OUT stddev_exec_time	float8,
+	OUT total_exec_time	float8,
+	OUT error_time		float8,
+	OUT worker_skew		float8,
+	OUT worker_time_skew	float8,
+	OUT workers_short	bigint,
+	OUT partitions_scanned	integer,
+	OUT partitions_pruned	integer
 )
 RETURNS setof record
 AS 'MODULE_PATHNAME', 'to_show_data'
 LANGUAGE C STRICT VOLATILE;
 
+CREATE OR REPLACE FUNCTION pg_track_optimizer_window(
+	period				interval DEFAULT '1 hour',
+	OUT dboid			Oid,
+	OUT queryid			bigint,
+	OUT toplevel		bool,
+	OUT querytext		text,
+	OUT nexecs			bigint,
+	OUT est_nexecs		float8,
+	OUT avg_error		float8,
+	OUT exec_time		float8,
+	OUT error_time		float8
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_window'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_top(
+	k					bigint,
+	order_by			text DEFAULT 'error2',
+	dbid				Oid DEFAULT NULL,
+	min_nexecs			bigint DEFAULT 0,
+	OUT dboid			Oid,
+	OUT queryid			bigint,
+	OUT toplevel		bool,
+	OUT querytext       text,
+	OUT relative_error	float8,
+	OUT error2          float8,
+	OUT nodes_assessed  integer,
+	OUT nodes_total     integer,
+	OUT exec_time       float8,
+	OUT nexecs          bigint,
+	OUT est_nexecs      float8,
+	OUT min_relative_error		float8,
+	OUT max_relative_error		float8,
+	OUT stddev_relative_error	float8,
+	OUT min_error2		float8,
+	OUT max_error2		float8,
+	OUT stddev_error2	float8,
+	OUT min_exec_time	float8,
+	OUT max_exec_time	float8,
+	OUT stddev_exec_time	float8,
+	OUT total_exec_time	float8,
+	OUT error_time		float8,
+	OUT worker_skew		float8,
+	OUT worker_time_skew	float8,
+	OUT workers_short	bigint,
+	OUT partitions_scanned	integer,
+	OUT partitions_pruned	integer
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_top'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_plan(
+	queryid				bigint,
+	dboid				Oid DEFAULT NULL,
+	toplevel			bool DEFAULT true
+)
+RETURNS json
+AS 'MODULE_PATHNAME', 'to_plan'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_plans(
+	OUT dboid			Oid,
+	OUT queryid			bigint,
+	OUT toplevel		bool,
+	OUT planid			bigint,
+	OUT nexecs			bigint,
+	OUT est_nexecs		float8,
+	OUT relative_error	float8,
+	OUT error2			float8,
+	OUT exec_time		float8,
+	OUT min_exec_time	float8,
+	OUT max_exec_time	float8,
+	OUT total_exec_time	float8,
+	OUT error_time		float8,
+	OUT last_exec		timestamptz
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_plans'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_advice(
+	OUT dboid			Oid,
+	OUT relid			Oid,
+	OUT attnums			smallint[],
+	OUT nnodes			bigint,
+	OUT error2			float8,
+	OUT max_error		float8,
+	OUT statement		text
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_advice'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_relations(
+	OUT dboid			Oid,
+	OUT relid			Oid,
+	OUT relname			text,
+	OUT nscans			bigint,
+	OUT overestimated	bigint,
+	OUT avg_error		float8,
+	OUT total_error		float8,
+	OUT error2			float8
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_relations'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_nodes(
+	OUT dboid			Oid,
+	OUT node			text,
+	OUT jointype		text,
+	OUT nnodes			bigint,
+	OUT noverestimated	bigint,
+	OUT avg_error		float8,
+	OUT buckets			bigint[]
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_nodes'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_details(
+	OUT dboid			Oid,
+	OUT queryid			bigint,
+	OUT toplevel		boolean,
+	OUT captured		timestamptz,
+	OUT node_id			integer,
+	OUT node_type		text,
+	OUT plan_rows		float8,
+	OUT actual_rows		float8,
+	OUT loops			float8,
+	OUT time			float8
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_details'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_status(
+	OUT entries			bigint,
+	OUT mem_used		bigint,
+	OUT mem_limit		bigint,
+	OUT evicted			bigint,
+	OUT dropped			bigint,
+	OUT plans_dropped	bigint,
+	OUT log_min_error	float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'to_status'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_self_stats(
+	OUT phase			text,
+	OUT calls			bigint,
+	OUT total_time		float8,
+	OUT lock_calls		bigint,
+	OUT lock_time		float8
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_self_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_stats(
+	OUT dboid			Oid,
+	OUT nexecs			bigint,
+	OUT error_time		float8,
+	OUT bad_time		float8,
+	OUT dropped			bigint,
+	OUT evicted			bigint
+)
+RETURNS setof record
+AS 'MODULE_PATHNAME', 'to_stats'
+LANGUAGE C STRICT VOLATILE;
+
 CREATE OR REPLACE FUNCTION pg_track_optimizer_flush()
 RETURNS VOID
 AS 'MODULE_PATHNAME', 'to_flush'
 LANGUAGE C STRICT VOLATILE;
 
-CREATE OR REPLACE FUNCTION pg_track_optimizer_reset()
+CREATE OR REPLACE FUNCTION pg_track_optimizer_export(
+	chunk_size			integer DEFAULT 1048576
+)
+RETURNS setof bytea
+AS 'MODULE_PATHNAME', 'to_export'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_merge(chunk bytea)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'to_merge'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION pg_track_optimizer_reset(
+	dboid				Oid DEFAULT NULL,
+	queryid				bigint DEFAULT NULL
+)
 RETURNS VOID
 AS 'MODULE_PATHNAME', 'to_reset'
-LANGUAGE C STRICT VOLATILE;
+LANGUAGE C VOLATILE;
+
+-- Export shows texts of all the queries; merge and reset change statistics of
+-- everyone. Superuser may grant them to a monitoring role.
+REVOKE ALL ON FUNCTION pg_track_optimizer_reset(Oid, bigint) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_track_optimizer_export(integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_track_optimizer_merge(bytea) FROM PUBLIC;
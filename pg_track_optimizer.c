@@ -16,33 +16,139 @@
 
 #include "postgres.h"
 
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "access/htup_details.h"
 #include "access/parallel.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type_d.h"
 #include "commands/explain.h"
+#include "common/hashfn.h"
+#include "common/int.h"
+#include "common/keywords.h"
+#include "common/pg_lzcompress.h"
+#include "common/pg_prng.h"
 #include "executor/executor.h"
 #include "funcapi.h"
+#include "lib/binaryheap.h"
 #include "lib/dshash.h"
+#include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "nodes/nodeFuncs.h"
 #include "nodes/queryjumble.h"
 #include "optimizer/optimizer.h"
+#include "optimizer/planmain.h"
+#include "parser/analyze.h"
+#include "parser/scanner.h"
+#include "partitioning/partdesc.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "statistics/statistics.h"
 #include "storage/dsm_registry.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/float.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
 
 PG_MODULE_MAGIC;
 
-#define track_optimizer_enabled(eflags) \
-	( \
-	IsQueryIdEnabled() && !IsParallelWorker() && \
-	queryDesc->plannedstmt->utilityStmt == NULL && \
-	(log_min_error >= 0. || track_mode == TRACK_MODE_FORCED) && \
-	track_mode != TRACK_MODE_DISABLED && \
-	((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0) \
-	)
+#define EXTENSION_NAME "pg_track_optimizer"
+
+#define DATATBL_NCOLS	(27)
+#define STATUS_NCOLS	(7)
+
+/*
+ * Approximate size of DSA memory consumed by an entry of the hash table,
+ * including the dshash item header (next pointer and hash value) and its slot
+ * in the array sampled by the eviction.
+ */
+#define ENTRY_MEM_SIZE \
+	(MAXALIGN(sizeof(DSMOptimizerTrackerEntry)) + 2 * sizeof(dsa_pointer) + \
+	 sizeof(EvictionSlot))
+#define PLAN_ENTRY_MEM_SIZE \
+	(MAXALIGN(sizeof(PlanTrackerEntry)) + 2 * sizeof(dsa_pointer))
+#define TEXT_MEM_SIZE(len) \
+	(MAXALIGN(sizeof(QueryTextEntry)) + 2 * sizeof(dsa_pointer) + MAXALIGN(len))
+
+/* Don't even try to compress shorter texts */
+#define TEXT_COMPRESS_MIN_LEN	(64)
+
+/* Max number of probes of the text store in the case of hash collisions */
+#define TEXT_MAX_PROBES			(4)
+
+/* Max size of the local cache of normalised query texts */
+#define NORMALIZED_CACHE_SIZE	(1024)
+
+/*
+ * Number of entries sampled by one pass of the eviction procedure, and the
+ * fraction of the sample thrown away.
+ */
+#define EVICTION_SAMPLE		(256)
+#define EVICTION_FRACTION	(0.05)
+
+/* Initial size of the array of eviction slots */
+#define EVICTION_MIN_SLOTS	(1024)
+#define SLOT_NONE			PG_UINT32_MAX
+
+/*
+ * The delta log is compacted into the data file when it contains more records
+ * than the hash table has entries, but not earlier than this number of records.
+ */
+#define DELTA_COMPACT_MIN_RECORDS	(1024)
+
+/*
+ * Keys of removed entries waiting to be written into the delta log as delete
+ * records. On overflow the next checkpoint compacts the log instead.
+ */
+#define REMOVED_MAX_KEYS	(1024)
+
+/* States of the load of the disk storage, see load_pending */
+#define LOAD_DONE		(0)
+#define LOAD_PENDING	(1)
+#define LOAD_RUNNING	(2) /* The loader holds the io_lock */
+
+/*
+ * Seconds backends wait for the worker to load the disk storage before doing
+ * it themselves
+ */
+#define LOAD_WAIT_TIMEOUT	(60)
+
+/* Size of the ring buffer of plans waiting for asynchronous logging */
+#define LOG_RING_SIZE		(1024 * 1024)
 
-#define DATATBL_NCOLS	(9)
+/* Number of slots used to limit the logging rate per query */
+#define LOG_RATE_SLOTS		(1024)
+
+/*
+ * Number of slots of per-database counters. The last slot is shared by all
+ * databases which haven't got their own one.
+ */
+#define DB_STATS_SLOTS		(64)
+
+/* Number of time buckets kept per entry, see window_interval */
+#define WINDOW_NBUCKETS		(12)
+#define STATS_NCOLS			(6)
 
 /*
  * Data structure used for error estimation as well as for statistics gathering.
@@ -53,24 +159,239 @@ typedef struct ScourContext
 	double	error2;
 	double	totaltime;
 
+	/*
+	 * Without per-node timing the share of the node's cost in the total cost of
+	 * the plan is used as a weight of the node's error in the error2 value.
+	 */
+	bool	use_timing;
+	double	totalcost;
+
 	/* Number of nodes assessed */
 	int		nnodes;
 
 	/*
 	 * Total number of nodes in the plan. Originally, used to detect leaf nodes.
-	 * Now, it is a part of statistics.
+	 * Now, it is a part of statistics. Subtrees cut off by append_children_limit
+	 * add only their top nodes, and nothing is counted past max_nodes.
 	 */
 	int 	counter;
+
+	/* Fingerprint of the plan structure */
+	uint64	planid;
+
+	/* Parallel execution, see TrackerStats */
+	double	worker_skew;
+	double	worker_time_skew;
+	bool	workers_short;
+
+	/* Partitions of Append nodes */
+	int		parts_scanned;
+	int		parts_pruned;
+
+	/* Per-node detail of a top offender, NULL if not captured */
+	struct DetailNode  *detail;
+	int					ndetail;
 } ScourContext;
 
+/* Per-node detail is kept for at most this number of queries and nodes */
+#define DETAIL_MAX_ENTRIES		(1024)
+#define DETAIL_MAX_NODES		(128)
+
+/* How often the set of top offenders is recalculated, ms */
+#define DETAIL_REFRESH_INTERVAL	(10000)
+
+/*
+ * Compact per-node detail of the last execution of a query from the top of
+ * error2 * nexecs, see detail_entries.
+ */
+typedef struct DetailNode
+{
+	int32	node_id;
+	int32	tag; /* NodeTag of the plan node */
+	double	plan_rows;
+	double	actual_rows; /* Per loop */
+	double	loops;
+	double	time; /* Total time of the node, ms */
+} DetailNode;
+
+/*
+ * Phases of the extension's own work, see self_instrumentation.
+ */
+typedef enum TrackPhase
+{
+	TRACK_PHASE_WALK,		/* Pass through the plan */
+	TRACK_PHASE_STORE,		/* store_data() */
+	TRACK_PHASE_PLAN,		/* Storing the worst plan */
+	TRACK_PHASE_EXPLAIN,	/* Logging the plan */
+	TRACK_PHASE_MERGE,		/* Merge of the local buffer */
+	TRACK_PHASE_FLUSH,		/* Writing to the disk */
+} TrackPhase;
+
+#define TRACK_PHASE_COUNT	(TRACK_PHASE_FLUSH + 1)
+
+static const char *const track_phase_names[TRACK_PHASE_COUNT] = {
+	"walk", "store", "plan", "explain", "merge", "flush"
+};
+
+/*
+ * Time spent in the phase, including time spent in lookups of the shared
+ * table: the latter mostly consists of waiting on partition locks.
+ */
+typedef struct PhaseStats
+{
+	pg_atomic_uint64	calls;
+	pg_atomic_uint64	time; /* Nanoseconds */
+	pg_atomic_uint64	lock_calls;
+	pg_atomic_uint64	lock_time;
+} PhaseStats;
+
+/*
+ * Cumulative counters of a database. Updated on each execution, so each slot
+ * occupies its own cache line to avoid false sharing between databases.
+ * The number of executions and time values are weighted by the sampling
+ * weight, the time is in microseconds.
+ */
+#define DB_NEXECS_SCALE		(1000)
+
+typedef struct DBStats
+{
+	pg_atomic_uint32	dbOid; /* InvalidOid, if the slot is free */
+	pg_atomic_uint64	nexecs; /* Estimated executions, in DB_NEXECS_SCALE
+								 * units */
+	pg_atomic_uint64	error_time; /* Sum of time multiplied by error2 */
+	pg_atomic_uint64	bad_time; /* Time of executions above log_min_error */
+	pg_atomic_uint64	ndropped;
+	pg_atomic_uint64	nevicted;
+} DBStats;
+
+typedef union DBStatsPadded
+{
+	DBStats		stats;
+#ifdef pg_attribute_aligned
+	pg_attribute_aligned(PG_CACHE_LINE_SIZE)
+#endif
+	char		pad[PG_CACHE_LINE_SIZE];
+} DBStatsPadded;
+
+/*
+ * Streaming quantile sketch of relative errors of executions: counts of
+ * logarithmically sized buckets, like DDSketch. Any quantile is known with
+ * the relative accuracy of about 1% at the fixed cost of an addition.
+ */
+#define SKETCH_NBUCKETS		(1024)
+#define SKETCH_GAMMA		(1.02)
+#define SKETCH_MIN_VALUE	(1e-4) /* Lower values go into the bucket 0 */
+#define SKETCH_INTERVAL		(60) /* Seconds, lifetime of a sketch */
+#define SKETCH_MIN_COUNT	(100)
+#define THRESHOLD_SCALE		(1e6)
+
+typedef struct ErrorSketch
+{
+	pg_atomic_uint32	epoch; /* Interval the counts belong to */
+	pg_atomic_uint64	count;
+	pg_atomic_uint64	buckets[SKETCH_NBUCKETS];
+} ErrorSketch;
+
 typedef struct TODSMRegistry
 {
-	LWLock				lock;
 	dshash_table	   *htab;
 	dsa_handle			dsah;
 	dshash_table_handle	dshh;
 
 	pg_atomic_uint32	htab_counter;
+
+	/*
+	 * Full reset just advances the generation. Entries of older generations
+	 * are invisible: writers reinitialise them in place, readers skip them, and
+	 * the background worker (or the resetting backend, if there is no worker)
+	 * frees them later, so nobody waits behind the cleanup.
+	 */
+	pg_atomic_uint32	generation;
+	pg_atomic_uint32	flush_requested; /* Reset should reach the disk */
+
+	/* Memory accounting and eviction */
+	LWLock				evict_lock; /* Allows only one evicting backend */
+	pg_atomic_uint64	mem_used; /* Bytes allocated for entries and texts */
+	pg_atomic_uint64	nevicted; /* Entries thrown away to free memory */
+	pg_atomic_uint64	ndropped; /* Executions not stored due to memory limit */
+	LWLock				slots_lock; /* Protects the fields below */
+	dsa_pointer			slots; /* EvictionSlot[max_slots] */
+	uint32				nslots; /* Ever used slots, including free ones */
+	uint32				max_slots;
+	uint32				free_slot; /* Head of the free list, or SLOT_NONE */
+
+	/*
+	 * Texts without references and plan variants of evicted entries are freed
+	 * by the background worker (or by the backend at the end of the query, if
+	 * there is no worker), not by the writer who hit the limit.
+	 */
+	pg_atomic_uint32	gc_requested;
+
+	/* Query text store */
+	dshash_table_handle	txt_dshh;
+	pg_atomic_uint64	txt_mem_used;
+
+	/* Per-node error histograms */
+	dshash_table_handle	node_dshh;
+
+	/* Statistics per plan variant */
+	dshash_table_handle	plan_dshh;
+
+	/* Candidates for extended statistics */
+	dshash_table_handle	advice_dshh;
+	pg_atomic_uint32	advice_counter;
+
+	/* Estimation errors per relation */
+	dshash_table_handle	relation_dshh;
+	pg_atomic_uint32	relation_counter;
+
+	/* Persistence */
+	LWLock				io_lock; /* Serialises writers of the disk files */
+	pg_atomic_uint32	ndirty; /* Entries changed since the last checkpoint */
+	pg_atomic_uint32	load_pending; /* LOAD_* state of the disk storage */
+	TimestampTz			load_start; /* Since when the load is pending */
+	uint64				delta_records; /* Protected by the io_lock */
+	bool				storage_standby; /* Files of a standby are in use,
+										  * protected by the io_lock */
+	LWLock				removed_lock;
+	uint32				nremoved; /* Fields protected by the removed_lock */
+	uint32				nlost; /* Removals which didn't fit into the queue */
+	DSMOptimizerTrackerKey removed[REMOVED_MAX_KEYS];
+
+	/* Asynchronous plan logging */
+	LWLock				log_lock;
+	dsa_pointer			log_ring; /* LOG_RING_SIZE bytes in the DSA, allocated
+									 * at the first use */
+	uint64				log_head; /* Fields protected by the log_lock */
+	uint64				log_tail;
+	PGPROC			   *worker_proc; /* NULL if the worker isn't running */
+	pg_atomic_uint64	log_dropped; /* Plans not logged: the ring was full */
+	pg_atomic_uint64	log_last[LOG_RATE_SLOTS]; /* Last logging time */
+
+	/* Counters readable without scanning the tables */
+	DBStatsPadded		db_stats[DB_STATS_SLOTS];
+
+	/* Self-instrumentation */
+	PhaseStats			phase_stats[TRACK_PHASE_COUNT];
+
+	/*
+	 * Top offenders, whose per-node detail is captured. Two sorted arrays of
+	 * DETAIL_MAX_ENTRIES keys in the DSA: backends search the current one
+	 * without locks, the refresh fills the other and switches them. A backend
+	 * racing with two refreshes in a row could see a mix of keys - the worst
+	 * case is a detail captured for a wrong query.
+	 */
+	dsa_pointer			detail_keys;
+	pg_atomic_uint32	detail_current; /* Index of the array in use */
+	pg_atomic_uint32	detail_nkeys[2];
+	pg_atomic_uint32	detail_count; /* Entries with the detail stored */
+	pg_atomic_uint64	detail_refresh; /* Time of the last refresh */
+
+	/* Adaptive threshold: sketches of the current and the previous interval */
+	ErrorSketch			sketches[2];
+	pg_atomic_uint64	adaptive_threshold; /* Scaled, PG_UINT64_MAX if unknown */
+	pg_atomic_uint64	threshold_refresh; /* Time of the last calculation */
+	TimestampTz			sketch_start; /* Nothing is fed before that */
 } TODSMRegistry;
 
 /*
@@ -82,22 +403,271 @@ typedef struct TODSMRegistry
 typedef struct DSMOptimizerTrackerKey
 {
 	Oid			dbOid;
+	bool		toplevel; /* Executed at the top level or nested */
 	uint64		queryId;
 } DSMOptimizerTrackerKey;
 
+/*
+ * Streaming aggregate of a per-execution value.
+ * Each value comes with its weight (inverse of the sampling probability), so
+ * the weighted variant of the Welford's algorithm is used to calculate mean and
+ * variance in one pass.
+ */
+typedef struct RStats
+{
+	double	weight;	/* Sum of weights of values have taken into account */
+	double	mean;
+	double	m2;		/* Weighted sum of squared differences from the mean */
+	double	min;
+	double	max;
+} RStats;
+
+/*
+ * Statistics gathered on executions of a query. Can be accumulated
+ * locally by a backend and merged into the shared entry afterwards.
+ */
+typedef struct TrackerStats
+{
+	RStats					relative_error;
+	RStats					error2;
+	RStats					exec_time;
+	double					error_time; /* Sum of exec_time * error2 over
+										 * executions */
+	int32					assessed_nodes; /* Last execution */
+	int32					total_nodes; /* Last execution */
+	int64					nexecs; /* Number of executions have taken into account */
+	double					est_nexecs; /* Sum of sampling weights: estimated
+										 * number of executions */
+	TimestampTz				last_exec; /* Start of the last statement stored */
+
+	/*
+	 * Parallel execution: the highest ratio of max to mean work of parallel
+	 * workers over nodes and executions, and number of executions launched
+	 * less workers than planned.
+	 */
+	double					worker_skew; /* By tuples */
+	double					worker_time_skew; /* By time */
+	int64					workers_short;
+
+	/* Partitions of Append nodes scanned and pruned in the last execution */
+	int32					parts_scanned;
+	int32					parts_pruned;
+} TrackerStats;
+
+/*
+ * Aggregates of executions started within one window_interval. Just a few
+ * numbers are enough for rankings over a recent period, so keep them compact.
+ * Buckets are rotated lazily: a bucket of an older epoch is overwritten by the
+ * first write into its position and ignored by readers.
+ */
+typedef struct WindowBucket
+{
+	uint32		epoch; /* Start time of the bucket in window_interval units */
+	uint32		nexecs;
+	float4		est_nexecs;
+	float4		error_weight; /* Weight of executions with relative error */
+	float4		error_sum; /* Weighted sum of relative errors */
+	float4		exec_time; /* Weighted sum of execution times, seconds */
+	float4		error_time;
+} WindowBucket;
+
 typedef struct DSMOptimizerTrackerEntry
 {
 	DSMOptimizerTrackerKey	key;
 
-	double					relative_error;
-	double					error2;
-	dsa_pointer				querytext_ptr;
-	int32					assessed_nodes;
-	int32					total_nodes;
-	double					exec_time;
-	int64					nexecs; /* Number of executions have taken into account */
+	uint64					textid; /* Key in the text store, 0 if no text */
+	uint32					generation; /* See TODSMRegistry */
+	bool					dirty; /* Changed since the last checkpoint */
+	uint32					changes; /* Bumped by every change, see _clear_dirty */
+	TrackerStats			stats;
+
+	/* EXPLAIN of the execution with the highest error, see plan_min_error */
+	dsa_pointer				plan; /* InvalidDsaPointer if not stored */
+	double					plan_error;
+	uint32					plan_len;
+	uint32					plan_stored_len; /* Less than plan_len, if compressed */
+
+	/* Per-node detail, see detail_entries. InvalidDsaPointer if not stored */
+	dsa_pointer				detail;
+	uint32					detail_nnodes;
+	TimestampTz				detail_time; /* When the execution was started */
+
+	uint32					slot; /* See EvictionSlot, SLOT_NONE if not sampled */
+
+	WindowBucket			window[WINDOW_NBUCKETS];
 } DSMOptimizerTrackerEntry;
 
+/*
+ * dshash can't return a random entry, so keys of the entries are kept in an
+ * array the eviction picks its sample from. Slots of removed entries are
+ * linked into the list of free ones.
+ */
+typedef struct EvictionSlot
+{
+	DSMOptimizerTrackerKey	key;
+	bool					used;
+	uint32					next_free;
+} EvictionSlot;
+
+/*
+ * Statistics on a variant of the plan of a query. A plan is identified by the
+ * fingerprint of its structure: node types, relations, indexes and join order.
+ * Entries are removed together with the entry of their query, or by the garbage
+ * collection after its eviction.
+ */
+typedef struct PlanTrackerKey
+{
+	DSMOptimizerTrackerKey	key;
+	uint64					planId;
+} PlanTrackerKey;
+
+typedef struct PlanTrackerEntry
+{
+	PlanTrackerKey			key;
+	uint32					generation; /* See TODSMRegistry */
+	TrackerStats			stats;
+} PlanTrackerEntry;
+
+/*
+ * Content-addressed store of query texts. The key is a hash of the text (in
+ * the case of collision the next value is probed), so the same text is stored
+ * only once whatever number of entries refer it.
+ * Texts without references are kept until the text memory limit is reached
+ * and garbage-collected independently of the tracker entries.
+ */
+typedef struct QueryTextEntry
+{
+	uint64		textid; /* hash key, must be first */
+
+	dsa_pointer	data;
+	uint32		len; /* Length of the text */
+	uint32		stored_len; /* Less than len, if compressed */
+	int32		refcount; /* Number of tracker entries referencing the text */
+} QueryTextEntry;
+
+/*
+ * Histogram of estimation errors of a class of plan nodes in a database.
+ * Bucket i counts nodes misestimated by a factor of [2^i, 2^(i+1)); the last
+ * bucket also takes all greater errors. Counters are atomic, so updating an
+ * existed histogram needs only a shared partition lock.
+ */
+#define NODE_HIST_NBUCKETS	(16)
+
+typedef struct NodeHistKey
+{
+	Oid			dbOid;
+	int32		nodeTag;
+	int32		jointype; /* -1 for non-join nodes */
+} NodeHistKey;
+
+typedef struct NodeHistEntry
+{
+	NodeHistKey			key;
+
+	pg_atomic_uint64	buckets[NODE_HIST_NBUCKETS];
+	pg_atomic_uint64	noverestimated; /* Nodes with plan_rows > real_rows */
+	pg_atomic_uint64	error_sum; /* Sum of errors in NODE_HIST_SCALE units */
+} NodeHistEntry;
+
+#define NODE_HIST_SCALE		(1000000.)
+
+/*
+ * Estimation errors of scans of a relation, across all the queries. Updated
+ * with atomics under a shared partition lock, like the histograms.
+ */
+#define RELATION_MAX_ENTRIES	(10000)
+
+typedef struct RelationErrorKey
+{
+	Oid			dbOid;
+	Oid			relid;
+} RelationErrorKey;
+
+typedef struct RelationErrorEntry
+{
+	RelationErrorKey	key;
+
+	pg_atomic_uint64	nscans;
+	pg_atomic_uint64	noverestimated; /* Scans with plan_rows > real_rows */
+	pg_atomic_uint64	error_sum; /* In NODE_HIST_SCALE units */
+	pg_atomic_uint64	error2_sum; /* Time-weighted, in NODE_HIST_SCALE units */
+} RelationErrorEntry;
+
+/*
+ * Set of columns of a relation referenced by quals of a badly estimated scan.
+ * A candidate for CREATE STATISTICS. Attribute numbers are sorted, so the same
+ * set always gives the same key.
+ */
+typedef struct AdviceKey
+{
+	Oid			dbOid;
+	Oid			relid;
+	int16		natts;
+	int16		attnums[STATS_MAX_DIMENSIONS];
+} AdviceKey;
+
+typedef struct AdviceEntry
+{
+	AdviceKey	key;
+
+	int64		nnodes; /* Number of misestimated nodes */
+	double		error2; /* Sum of time-weighted errors of the nodes */
+	double		max_error;
+} AdviceEntry;
+
+/* Nodes misestimated less than twice are not interesting for the advice */
+#define ADVICE_MIN_ERROR	(0.6931471805599453)
+
+/* Limit of the number of column sets tracked */
+#define ADVICE_MAX_ENTRIES	(10000)
+
+/* Backend-local cache of normalised texts, filled at parse analysis */
+typedef struct NormalizedTextEntry
+{
+	uint64		queryId; /* hash key, must be first */
+
+	char	   *text;
+	int			len;
+} NormalizedTextEntry;
+
+/*
+ * Entry of the backend-local buffer. Executions are accumulated here and
+ * merged into the shared hash table in batches.
+ */
+typedef struct LocalTrackerEntry
+{
+	PlanTrackerKey			key; /* hash key, must be first */
+
+	char				   *querytext;
+	int						querytext_len;
+	TrackerStats			stats;
+} LocalTrackerEntry;
+
+/*
+ * Decision on tracking has made for a query in the ExecutorStart hook.
+ * Lives in the per-query memory context and is found by the queryDesc pointer
+ * at the end of execution. Reset callback of this context removes the state
+ * from the list, so we don't need any cleanup in the case of an error.
+ * Settings are remembered at the start, so the end of the query is processed
+ * consistently even if they have been changed in the middle.
+ */
+typedef struct TrackQueryState
+{
+	QueryDesc			   *queryDesc;
+	uint64					queryId;
+	bool					toplevel;
+	double					weight; /* Inverse of sampling probability */
+	bool					use_timing; /* Per-node timing is requested */
+
+	/* Snapshot of the settings */
+	int						track_mode;
+	double					log_min_error;
+	double					plan_min_error;
+
+	MemoryContextCallback	cb;
+	struct TrackQueryState *next;
+} TrackQueryState;
+
 static const dshash_parameters dsh_params = {
 	sizeof(DSMOptimizerTrackerKey),
 	sizeof(DSMOptimizerTrackerEntry),
@@ -106,12 +676,96 @@ static const dshash_parameters dsh_params = {
 	LWTRANCHE_PGSTATS_HASH
 };
 
+static const dshash_parameters txt_params = {
+	sizeof(uint64),
+	sizeof(QueryTextEntry),
+	dshash_memcmp,
+	dshash_memhash,
+	LWTRANCHE_PGSTATS_HASH
+};
+
+static const dshash_parameters plan_params = {
+	sizeof(PlanTrackerKey),
+	sizeof(PlanTrackerEntry),
+	dshash_memcmp,
+	dshash_memhash,
+	LWTRANCHE_PGSTATS_HASH
+};
+
+static const dshash_parameters advice_params = {
+	sizeof(AdviceKey),
+	sizeof(AdviceEntry),
+	dshash_memcmp,
+	dshash_memhash,
+	LWTRANCHE_PGSTATS_HASH
+};
+
+static const dshash_parameters relation_params = {
+	sizeof(RelationErrorKey),
+	sizeof(RelationErrorEntry),
+	dshash_memcmp,
+	dshash_memhash,
+	LWTRANCHE_PGSTATS_HASH
+};
+
+static const dshash_parameters node_params = {
+	sizeof(NodeHistKey),
+	sizeof(NodeHistEntry),
+	dshash_memcmp,
+	dshash_memhash,
+	LWTRANCHE_PGSTATS_HASH
+};
+
 static TODSMRegistry *shared = NULL;
+static DBStats *my_db_stats = NULL; /* Slot of MyDatabaseId */
 static dsa_area *htab_dsa = NULL;
 static dshash_table *htab = NULL;
+static dshash_table *txt_htab = NULL;
+static dshash_table *node_htab = NULL;
+static dshash_table *plan_htab = NULL;
+static dshash_table *advice_htab = NULL;
+static dshash_table *relation_htab = NULL;
 
+static MemoryContext normalized_cxt = NULL;
+static HTAB *normalized_texts = NULL;
+
+static TrackQueryState *tracked_queries = NULL;
+
+/* Backend-local buffer of executions */
+static MemoryContext local_buffer_cxt = NULL;
+static HTAB *local_htab = NULL;
+static HTAB *local_advice = NULL; /* AdviceEntry */
+static int local_nexecs = 0;
+
+/* Set by the timer when the batch has waited for batch_timeout */
+static volatile sig_atomic_t local_flush_pending = false;
+static TimeoutId batch_timeout_id = MAX_TIMEOUTS;
+
+/* Garbage collection requested while there is no worker to do it */
+static bool gc_pending = false;
+
+/* Counts of the error sketch not moved to the shared memory yet */
+#define SKETCH_LOCAL_SLOTS	(16)
+#define SKETCH_LOCAL_EXECS	(64)
+
+static struct
+{
+	int		idx;
+	uint64	count;
+} sketch_local[SKETCH_LOCAL_SLOTS];
+static int sketch_nlocal = 0;
+static int sketch_local_execs = 0;
+static bool sketch_exit_registered = false;
+
+static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
 static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+
+/* Current nesting depth of planner/executor calls, like pg_stat_statements */
+static int nesting_level = 0;
 
 typedef enum
 {
@@ -127,834 +781,7202 @@ static const struct config_enum_entry format_options[] = {
 	{NULL, 0, false}
 };
 
+/*
+ * Level of instrumentation requested for tracked queries.
+ * 'rows' is the cheapest one: no clock reads at each node. In this case the
+ * time-weighted error is calculated in proportion to the node's cost.
+ */
+typedef enum
+{
+	TRACK_INSTR_ROWS,
+	TRACK_INSTR_ROWS_TIMING,
+	TRACK_INSTR_FULL,
+} TrackInstrumentation;
+
+static const struct config_enum_entry instrumentation_options[] = {
+	{"rows", TRACK_INSTR_ROWS, false},
+	{"rows_timing", TRACK_INSTR_ROWS_TIMING, false},
+	{"full", TRACK_INSTR_FULL, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Which entries to throw away when the hash table reaches the memory limit.
+ * 'harm' evicts entries with the lowest time spent in badly estimated plans
+ * (error_time), 'lru' - the least recently executed ones.
+ */
+typedef enum
+{
+	TRACK_EVICT_NONE,
+	TRACK_EVICT_LRU,
+	TRACK_EVICT_HARM,
+} TrackEviction;
+
+static const struct config_enum_entry eviction_options[] = {
+	{"none", TRACK_EVICT_NONE, false},
+	{"lru", TRACK_EVICT_LRU, false},
+	{"harm", TRACK_EVICT_HARM, false},
+	{NULL, 0, false}
+};
+
+/*
+ * How to log plans of badly estimated queries. 'async' passes the plan to the
+ * background worker through a ring buffer, so the backend doesn't wait for
+ * the log writing.
+ */
+typedef enum
+{
+	TRACK_LOG_SYNC,
+	TRACK_LOG_ASYNC,
+} TrackLogMode;
+
+static const struct config_enum_entry log_mode_options[] = {
+	{"sync", TRACK_LOG_SYNC, false},
+	{"async", TRACK_LOG_ASYNC, false},
+	{NULL, 0, false}
+};
+
 static int track_mode = TRACK_MODE_DISABLED;
 static double log_min_error = -1.0;
+static int log_mode = TRACK_LOG_SYNC;
+static int log_min_interval = 0;
+static double plan_min_error = -1.0;
 static int hash_mem = 4096;
+static int eviction = TRACK_EVICT_HARM;
+static int instrumentation = TRACK_INSTR_ROWS_TIMING;
+static double sample_rate = 1.0;
+static int adaptive_sample_limit = 0;
+static int batch_size = 0;
+static int batch_timeout = 1000;
+static int flush_interval = 0;
+static int flush_dirty_entries = 0;
+static int window_interval = 300;
+static int text_mem = 4096;
+static bool compress_texts = true;
+static bool normalize_texts = false;
+static bool node_histograms = true;
+static bool track_nested = true;
+static bool stats_advice = true;
+static bool relation_stats = true;
+static bool self_instrumentation = false;
+static int append_children_limit = 0;
+static int max_nodes = 0;
+static bool aggregate_partitions = false;
+static int detail_entries = 0;
+static double log_min_error_quantile = 0.;
+static int log_target_rate = 0;
+
+/* Custom wait events, registered at the attachment to the shared memory */
+static uint32 track_wait_hash = PG_WAIT_EXTENSION;
+static uint32 track_wait_flush = PG_WAIT_EXTENSION;
+static uint32 track_wait_main = PG_WAIT_EXTENSION;
+
+/* Phase being measured or -1 */
+static int current_phase = -1;
+
+/* The background worker loads the disk storage */
+static bool worker_registered = false;
 
 void _PG_init(void);
+PGDLLEXPORT void track_worker_main(Datum main_arg);
 
-static double track_prediction_estimation(PlanState *pstate, double totaltime, ScourContext *ctx);
+static double track_prediction_estimation(PlanState *pstate, double totaltime,
+										  bool use_timing, ScourContext *ctx);
 static void to_init_shmem(void *ptr);
-static bool _load_hash_table(TODSMRegistry *state);
 static bool _flush_hash_table(void);
+static void track_load_storage(void);
+static void track_load_fallback(void);
+static void track_wait_load(void);
+static bool track_reserve_memory(uint64 size);
+static void _free_entry_detail(DSMOptimizerTrackerEntry *entry);
+static bool detail_wanted(TrackQueryState *state);
+static void _store_detail(TrackQueryState *state, ScourContext *ctx);
+static void track_detail_refresh(void);
+static bool track_write_storage(bool compact);
+static void _merge_advice(HTAB *advice);
+static void track_request_gc(void);
+static void track_gc(void);
+
+static inline void
+rstats_init(RStats *stats)
+{
+	memset(stats, 0, sizeof(RStats));
+}
 
 /*
- * Using DSM for shared memory segments we need to check attachment at each
- * point where we are going to use it.
+ * Add a value into the aggregate. O(1), so it may be done under the partition
+ * lock of the hash table.
  */
-static void
-track_attach_shmem(void)
+static inline void
+rstats_add(RStats *stats, double value, double weight)
 {
-	bool			found;
-	MemoryContext	mctx;
-
-	if (htab != NULL)
-		return;
-
-	mctx = MemoryContextSwitchTo(TopMemoryContext);
+	double	delta;
 
-	shared = GetNamedDSMSegment("pg_track_optimizer",
-								   sizeof(TODSMRegistry),
-								   to_init_shmem,
-								   &found);
+	Assert(weight > 0.);
 
-	if (found)
+	if (stats->weight <= 0.)
 	{
-		Assert(shared->dshh != DSHASH_HANDLE_INVALID);
-
-		htab_dsa = dsa_attach(shared->dsah);
-		/* Attach to existed hash table */
-		htab = dshash_attach(htab_dsa, &dsh_params, shared->dshh, NULL);
+		stats->weight = weight;
+		stats->mean = value;
+		stats->m2 = 0.;
+		stats->min = value;
+		stats->max = value;
+		return;
 	}
 
-	dsa_pin_mapping(htab_dsa);
-	MemoryContextSwitchTo(mctx);
+	stats->weight += weight;
+	delta = value - stats->mean;
+	stats->mean += delta * weight / stats->weight;
+	stats->m2 += weight * delta * (value - stats->mean);
+
+	if (value < stats->min)
+		stats->min = value;
+	if (value > stats->max)
+		stats->max = value;
 }
 
 /*
- * Here we need it to enable instrumentation.
+ * Combine two aggregates (Chan et al. parallel variant of the algorithm).
  */
-static void
-explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
+static inline void
+rstats_merge(RStats *dst, const RStats *src)
 {
-	track_attach_shmem();
-
-	if (track_optimizer_enabled(eflags))
-		queryDesc->instrument_options |= INSTRUMENT_TIMER | INSTRUMENT_ROWS;
-
-	if (prev_ExecutorStart)
-		prev_ExecutorStart(queryDesc, eflags);
-	else
-		standard_ExecutorStart(queryDesc, eflags);
+	double	weight;
+	double	delta;
 
-	if (!track_optimizer_enabled(eflags))
+	if (src->weight <= 0.)
 		return;
 
-	/*
-	 * Set up to track total elapsed time in ExecutorRun.  Make sure the
-	 * space is allocated in the per-query context so it will go away at
-	 * ExecutorEnd.
-	 */
-	if (queryDesc->totaltime == NULL)
+	if (dst->weight <= 0.)
 	{
-		MemoryContext oldcxt;
-
-		oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
-		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
-		MemoryContextSwitchTo(oldcxt);
+		*dst = *src;
+		return;
 	}
+
+	weight = dst->weight + src->weight;
+	delta = src->mean - dst->mean;
+	dst->mean += delta * src->weight / weight;
+	dst->m2 += src->m2 + delta * delta * dst->weight * src->weight / weight;
+	dst->weight = weight;
+
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
 }
 
-/*
- * Copy-paste from auto_explain code
- */
-static void
-_explain_statement(QueryDesc *queryDesc, double normalized_error)
+static inline double
+rstats_stddev(RStats *stats)
 {
-	ExplainState   *es = NewExplainState();
-	double			msec;
-
-	if (log_min_error < 0 || normalized_error < log_min_error)
-		return;
-
-	msec = queryDesc->totaltime->total * 1000.0;
-
-	/*
-	 * We triggered by an estimation error. So, show only the options which
-	 * can be useful to determine possible solution.
-	 */
-	es->analyze = (queryDesc->instrument_options);
-	es->verbose = false;
-	es->buffers = false;
-	es->wal = false;
-	es->timing = true;
-	es->summary = true;
-	es->format = EXPLAIN_FORMAT_TEXT;
-	es->settings = true;
+	Assert(stats->weight > 0.);
 
-	ExplainBeginOutput(es);
-	ExplainQueryText(es, queryDesc);
-	ExplainPrintPlan(es, queryDesc);
-	ExplainEndOutput(es);
+	return (stats->m2 > 0.) ? sqrt(stats->m2 / stats->weight) : 0.;
+}
 
-	/* Remove last line break */
-	if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
-		es->str->data[--es->str->len] = '\0';
+static void
+tracker_stats_init(TrackerStats *stats)
+{
+	rstats_init(&stats->relative_error);
+	rstats_init(&stats->error2);
+	rstats_init(&stats->exec_time);
+	stats->error_time = 0.;
+	stats->assessed_nodes = 0;
+	stats->total_nodes = 0;
+	stats->nexecs = 0;
+	stats->est_nexecs = 0.;
+	stats->last_exec = 0;
+	stats->worker_skew = 0.;
+	stats->worker_time_skew = 0.;
+	stats->workers_short = 0;
+	stats->parts_scanned = 0;
+	stats->parts_pruned = 0;
+}
 
-	/*
-	 * Note: we rely on the existing logging of context or
-	 * debug_query_string to identify just which statement is being
-	 * reported.  This isn't ideal but trying to do it here would
-	 * often result in duplication.
-	 */
-	ereport(LOG,
-			(errmsg("duration: %.3f ms, relative error: %.4lf, plan:\n%s",
-					msec, normalized_error, es->str->data),
-			 errhidestmt(true)));
+static void
+tracker_stats_merge(TrackerStats *dst, const TrackerStats *src)
+{
+	rstats_merge(&dst->relative_error, &src->relative_error);
+	rstats_merge(&dst->error2, &src->error2);
+	rstats_merge(&dst->exec_time, &src->exec_time);
+	dst->error_time += src->error_time;
+	dst->nexecs += src->nexecs;
+	dst->est_nexecs += src->est_nexecs;
+	dst->worker_skew = Max(dst->worker_skew, src->worker_skew);
+	dst->worker_time_skew = Max(dst->worker_time_skew, src->worker_time_skew);
+	dst->workers_short += src->workers_short;
+
+	/* Node counters describe the last execution */
+	if (src->last_exec >= dst->last_exec)
+	{
+		dst->assessed_nodes = src->assessed_nodes;
+		dst->total_nodes = src->total_nodes;
+		dst->parts_scanned = src->parts_scanned;
+		dst->parts_pruned = src->parts_pruned;
+		dst->last_exec = src->last_exec;
+	}
 }
 
 /*
- * Returns false if memory limit was exceeded.
+ * Was the entry of the generation reset?
  */
-static bool
-store_data(QueryDesc *queryDesc, double normalized_error, ScourContext *ctx)
+static inline bool
+entry_is_stale(uint32 generation)
 {
-	DSMOptimizerTrackerEntry   *entry;
-	DSMOptimizerTrackerKey		key;
-	bool						found;
-	uint32						counter;
+	return generation != pg_atomic_read_u32(&shared->generation);
+}
 
-	Assert(htab != NULL && queryDesc->plannedstmt->queryId != UINT64CONST(0));
+static inline uint32
+window_epoch(TimestampTz ts)
+{
+	return (uint32) (ts / ((int64) window_interval * USECS_PER_SEC));
+}
 
-	if (!(normalized_error >= log_min_error || track_mode == TRACK_MODE_FORCED))
-		return false;
+/*
+ * Add statistics into the time bucket of their last execution. A batch of
+ * executions merged at once goes into one bucket: the batch timeout is much
+ * less than a bucket.
+ */
+static void
+window_add(WindowBucket *window, const TrackerStats *stats)
+{
+	uint32			epoch = window_epoch(stats->last_exec);
+	WindowBucket   *bucket = &window[epoch % WINDOW_NBUCKETS];
 
-	counter = pg_atomic_read_u32(&shared->htab_counter);
+	if (bucket->epoch != epoch)
+	{
+		memset(bucket, 0, sizeof(WindowBucket));
+		bucket->epoch = epoch;
+	}
 
-	if (counter == UINT32_MAX ||
-		counter * sizeof(DSMOptimizerTrackerEntry) > hash_mem)
-		/* TODO: set status of full hash table */
-		return false;
+	bucket->nexecs += stats->nexecs;
+	bucket->est_nexecs += stats->est_nexecs;
+	bucket->error_weight += stats->relative_error.weight;
+	bucket->error_sum += stats->relative_error.mean *
+												stats->relative_error.weight;
+	bucket->exec_time += stats->exec_time.mean * stats->exec_time.weight;
+	bucket->error_time += stats->error_time;
+}
 
-	memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
-	key.dbOid = MyDatabaseId;
-	key.queryId = queryDesc->plannedstmt->queryId;
-	entry = dshash_find_or_insert(htab, &key, &found);
-	entry->relative_error = normalized_error;
-	entry->error2 = ctx->error2;
-	entry->assessed_nodes = ctx->nnodes;
-	entry->total_nodes = ctx->counter;
-	entry->exec_time = ctx->totaltime;
+/*
+ * Merge buckets of another copy of the entry. Buckets of the same epoch are
+ * summed, otherwise the later one wins.
+ */
+static void
+window_merge(WindowBucket *dst, const WindowBucket *src)
+{
+	int		i;
 
-	if (!found)
+	for (i = 0; i < WINDOW_NBUCKETS; i++)
 	{
-		size_t	len = strlen(queryDesc->sourceText);
-		char   *strptr;
+		if (src[i].nexecs == 0 || src[i].epoch < dst[i].epoch)
+			continue;
 
-		/* Put the query string into the shared memory too */
-		entry->querytext_ptr = dsa_allocate0(htab_dsa, len + 1);
-		Assert(DsaPointerIsValid(entry->querytext_ptr));
-		strptr = (char *) dsa_get_address(htab_dsa, entry->querytext_ptr);
-		strlcpy(strptr, queryDesc->sourceText, len);
+		if (src[i].epoch > dst[i].epoch || dst[i].nexecs == 0)
+		{
+			dst[i] = src[i];
+			continue;
+		}
 
-		entry->nexecs = 0;
-		pg_atomic_fetch_add_u32(&shared->htab_counter, 1);
+		dst[i].nexecs += src[i].nexecs;
+		dst[i].est_nexecs += src[i].est_nexecs;
+		dst[i].error_weight += src[i].error_weight;
+		dst[i].error_sum += src[i].error_sum;
+		dst[i].exec_time += src[i].exec_time;
+		dst[i].error_time += src[i].error_time;
 	}
+}
 
-	entry->nexecs++;
+/* -----------------------------------------------------------------------------
+ *
+ * Self-instrumentation
+ *
+ * -------------------------------------------------------------------------- */
 
-	dshash_release_lock(htab, entry);
+typedef struct PhaseTimer
+{
+	instr_time	start; /* Zero, if not measured */
+	int			prev_phase;
+} PhaseTimer;
 
-	return true;
+static inline void
+phase_begin(TrackPhase phase, PhaseTimer *timer)
+{
+	timer->prev_phase = current_phase;
+	if (!self_instrumentation || shared == NULL)
+	{
+		INSTR_TIME_SET_ZERO(timer->start);
+		return;
+	}
+
+	current_phase = phase;
+	INSTR_TIME_SET_CURRENT(timer->start);
 }
 
-static void
-track_ExecutorEnd(QueryDesc *queryDesc)
+static inline void
+phase_end(PhaseTimer *timer)
 {
-	MemoryContext	oldcxt;
-	double			normalized_error = -1.0;
-	ScourContext	ctx;
+	instr_time	duration;
 
-	track_attach_shmem();
-
-	if (!queryDesc->totaltime ||
-		!track_optimizer_enabled(queryDesc->estate->es_top_eflags) ||
-		queryDesc->plannedstmt->queryId == 0)
-		/*
-		 * Just to remember: a stranger extension can decide somewhere in the
-		 * middle to change queryId, eflags or another global variable. So,
-		 * trust only local variables and check the state whenever possible.
-		 */
-		goto end;
+	if (INSTR_TIME_IS_ZERO(timer->start))
+		return;
 
-	/* TODO: need shared state 'status' instead of assertions */
-	Assert(queryDesc->planstate->instrument &&
-			queryDesc->instrument_options & INSTRUMENT_TIMER &&
-			queryDesc->instrument_options & INSTRUMENT_ROWS);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, timer->start);
 
-	/*
-	 * Make sure we operate in the per-query context, so any cruft will be
-	 * discarded later during ExecutorEnd.
-	 */
-	oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+	Assert(current_phase >= 0 && current_phase < TRACK_PHASE_COUNT);
+	pg_atomic_fetch_add_u64(&shared->phase_stats[current_phase].calls, 1);
+	pg_atomic_fetch_add_u64(&shared->phase_stats[current_phase].time,
+							INSTR_TIME_GET_NANOSEC(duration));
+	current_phase = timer->prev_phase;
+}
 
-	/*
-	 * Make sure stats accumulation is done.  (Note: it's okay if several
-	 * levels of hook all do this.)
-	 */
-	InstrEndLoop(queryDesc->totaltime);
+/*
+ * An error thrown in the middle of a phase skips its phase_end: forget the
+ * phase, otherwise lock waits of the next queries are accounted to it.
+ */
+static void
+track_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		current_phase = -1;
+}
 
-	normalized_error = track_prediction_estimation(queryDesc->planstate,
-												   queryDesc->totaltime->total,
-												   &ctx);
+/*
+ * Lookups of the shared table are reported as a custom wait event. Note, if
+ * the backend actually sleeps on the partition lock, the LWLock wait event
+ * replaces it.
+ */
+static inline void
+lock_wait_begin(instr_time *start)
+{
+	pgstat_report_wait_start(track_wait_hash);
+	if (current_phase >= 0)
+		INSTR_TIME_SET_CURRENT(*start);
+}
 
-	/*
-	 * Store data in the hash table and/or print it to the log. Decision on what
-	 * to do each routine makes individually.
-	 */
-	store_data(queryDesc, normalized_error, &ctx);
-	_explain_statement(queryDesc, normalized_error);
+static inline void
+lock_wait_end(instr_time *start)
+{
+	instr_time	duration;
 
-	MemoryContextSwitchTo(oldcxt);
+	pgstat_report_wait_end();
+	if (current_phase < 0)
+		return;
 
-end:
-	if (prev_ExecutorEnd)
-		prev_ExecutorEnd(queryDesc);
-	else
-		standard_ExecutorEnd(queryDesc);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, *start);
+	pg_atomic_fetch_add_u64(&shared->phase_stats[current_phase].lock_calls, 1);
+	pg_atomic_fetch_add_u64(&shared->phase_stats[current_phase].lock_time,
+							INSTR_TIME_GET_NANOSEC(duration));
 }
 
 /*
- * First-time initialization code. Secured by the lock on DSM registry.
+ * Using DSM for shared memory segments we need to check attachment at each
+ * point where we are going to use it.
  */
 static void
-to_init_shmem(void *ptr)
+track_attach_shmem(void)
 {
-	TODSMRegistry	   *state = (TODSMRegistry *) ptr;
-	int					tranche_id; /* dshash tranche */
+	bool			found;
+	MemoryContext	mctx;
 
-	Assert(htab_dsa == NULL && htab == NULL);
+	if (htab != NULL)
+		return;
 
-	LWLockInitialize(&state->lock, LWLockNewTrancheId());
+	mctx = MemoryContextSwitchTo(TopMemoryContext);
 
-	tranche_id = LWLockNewTrancheId();
-	LWLockRegisterTranche(tranche_id, "pg_track_optimizer_tranche");
-	htab_dsa = dsa_create(tranche_id);
-	state->dsah = dsa_get_handle(htab_dsa);
-	dsa_pin(htab_dsa);
+	shared = GetNamedDSMSegment("pg_track_optimizer",
+								   sizeof(TODSMRegistry),
+								   to_init_shmem,
+								   &found);
 
-	htab = dshash_create(htab_dsa, &dsh_params, 0);
-	state->dshh = dshash_get_hash_table_handle(htab);
-	pg_atomic_init_u32(&state->htab_counter, 0);
+	if (found)
+	{
+		Assert(shared->dshh != DSHASH_HANDLE_INVALID);
 
-	(void) _load_hash_table(state);
+		htab_dsa = dsa_attach(shared->dsah);
+		/* Attach to existed hash table */
+		htab = dshash_attach(htab_dsa, &dsh_params, shared->dshh, NULL);
+		txt_htab = dshash_attach(htab_dsa, &txt_params, shared->txt_dshh, NULL);
+		node_htab = dshash_attach(htab_dsa, &node_params, shared->node_dshh, NULL);
+		plan_htab = dshash_attach(htab_dsa, &plan_params, shared->plan_dshh, NULL);
+		advice_htab = dshash_attach(htab_dsa, &advice_params, shared->advice_dshh, NULL);
+		relation_htab = dshash_attach(htab_dsa, &relation_params, shared->relation_dshh, NULL);
+	}
+
+	dsa_pin_mapping(htab_dsa);
+
+	track_wait_hash = WaitEventExtensionNew("PgTrackOptimizerHash");
+	track_wait_flush = WaitEventExtensionNew("PgTrackOptimizerFlush");
+	track_wait_main = WaitEventExtensionNew("PgTrackOptimizerMain");
+	MemoryContextSwitchTo(mctx);
 }
 
-void
-_PG_init(void)
+/* -----------------------------------------------------------------------------
+ *
+ * Adaptive threshold
+ *
+ * -------------------------------------------------------------------------- */
+
+static inline bool
+adaptive_enabled(void)
 {
-	/*
-	 * Inform the postmaster that we want to enable query_id calculation if
-	 * compute_query_id is set to auto.
-	 */
-	EnableQueryId();
+	return log_min_error_quantile > 0. || log_target_rate > 0;
+}
 
-	DefineCustomEnumVariable("pg_track_optimizer.mode",
-							 "Mode of the extension usage.",
-							 NULL,
-							 &track_mode,
-							 TRACK_MODE_DISABLED,
-							 format_options,
-							 PGC_SUSET,
-							 0,
-							 NULL,
-							 NULL,
-							 NULL);
+static inline int
+sketch_index(double value)
+{
+	double	idx;
 
-	DefineCustomRealVariable("pg_track_optimizer.log_min_error",
-							 "Sets the minimum planning error above which plans will be logged.",
-							 "Zero prints all plans. -1 turns this feature off.",
-							 &log_min_error,
-							 -1.0,
-							 -1.0, INT_MAX, /* Looks like so huge error, as INT_MAX don't make a sense */
-							 PGC_SUSET,
-							 0,
-							 NULL,
-							 NULL,
-							 NULL);
+	if (value < SKETCH_MIN_VALUE)
+		return 0;
 
-	DefineCustomIntVariable("pg_track_optimizer.hash_mem",
-							"Max size of DSM memory allocated to hash table",
-							NULL,
-							&hash_mem,
-							4096,
-							0, INT_MAX,
-							PGC_SUSET,
-							GUC_UNIT_KB,
-							NULL,
-							NULL,
-							NULL);
+	idx = ceil(log(value / SKETCH_MIN_VALUE) / log(SKETCH_GAMMA)) + 1;
+	return (idx >= SKETCH_NBUCKETS) ? SKETCH_NBUCKETS - 1 : (int) idx;
+}
 
-	MarkGUCPrefixReserved("pg_track_optimizer");
+/*
+ * Value representing the bucket with the relative error (gamma - 1) / 2.
+ */
+static inline double
+sketch_value(int idx)
+{
+	if (idx == 0)
+		return 0.;
 
-	prev_ExecutorStart = ExecutorStart_hook;
-	ExecutorStart_hook = explain_ExecutorStart;
-	prev_ExecutorEnd = ExecutorEnd_hook;
-	ExecutorEnd_hook = track_ExecutorEnd;
+	return SKETCH_MIN_VALUE * pow(SKETCH_GAMMA, idx - 1) * 2. /
+														(1. + SKETCH_GAMMA);
 }
 
-static bool
-prediction_walker(PlanState *pstate, void *context)
+static inline uint32
+sketch_epoch(TimestampTz ts)
 {
-	double			plan_rows,
-					real_rows = 0;
-	ScourContext   *ctx = (ScourContext *) context;
-	double			nloops;
-	int				tmp_counter;
-	double			relative_time;
+	return (uint32) (ts / ((int64) SKETCH_INTERVAL * USECS_PER_SEC));
+}
 
-	/* At first, increment the counter */
-	ctx->counter++;
+/*
+ * Move the locally gathered counts to the shared sketch of the current
+ * interval. The sketch of an interval older than the previous one is cleared
+ * by the first backend noticed that. Concurrent additions may be lost in the
+ * clear: the threshold is an estimation anyway.
+ */
+static void
+sketch_flush_local(TimestampTz now)
+{
+	uint32			epoch = sketch_epoch(now);
+	ErrorSketch	   *sketch = &shared->sketches[epoch % 2];
+	uint32			old_epoch = pg_atomic_read_u32(&sketch->epoch);
+	int				i;
 
-	tmp_counter = ctx->counter;
-	planstate_tree_walker(pstate, prediction_walker, context);
+	if (old_epoch != epoch &&
+		pg_atomic_compare_exchange_u32(&sketch->epoch, &old_epoch, epoch))
+	{
+		pg_atomic_write_u64(&sketch->count, 0);
+		for (i = 0; i < SKETCH_NBUCKETS; i++)
+			pg_atomic_write_u64(&sketch->buckets[i], 0);
+	}
 
-	/*
-	 * Finish the node before an analysis. And only after that we can touch any
-	 * instrument fields.
-	 */
-	InstrEndLoop(pstate->instrument);
-	nloops = pstate->instrument->nloops;
+	for (i = 0; i < sketch_nlocal; i++)
+	{
+		int		idx = sketch_local[i].idx;
 
+		pg_atomic_fetch_add_u64(&sketch->buckets[idx], sketch_local[i].count);
+		pg_atomic_fetch_add_u64(&sketch->count, sketch_local[i].count);
+	}
+	sketch_nlocal = 0;
+}
 
-	if (nloops <= 0.0 || pstate->instrument->total == 0.0)
-		/*
-		 * Skip 'never executed' case or "0-Tuple situation" and the case of
-		 * manual switching off of the timing instrumentation
-		 */
-		return false;
+/*
+ * Recalculate the effective threshold from the sketches of the current and
+ * the previous interval. Only one process does it at a time, at most once per
+ * second.
+ */
+static void
+sketch_refresh_threshold(TimestampTz now)
+{
+	uint32		epoch = sketch_epoch(now);
+	uint64		last = pg_atomic_read_u64(&shared->threshold_refresh);
+	uint64		counts[SKETCH_NBUCKETS];
+	uint64		total = 0;
+	uint64		rank;
+	uint64		sum = 0;
+	double		quantile = 0.;
+	double		threshold;
+	uint32		oldest = epoch;
+	int			i;
+	int			s;
+
+	if (!TimestampDifferenceExceeds((TimestampTz) last, now, 1000) ||
+		!pg_atomic_compare_exchange_u64(&shared->threshold_refresh, &last,
+										(uint64) now))
+		return;
 
-	/*
-	 * Calculate number of rows predicted by the optimizer and really passed
-	 * through the node. This simplistic code becomes a bit tricky in the case
+	memset(counts, 0, sizeof(counts));
+	for (s = 0; s < 2; s++)
+	{
+		ErrorSketch	   *sketch = &shared->sketches[s];
+		uint32			sepoch = pg_atomic_read_u32(&sketch->epoch);
+
+		if (sepoch != epoch && sepoch + 1 != epoch)
+			continue;
+		oldest = Min(oldest, sepoch);
+
+		for (i = 0; i < SKETCH_NBUCKETS; i++)
+		{
+			uint64	count = pg_atomic_read_u64(&sketch->buckets[i]);
+
+			counts[i] += count;
+			total += count;
+		}
+	}
+
+	/* Too few executions to say anything: fall back to log_min_error */
+	if (total < SKETCH_MIN_COUNT)
+	{
+		pg_atomic_write_u64(&shared->adaptive_threshold, PG_UINT64_MAX);
+		return;
+	}
+
+	if (log_min_error_quantile > 0.)
+		quantile = log_min_error_quantile;
+
+	if (log_target_rate > 0)
+	{
+		TimestampTz	start;
+		double		elapsed;
+		double		rate;
+
+		/*
+		 * The sketches cover the previous interval, if there is its sketch,
+		 * and a part of the current one. Nothing was counted before the start.
+		 */
+		start = Max((TimestampTz) oldest * SKETCH_INTERVAL * USECS_PER_SEC,
+					shared->sketch_start);
+		elapsed = (double) (now - start) / USECS_PER_SEC;
+		rate = total * 60. / Max(elapsed, 1.);
+		quantile = Max(quantile, 1. - log_target_rate / rate);
+	}
+
+	quantile = Min(Max(quantile, 0.), 1.);
+	rank = (uint64) ceil(quantile * total);
+	for (i = 0; i < SKETCH_NBUCKETS - 1; i++)
+	{
+		sum += counts[i];
+		if (sum >= rank)
+			break;
+	}
+
+	/* Errors of the bucket and below are not exceeding the threshold */
+	threshold = sketch_value(i + 1);
+	pg_atomic_write_u64(&shared->adaptive_threshold,
+						(uint64) (threshold * THRESHOLD_SCALE));
+}
+
+/*
+ * Move the local counts to the shared memory and recalculate the threshold.
+ */
+static void
+sketch_flush(void)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+
+	sketch_flush_local(now);
+	sketch_local_execs = 0;
+	sketch_refresh_threshold(now);
+}
+
+static void
+sketch_shmem_exit(int code, Datum arg)
+{
+	/* See track_shmem_exit */
+	if (code != 0 || sketch_nlocal == 0)
+		return;
+
+	sketch_flush();
+}
+
+/*
+ * Feed the relative error of the execution to the sketch. Counts are gathered
+ * locally and moved to the shared memory in batches, so backends don't fight
+ * for the cache lines of popular buckets. The batch is also moved by the
+ * flush of the local buffer and at the backend exit.
+ */
+static void
+sketch_add(double error)
+{
+	int			idx = sketch_index(error);
+	int			i;
+
+	if (!sketch_exit_registered)
+	{
+		before_shmem_exit(sketch_shmem_exit, (Datum) 0);
+		sketch_exit_registered = true;
+	}
+
+	for (i = 0; i < sketch_nlocal; i++)
+	{
+		if (sketch_local[i].idx == idx)
+			break;
+	}
+	if (i == sketch_nlocal)
+	{
+		sketch_local[i].idx = idx;
+		sketch_local[i].count = 0;
+		sketch_nlocal++;
+	}
+	sketch_local[i].count++;
+	sketch_local_execs++;
+
+	if (sketch_nlocal < SKETCH_LOCAL_SLOTS &&
+		sketch_local_execs < SKETCH_LOCAL_EXECS)
+		return;
+
+	sketch_flush();
+}
+
+/*
+ * log_min_error to be used by the query: in adaptive mode, the threshold
+ * derived from the recent distribution of errors; log_min_error works as its
+ * lower bound then.
+ */
+static double
+track_log_min_error(void)
+{
+	uint64		threshold;
+	TimestampTz	refreshed;
+
+	if (!adaptive_enabled())
+		return log_min_error;
+
+	track_attach_shmem();
+	threshold = pg_atomic_read_u64(&shared->adaptive_threshold);
+	refreshed = (TimestampTz) pg_atomic_read_u64(&shared->threshold_refresh);
+
+	/*
+	 * Isn't calculated yet or is too old: nobody has fed the sketch for two
+	 * intervals. Without log_min_error admit nothing then: executions only
+	 * feed the sketch until it can tell the threshold.
+	 */
+	if (threshold == PG_UINT64_MAX ||
+		TimestampDifferenceExceeds(refreshed,
+								   GetCurrentStatementStartTimestamp(),
+								   2 * SKETCH_INTERVAL * 1000))
+		return (log_min_error >= 0.) ? log_min_error : get_float8_infinity();
+
+	return Max(log_min_error, threshold / THRESHOLD_SCALE);
+}
+
+/* -----------------------------------------------------------------------------
+ *
+ * Query text store
+ *
+ * -------------------------------------------------------------------------- */
+
+/*
+ * Free all the texts nobody references anymore.
+ */
+static void
+text_store_gc(void)
+{
+	dshash_seq_status	stat;
+	QueryTextEntry	   *tentry;
+	uint64				freed = 0;
+
+	dshash_seq_init(&stat, txt_htab, true);
+	while ((tentry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (tentry->refcount > 0)
+			continue;
+
+		dsa_free(htab_dsa, tentry->data);
+		freed += TEXT_MEM_SIZE(tentry->stored_len);
+		dshash_delete_current(&stat);
+	}
+	dshash_seq_term(&stat);
+
+	pg_atomic_fetch_sub_u64(&shared->txt_mem_used, freed);
+}
+
+/*
+ * Reserve memory for a new text. At the limit, the garbage is collected later,
+ * see track_request_gc: the writer doesn't wait for the pass over the store.
+ */
+static bool
+text_store_reserve(uint64 size)
+{
+	uint64	limit = (uint64) text_mem * 1024;
+	uint64	used = pg_atomic_fetch_add_u64(&shared->txt_mem_used, size);
+
+	if (used + size <= limit)
+		return true;
+	pg_atomic_fetch_sub_u64(&shared->txt_mem_used, size);
+
+	track_request_gc();
+	return false;
+}
+
+/*
+ * Copy the text out of the store into the palloc'ed buffer.
+ * Caller should hold lock on the text entry.
+ */
+static char *
+text_store_copy(QueryTextEntry *tentry)
+{
+	char   *data = (char *) dsa_get_address(htab_dsa, tentry->data);
+	char   *str = palloc(tentry->len + 1);
+
+	if (tentry->stored_len < tentry->len)
+	{
+		if (pglz_decompress(data, tentry->stored_len, str, tentry->len,
+							true) != tentry->len)
+			elog(ERROR, "[%s] compressed query text is corrupted",
+				 "pg_track_optimizer");
+	}
+	else
+		memcpy(str, data, tentry->len);
+
+	str[tentry->len] = '\0';
+	return str;
+}
+
+static bool
+text_store_equal(QueryTextEntry *tentry, const char *text, int len)
+{
+	char   *str;
+	bool	result;
+
+	if (tentry->len != len)
+		return false;
+
+	if (tentry->stored_len == tentry->len)
+		return memcmp(dsa_get_address(htab_dsa, tentry->data), text, len) == 0;
+
+	str = text_store_copy(tentry);
+	result = (memcmp(str, text, len) == 0);
+	pfree(str);
+	return result;
+}
+
+/*
+ * Get a reference to the text in the store: find the existing copy or add a
+ * new one. Returns 0 if the text memory limit doesn't allow to store it.
+ */
+static uint64
+text_store_add(const char *text, int len)
+{
+	uint64			textid;
+	char		   *compressed = NULL;
+	int32			stored_len = len;
+	int				probe;
+
+	textid = hash_bytes_extended((const unsigned char *) text, len, 0);
+
+	for (probe = 0; probe < TEXT_MAX_PROBES; probe++, textid++)
+	{
+		QueryTextEntry *tentry;
+		bool			found;
+
+		/* Zero is reserved for the 'no text' case */
+		if (textid == UINT64CONST(0))
+			textid++;
+
+		tentry = dshash_find(txt_htab, &textid, true);
+		if (tentry != NULL)
+		{
+			bool	equal = text_store_equal(tentry, text, len);
+
+			if (equal)
+				tentry->refcount++;
+			dshash_release_lock(txt_htab, tentry);
+
+			if (equal)
+			{
+				if (compressed)
+					pfree(compressed);
+				return textid;
+			}
+
+			/* Collision. Probe next value */
+			continue;
+		}
+
+		/* New text. Compress it before taking an exclusive lock. */
+		if (compressed == NULL && compress_texts &&
+			len >= TEXT_COMPRESS_MIN_LEN)
+		{
+			compressed = palloc(PGLZ_MAX_OUTPUT(len));
+			stored_len = pglz_compress(text, len, compressed,
+									   PGLZ_strategy_default);
+			if (stored_len < 0)
+				/* Incompressible data. Store it as is. */
+				stored_len = len;
+		}
+
+		if (!text_store_reserve(TEXT_MEM_SIZE(stored_len)))
+			break;
+
+		tentry = dshash_find_or_insert(txt_htab, &textid, &found);
+		if (found)
+		{
+			/* Concurrent insertion */
+			bool	equal = text_store_equal(tentry, text, len);
+
+			if (equal)
+				tentry->refcount++;
+			dshash_release_lock(txt_htab, tentry);
+			pg_atomic_fetch_sub_u64(&shared->txt_mem_used,
+									TEXT_MEM_SIZE(stored_len));
+
+			if (equal)
+			{
+				if (compressed)
+					pfree(compressed);
+				return textid;
+			}
+			continue;
+		}
+
+		tentry->data = dsa_allocate_extended(htab_dsa, stored_len,
+											 DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(tentry->data))
+		{
+			dshash_delete_entry(txt_htab, tentry);
+			pg_atomic_fetch_sub_u64(&shared->txt_mem_used,
+									TEXT_MEM_SIZE(stored_len));
+			break;
+		}
+
+		memcpy(dsa_get_address(htab_dsa, tentry->data),
+			   (stored_len < len) ? compressed : text, stored_len);
+		tentry->len = len;
+		tentry->stored_len = stored_len;
+		tentry->refcount = 1;
+		dshash_release_lock(txt_htab, tentry);
+
+		if (compressed)
+			pfree(compressed);
+		return textid;
+	}
+
+	if (compressed)
+		pfree(compressed);
+	return UINT64CONST(0);
+}
+
+/*
+ * Drop the reference to the text. Memory is freed later by the garbage
+ * collector.
+ */
+static void
+text_store_release(uint64 textid)
+{
+	QueryTextEntry *tentry;
+
+	if (textid == UINT64CONST(0))
+		return;
+
+	tentry = dshash_find(txt_htab, &textid, true);
+	if (tentry == NULL)
+		return;
+
+	Assert(tentry->refcount > 0);
+	tentry->refcount--;
+	dshash_release_lock(txt_htab, tentry);
+}
+
+/*
+ * Returns palloc'ed copy of the text or NULL if it isn't stored.
+ */
+static char *
+text_store_get(uint64 textid)
+{
+	QueryTextEntry *tentry;
+	char		   *str;
+
+	if (textid == UINT64CONST(0))
+		return NULL;
+
+	tentry = dshash_find(txt_htab, &textid, false);
+	if (tentry == NULL)
+		return NULL;
+
+	str = text_store_copy(tentry);
+	dshash_release_lock(txt_htab, tentry);
+	return str;
+}
+
+/*
+ * Normalisation of query texts. Copy-paste from the pg_stat_statements code.
+ */
+
+static int
+comp_location(const void *a, const void *b)
+{
+	int			l = ((const LocationLen *) a)->location;
+	int			r = ((const LocationLen *) b)->location;
+
+	return pg_cmp_s32(l, r);
+}
+
+/*
+ * Given a valid SQL string and an array of constant-location records,
+ * fill in the textual lengths of those constants.
+ */
+static void
+fill_in_constant_lengths(JumbleState *jstate, const char *query,
+						 int query_loc)
+{
+	LocationLen *locs;
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc;
+	int			last_loc = -1;
+	int			i;
+
+	/*
+	 * Sort the records by location so that we can process them in order while
+	 * scanning the query text.
+	 */
+	locs = jstate->clocations;
+	if (jstate->clocations_count > 1)
+		qsort(locs, jstate->clocations_count,
+			  sizeof(LocationLen), comp_location);
+
+	/* initialize the flex scanner --- should match raw_parser() */
+	yyscanner = scanner_init(query,
+							 &yyextra,
+							 &ScanKeywords,
+							 ScanKeywordTokens);
+
+	/* we don't want to re-emit any escape string warnings */
+	yyextra.escape_string_warning = false;
+
+	/* Search for each constant, in sequence */
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			loc = locs[i].location;
+		int			tok;
+
+		/* Adjust recorded location if we're dealing with partial string */
+		loc -= query_loc;
+
+		Assert(loc >= 0);
+
+		if (loc <= last_loc)
+		{
+			locs[i].length = -1;	/* duplicate */
+			continue;
+		}
+
+		/* Lex tokens until we find the desired constant */
+		for (;;)
+		{
+			tok = core_yylex(&yylval, &yylloc, yyscanner);
+
+			/* We should not hit end-of-string, but if we do, behave sanely */
+			if (tok == 0)
+				break;			/* out of inner for-loop */
+
+			/*
+			 * We should find the token position exactly, but if we somehow
+			 * run past it, work with that.
+			 */
+			if (yylloc >= loc)
+			{
+				if (query[loc] == '-')
+				{
+					/*
+					 * It's a negative value - this is the one and only case
+					 * where we replace more than a single token.
+					 */
+					tok = core_yylex(&yylval, &yylloc, yyscanner);
+					if (tok == 0)
+						break;	/* out of inner for-loop */
+				}
+
+				/*
+				 * We now rely on the assumption that flex has placed a zero
+				 * byte after the text of the current token in scanbuf.
+				 */
+				locs[i].length = strlen(yyextra.scanbuf + loc);
+				break;			/* out of inner for-loop */
+			}
+		}
+
+		/* If we hit end-of-string, give up, leaving remaining lengths -1 */
+		if (tok == 0)
+			break;
+
+		last_loc = loc;
+	}
+
+	scanner_finish(yyscanner);
+}
+
+/*
+ * Generate a normalized version of the query string that will be used to
+ * represent all similar queries: constants are replaced by $n symbols.
+ */
+static char *
+generate_normalized_query(JumbleState *jstate, const char *query,
+						  int query_loc, int *query_len_p)
+{
+	char	   *norm_query;
+	int			query_len = *query_len_p;
+	int			i,
+				norm_query_buflen,	/* Space allowed for norm_query */
+				len_to_wrt,		/* Length (in bytes) to write */
+				quer_loc = 0,	/* Source query byte location */
+				n_quer_loc = 0, /* Normalized query byte location */
+				last_off = 0,	/* Offset from start for previous tok */
+				last_tok_len = 0;	/* Length (in bytes) of that tok */
+
+	/*
+	 * Get constants' lengths (core system only gives us locations).  Note
+	 * this also ensures the items are sorted by location.
+	 */
+	fill_in_constant_lengths(jstate, query, query_loc);
+
+	/* Allow for $n symbols to be longer than the constants they replace */
+	norm_query_buflen = query_len + jstate->clocations_count * 10;
+	norm_query = palloc(norm_query_buflen + 1);
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int			off,		/* Offset from start for cur tok */
+					tok_len;	/* Length (in bytes) of that tok */
+
+		off = jstate->clocations[i].location;
+		/* Adjust recorded location if we're dealing with partial string */
+		off -= query_loc;
+
+		tok_len = jstate->clocations[i].length;
+
+		if (tok_len < 0)
+			continue;			/* ignore any duplicates */
+
+		/* Copy next chunk (what precedes the next constant) */
+		len_to_wrt = off - last_off;
+		len_to_wrt -= last_tok_len;
+
+		Assert(len_to_wrt >= 0);
+		memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+		n_quer_loc += len_to_wrt;
+
+		/* And insert a param symbol in place of the constant token */
+		n_quer_loc += sprintf(norm_query + n_quer_loc, "$%d",
+							  i + 1 + jstate->highest_extern_param_id);
+
+		quer_loc = off + tok_len;
+		last_off = off;
+		last_tok_len = tok_len;
+	}
+
+	/*
+	 * We've copied up until the last ignorable constant.  Copy over the
+	 * remaining bytes of the original query string.
+	 */
+	len_to_wrt = query_len - quer_loc;
+
+	Assert(len_to_wrt >= 0);
+	memcpy(norm_query + n_quer_loc, query + quer_loc, len_to_wrt);
+	n_quer_loc += len_to_wrt;
+
+	Assert(n_quer_loc <= norm_query_buflen);
+	norm_query[n_quer_loc] = '\0';
+
+	*query_len_p = n_quer_loc;
+	return norm_query;
+}
+
+/*
+ * The jumble state with locations of constants is available at the parse
+ * analysis stage only. Normalise the text here and remember it until the end of
+ * execution.
+ */
+static void
+track_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
+{
+	if (prev_post_parse_analyze_hook)
+		prev_post_parse_analyze_hook(pstate, query, jstate);
+
+	if (normalize_texts && track_mode != TRACK_MODE_DISABLED &&
+		jstate != NULL && jstate->clocations_count > 0 &&
+		query->queryId != UINT64CONST(0) && pstate->p_sourcetext != NULL)
+	{
+		NormalizedTextEntry	   *nentry;
+		const char			   *text;
+		int						location = query->stmt_location;
+		int						len = query->stmt_len;
+		bool					found;
+		char				   *norm;
+
+		if (normalized_texts == NULL ||
+			hash_get_num_entries(normalized_texts) >= NORMALIZED_CACHE_SIZE)
+		{
+			HASHCTL		ctl;
+
+			/* Simplistic limit on memory: just drop the whole cache */
+			if (normalized_cxt == NULL)
+				normalized_cxt = AllocSetContextCreate(TopMemoryContext,
+													   "pg_track_optimizer normalized texts",
+													   ALLOCSET_DEFAULT_SIZES);
+			else
+				MemoryContextReset(normalized_cxt);
+
+			ctl.keysize = sizeof(uint64);
+			ctl.entrysize = sizeof(NormalizedTextEntry);
+			ctl.hcxt = normalized_cxt;
+			normalized_texts = hash_create("pg_track_optimizer normalized texts",
+										   64, &ctl,
+										   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		}
+
+		if (hash_search(normalized_texts, &query->queryId,
+						HASH_FIND, NULL) != NULL)
+			return;
+
+		/* Don't insert the entry before the text is ready */
+		text = CleanQuerytext(pstate->p_sourcetext, &location, &len);
+		norm = generate_normalized_query(jstate, text, location, &len);
+
+		nentry = (NormalizedTextEntry *) hash_search(normalized_texts,
+													 &query->queryId,
+													 HASH_ENTER, &found);
+		nentry->text = MemoryContextAlloc(normalized_cxt, len + 1);
+		memcpy(nentry->text, norm, len);
+		nentry->text[len] = '\0';
+		nentry->len = len;
+		pfree(norm);
+	}
+}
+
+/*
+ * Find text of the statement to be stored: normalised one, if it was prepared
+ * at the parse analysis, or a part of the source text, related to the
+ * statement.
+ */
+static const char *
+track_query_text(QueryDesc *queryDesc, int *len)
+{
+	int		location = queryDesc->plannedstmt->stmt_location;
+
+	if (normalized_texts != NULL)
+	{
+		NormalizedTextEntry *nentry;
+
+		nentry = (NormalizedTextEntry *) hash_search(normalized_texts,
+											&queryDesc->plannedstmt->queryId,
+											HASH_FIND, NULL);
+		if (nentry != NULL)
+		{
+			*len = nentry->len;
+			return nentry->text;
+		}
+	}
+
+	*len = queryDesc->plannedstmt->stmt_len;
+	return CleanQuerytext(queryDesc->sourceText, &location, len);
+}
+
+/*
+ * Can the query be tracked at all? Cheapest checks go first, so the disabled
+ * mode costs almost nothing.
+ */
+static inline bool
+track_query_eligible(QueryDesc *queryDesc, int eflags)
+{
+	return track_mode != TRACK_MODE_DISABLED &&
+		(log_min_error >= 0. || track_mode == TRACK_MODE_FORCED ||
+		 adaptive_enabled()) &&
+		(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+		queryDesc->plannedstmt->utilityStmt == NULL &&
+		queryDesc->plannedstmt->queryId != UINT64CONST(0) &&
+		(nesting_level == 0 || track_nested) &&
+		IsQueryIdEnabled() && !IsParallelWorker();
+}
+
+/*
+ * Decide whether to sample this execution.
+ * Returns the probability the query has been sampled with or zero if it should
+ * be skipped. In adaptive mode the probability decreases proportionally to the
+ * number of samples already gathered for this queryId in the hash table.
+ */
+static double
+track_sample_query(QueryDesc *queryDesc)
+{
+	double	dice;
+	double	probability = sample_rate;
+
+	if (sample_rate <= 0.0)
+		return 0.0;
+
+	if (sample_rate >= 1.0 && adaptive_sample_limit <= 0)
+		/* Trivial case, don't waste time on random numbers */
+		return 1.0;
+
+	dice = pg_prng_double(&pg_global_prng_state);
+	if (dice >= probability)
+		return 0.0;
+
+	if (adaptive_sample_limit > 0 &&
+		queryDesc->plannedstmt->queryId != UINT64CONST(0))
+	{
+		DSMOptimizerTrackerEntry   *entry;
+		DSMOptimizerTrackerKey		key;
+		int64						nexecs = 0;
+
+		track_attach_shmem();
+
+		memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
+		key.dbOid = MyDatabaseId;
+		key.toplevel = (nesting_level == 0);
+		key.queryId = queryDesc->plannedstmt->queryId;
+
+		entry = dshash_find(htab, &key, false);
+		if (entry != NULL)
+		{
+			if (!entry_is_stale(entry->generation))
+				nexecs = entry->stats.nexecs;
+			dshash_release_lock(htab, entry);
+		}
+
+		if (nexecs > adaptive_sample_limit)
+		{
+			/* The query is well covered already. Back off. */
+			probability *= (double) adaptive_sample_limit / (double) nexecs;
+			if (dice >= probability)
+				return 0.0;
+		}
+	}
+
+	return probability;
+}
+
+static void
+track_query_state_cleanup(void *arg)
+{
+	TrackQueryState	   *state = (TrackQueryState *) arg;
+	TrackQueryState	  **prev = &tracked_queries;
+
+	while (*prev != NULL)
+	{
+		if (*prev == state)
+		{
+			*prev = state->next;
+			return;
+		}
+		prev = &(*prev)->next;
+	}
+}
+
+static TrackQueryState *
+track_query_state_lookup(QueryDesc *queryDesc)
+{
+	TrackQueryState *state;
+
+	for (state = tracked_queries; state != NULL; state = state->next)
+	{
+		if (state->queryDesc == queryDesc)
+			return state;
+	}
+	return NULL;
+}
+
+static int
+track_instrument_options(void)
+{
+	switch (instrumentation)
+	{
+		case TRACK_INSTR_ROWS:
+			return INSTRUMENT_ROWS;
+		case TRACK_INSTR_ROWS_TIMING:
+			return INSTRUMENT_TIMER | INSTRUMENT_ROWS;
+		case TRACK_INSTR_FULL:
+			return INSTRUMENT_ALL;
+	}
+
+	Assert(false);
+	return INSTRUMENT_TIMER | INSTRUMENT_ROWS;
+}
+
+/*
+ * Here we need it to enable instrumentation.
+ */
+static void
+explain_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	double				probability = 0.0;
+	int					instrument_options = 0;
+	TrackQueryState	   *state;
+	MemoryContext		oldcxt;
+
+	/*
+	 * Make the sampling decision once: unsampled queries don't pay for the
+	 * instrumentation at all. Shared memory isn't touched until the query
+	 * is actually tracked.
+	 */
+	if (track_query_eligible(queryDesc, eflags))
+	{
+		probability = track_sample_query(queryDesc);
+		if (probability > 0.0)
+		{
+			instrument_options = track_instrument_options();
+			queryDesc->instrument_options |= instrument_options;
+		}
+	}
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	if (probability <= 0.0)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+	/*
+	 * Set up to track total elapsed time in ExecutorRun.  Make sure the
+	 * space is allocated in the per-query context so it will go away at
+	 * ExecutorEnd.
+	 */
+	if (queryDesc->totaltime == NULL)
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_ALL, false);
+
+	/* Remember the decision till the end of the query execution */
+	state = (TrackQueryState *) palloc0(sizeof(TrackQueryState));
+	state->queryDesc = queryDesc;
+	state->queryId = queryDesc->plannedstmt->queryId;
+	state->toplevel = (nesting_level == 0);
+	state->weight = 1.0 / probability;
+	state->use_timing = (instrument_options & INSTRUMENT_TIMER) != 0;
+	state->track_mode = track_mode;
+	state->log_min_error = track_log_min_error();
+	state->plan_min_error = plan_min_error;
+	state->cb.func = track_query_state_cleanup;
+	state->cb.arg = (void *) state;
+	MemoryContextRegisterResetCallback(queryDesc->estate->es_query_cxt,
+									   &state->cb);
+	state->next = tracked_queries;
+	tracked_queries = state;
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * ExecutorRun, ExecutorFinish and ProcessUtility hooks just keep track of the
+ * nesting level, so statements executed inside functions and procedures are
+ * distinguished from the top-level ones.
+ */
+static void
+track_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+				  bool execute_once)
+{
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+	}
+	PG_FINALLY();
+	{
+		nesting_level--;
+	}
+	PG_END_TRY();
+}
+
+static void
+track_ExecutorFinish(QueryDesc *queryDesc)
+{
+	nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+	}
+	PG_FINALLY();
+	{
+		nesting_level--;
+	}
+	PG_END_TRY();
+}
+
+static void
+track_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+					 bool readOnlyTree, ProcessUtilityContext context,
+					 ParamListInfo params, QueryEnvironment *queryEnv,
+					 DestReceiver *dest, QueryCompletion *qc)
+{
+	Node   *parsetree = pstmt->utilityStmt;
+	int		nesting;
+
+	/*
+	 * EXECUTE runs the prepared statement on behalf of the client, so it stays
+	 * a top-level one, as in pg_stat_statements.
+	 */
+	nesting = (IsA(parsetree, ExecuteStmt) || IsA(parsetree, PrepareStmt)) ? 0 : 1;
+
+	nesting_level += nesting;
+	PG_TRY();
+	{
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+								params, queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+									params, queryEnv, dest, qc);
+	}
+	PG_FINALLY();
+	{
+		nesting_level -= nesting;
+	}
+	PG_END_TRY();
+}
+
+/* -----------------------------------------------------------------------------
+ *
+ * Plan logging
+ *
+ * -------------------------------------------------------------------------- */
+
+/*
+ * Header of a plan in the ring buffer. The plan text follows the header,
+ * compressed if it is profitable.
+ */
+typedef struct LogRecord
+{
+	uint32		size; /* Total size of the record, MAXALIGN'ed */
+	uint32		rawlen; /* Length of the plan text */
+	uint32		datalen; /* Less than rawlen, if compressed */
+	int			pid;
+	uint64		queryId;
+	double		msec;
+	double		error;
+} LogRecord;
+
+/*
+ * Allow a plan of the query to be logged not more often than once per
+ * log_min_interval. Queries are hashed into a fixed array of slots; queries
+ * colliding in a slot share its limit, which is fine for such a purpose.
+ */
+static bool
+track_log_allowed(uint64 queryId)
+{
+	pg_atomic_uint64   *slot;
+	uint64				last;
+	TimestampTz			now;
+
+	if (log_min_interval <= 0)
+		return true;
+
+	slot = &shared->log_last[murmurhash64(queryId) % LOG_RATE_SLOTS];
+	last = pg_atomic_read_u64(slot);
+	now = GetCurrentTimestamp();
+
+	if (!TimestampDifferenceExceeds((TimestampTz) last, now, log_min_interval))
+		return false;
+
+	/* Only one of concurrent backends wins the right to log */
+	return pg_atomic_compare_exchange_u64(slot, &last, (uint64) now);
+}
+
+static void
+log_ring_write(char *ring, uint64 pos, const void *src, Size len)
+{
+	Size	offset = pos % LOG_RING_SIZE;
+	Size	part = Min(len, LOG_RING_SIZE - offset);
+
+	memcpy(ring + offset, src, part);
+	if (part < len)
+		memcpy(ring, (const char *) src + part, len - part);
+}
+
+static void
+log_ring_read(const char *ring, uint64 pos, void *dst, Size len)
+{
+	Size	offset = pos % LOG_RING_SIZE;
+	Size	part = Min(len, LOG_RING_SIZE - offset);
+
+	memcpy(dst, ring + offset, part);
+	if (part < len)
+		memcpy((char *) dst + part, ring, len - part);
+}
+
+/*
+ * Allocate the ring buffer at the first use of the asynchronous logging: the
+ * server without the worker or with synchronous logging doesn't pay for it.
+ * The ring is accounted in hash_mem.
+ * Returns false if there is no memory for the ring.
+ */
+static bool
+track_log_alloc_ring(void)
+{
+	dsa_pointer	ring;
+
+	if (!track_reserve_memory(LOG_RING_SIZE))
+		return false;
+
+	ring = dsa_allocate_extended(htab_dsa, LOG_RING_SIZE, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(ring))
+	{
+		pg_atomic_fetch_sub_u64(&shared->mem_used, LOG_RING_SIZE);
+		return false;
+	}
+
+	LWLockAcquire(&shared->log_lock, LW_EXCLUSIVE);
+	if (!DsaPointerIsValid(shared->log_ring))
+	{
+		shared->log_ring = ring;
+		ring = InvalidDsaPointer;
+	}
+	LWLockRelease(&shared->log_lock);
+
+	/* A concurrent backend has allocated the ring in between */
+	if (DsaPointerIsValid(ring))
+	{
+		dsa_free(htab_dsa, ring);
+		pg_atomic_fetch_sub_u64(&shared->mem_used, LOG_RING_SIZE);
+	}
+	return true;
+}
+
+/*
+ * Pass the plan to the background worker. The plan is dropped if the ring
+ * buffer is full.
+ * Only the write into the log is offloaded: the plan has been rendered by the
+ * caller, because the worker has no access to the executor state of the query.
+ * Returns false if there is no worker or no memory for the ring: the caller
+ * should log the plan itself.
+ */
+static bool
+track_log_enqueue(uint64 queryId, double msec, double error,
+				  const char *plan, int len)
+{
+	LogRecord	rec;
+	char	   *data = NULL;
+	char	   *ring;
+	int32		clen = -1;
+	PGPROC	   *worker;
+
+	if (shared->worker_proc == NULL)
+		return false;
+
+	/* Once set, the pointer never changes */
+	if (!DsaPointerIsValid(shared->log_ring) && !track_log_alloc_ring())
+		return false;
+
+	/* Compress outside of the lock */
+	if ((Size) len >= TEXT_COMPRESS_MIN_LEN)
+	{
+		data = palloc(PGLZ_MAX_OUTPUT(len));
+		clen = pglz_compress(plan, len, data, PGLZ_strategy_default);
+	}
+
+	rec.rawlen = len;
+	rec.datalen = (clen >= 0) ? clen : len;
+	rec.size = MAXALIGN(sizeof(LogRecord) + rec.datalen);
+	rec.pid = MyProcPid;
+	rec.queryId = queryId;
+	rec.msec = msec;
+	rec.error = error;
+
+	if (rec.size > LOG_RING_SIZE / 4)
+	{
+		/* Don't let a huge plan to push away many others */
+		pg_atomic_fetch_add_u64(&shared->log_dropped, 1);
+		if (data)
+			pfree(data);
+		return true;
+	}
+
+	ring = dsa_get_address(htab_dsa, shared->log_ring);
+
+	LWLockAcquire(&shared->log_lock, LW_EXCLUSIVE);
+	if (LOG_RING_SIZE - (shared->log_head - shared->log_tail) < rec.size)
+	{
+		LWLockRelease(&shared->log_lock);
+		pg_atomic_fetch_add_u64(&shared->log_dropped, 1);
+		if (data)
+			pfree(data);
+		return true;
+	}
+	log_ring_write(ring, shared->log_head, &rec, sizeof(LogRecord));
+	log_ring_write(ring, shared->log_head + sizeof(LogRecord),
+				   (clen >= 0) ? data : plan, rec.datalen);
+	shared->log_head += rec.size;
+	worker = shared->worker_proc;
+	LWLockRelease(&shared->log_lock);
+
+	if (worker != NULL)
+		SetLatch(&worker->procLatch);
+
+	if (data)
+		pfree(data);
+	return true;
+}
+
+/*
+ * Write all the plans waiting in the ring buffer into the log.
+ * Called by the background worker.
+ */
+static void
+track_log_drain(void)
+{
+	char   *ring = NULL;
+
+	for (;;)
+	{
+		LogRecord	rec;
+		char	   *data;
+		char	   *plan;
+
+		LWLockAcquire(&shared->log_lock, LW_EXCLUSIVE);
+		if (shared->log_tail == shared->log_head)
+		{
+			LWLockRelease(&shared->log_lock);
+			break;
+		}
+
+		/* Something is in the ring, so it has been allocated */
+		if (ring == NULL)
+			ring = dsa_get_address(htab_dsa, shared->log_ring);
+		log_ring_read(ring, shared->log_tail, &rec, sizeof(LogRecord));
+		data = palloc(rec.datalen + 1);
+		log_ring_read(ring, shared->log_tail + sizeof(LogRecord), data,
+					  rec.datalen);
+		shared->log_tail += rec.size;
+		LWLockRelease(&shared->log_lock);
+
+		if (rec.datalen < rec.rawlen)
+		{
+			plan = palloc(rec.rawlen + 1);
+			if (pglz_decompress(data, rec.datalen, plan, rec.rawlen,
+								true) != (int32) rec.rawlen)
+			{
+				elog(WARNING, "[%s] could not decompress a plan of the query "
+					 UINT64_FORMAT, EXTENSION_NAME, rec.queryId);
+				pfree(plan);
+				pfree(data);
+				continue;
+			}
+			pfree(data);
+		}
+		else
+			plan = data;
+		plan[rec.rawlen] = '\0';
+
+		ereport(LOG,
+				(errmsg("duration: %.3f ms, relative error: %.4lf, plan:\n%s",
+						rec.msec, rec.error, plan),
+				 errdetail("Query " INT64_FORMAT " executed by process %d.",
+						   (int64) rec.queryId, rec.pid),
+				 errhidestmt(true)));
+		pfree(plan);
+	}
+}
+
+/*
+ * Copy-paste from auto_explain code
+ */
+static void
+_explain_statement(QueryDesc *queryDesc, TrackQueryState *state,
+				   double normalized_error)
+{
+	ExplainState   *es;
+	double			msec;
+
+	if (state->log_min_error < 0 || normalized_error < state->log_min_error)
+		return;
+
+	/* Don't spend time on the plan of the query logged just recently */
+	if (!track_log_allowed(state->queryId))
+		return;
+
+	es = NewExplainState();
+
+	msec = queryDesc->totaltime->total * 1000.0;
+
+	/*
+	 * We triggered by an estimation error. So, show only the options which
+	 * can be useful to determine possible solution.
+	 */
+	es->analyze = (queryDesc->instrument_options);
+	es->verbose = false;
+	es->buffers = (queryDesc->instrument_options & INSTRUMENT_BUFFERS) != 0;
+	es->wal = (queryDesc->instrument_options & INSTRUMENT_WAL) != 0;
+	es->timing = (queryDesc->instrument_options & INSTRUMENT_TIMER) != 0;
+	es->summary = true;
+	es->format = EXPLAIN_FORMAT_TEXT;
+	es->settings = true;
+
+	ExplainBeginOutput(es);
+	ExplainQueryText(es, queryDesc);
+	ExplainPrintPlan(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Remove last line break */
+	if (es->str->len > 0 && es->str->data[es->str->len - 1] == '\n')
+		es->str->data[--es->str->len] = '\0';
+
+	if (log_mode == TRACK_LOG_ASYNC &&
+		track_log_enqueue(state->queryId, msec,
+						  normalized_error, es->str->data, es->str->len))
+		return;
+
+	/*
+	 * Note: we rely on the existing logging of context or
+	 * debug_query_string to identify just which statement is being
+	 * reported.  This isn't ideal but trying to do it here would
+	 * often result in duplication.
+	 */
+	ereport(LOG,
+			(errmsg("duration: %.3f ms, relative error: %.4lf, plan:\n%s",
+					msec, normalized_error, es->str->data),
+			 errhidestmt(true)));
+}
+
+/*
+ * Free the stored plan of the entry. Caller must hold exclusive lock on the
+ * entry.
+ */
+static void
+_free_entry_plan(DSMOptimizerTrackerEntry *entry)
+{
+	if (!DsaPointerIsValid(entry->plan))
+		return;
+
+	dsa_free(htab_dsa, entry->plan);
+	pg_atomic_fetch_sub_u64(&shared->mem_used, MAXALIGN(entry->plan_stored_len));
+	entry->plan = InvalidDsaPointer;
+	entry->plan_error = -1.;
+}
+
+/*
+ * Free the per-node detail of the entry. Caller must hold exclusive lock on
+ * the entry.
+ */
+static void
+_free_entry_detail(DSMOptimizerTrackerEntry *entry)
+{
+	if (!DsaPointerIsValid(entry->detail))
+		return;
+
+	dsa_free(htab_dsa, entry->detail);
+	pg_atomic_fetch_sub_u64(&shared->mem_used,
+							MAXALIGN(entry->detail_nnodes * sizeof(DetailNode)));
+	pg_atomic_fetch_sub_u32(&shared->detail_count, 1);
+	entry->detail = InvalidDsaPointer;
+	entry->detail_nnodes = 0;
+}
+
+/*
+ * Keep the JSON EXPLAIN of the execution with the highest error in the entry.
+ * The cheap check under the shared lock goes first, so the plan is rendered
+ * only when the entry is going to be updated.
+ * Plan memory is accounted in hash_mem.
+ */
+static void
+_store_plan(QueryDesc *queryDesc, TrackQueryState *state,
+			double normalized_error)
+{
+	DSMOptimizerTrackerKey		key;
+	DSMOptimizerTrackerEntry   *entry;
+	ExplainState			   *es;
+	double						stored_error;
+	char					   *data = NULL;
+	int32						clen = -1;
+	uint32						stored_len;
+	dsa_pointer					dp;
+
+	if (state->plan_min_error < 0. || normalized_error < state->plan_min_error)
+		return;
+
+	memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
+	key.dbOid = MyDatabaseId;
+	key.toplevel = state->toplevel;
+	key.queryId = state->queryId;
+
+	/* The entry might not be merged from the local buffer yet */
+	entry = dshash_find(htab, &key, false);
+	if (entry == NULL)
+		return;
+	if (entry_is_stale(entry->generation))
+	{
+		dshash_release_lock(htab, entry);
+		return;
+	}
+	stored_error = entry->plan_error;
+	dshash_release_lock(htab, entry);
+
+	if (normalized_error <= stored_error)
+		return;
+
+	es = NewExplainState();
+	es->analyze = (queryDesc->instrument_options);
+	es->verbose = false;
+	es->buffers = (queryDesc->instrument_options & INSTRUMENT_BUFFERS) != 0;
+	es->wal = (queryDesc->instrument_options & INSTRUMENT_WAL) != 0;
+	es->timing = (queryDesc->instrument_options & INSTRUMENT_TIMER) != 0;
+	es->summary = true;
+	es->format = EXPLAIN_FORMAT_JSON;
+	es->settings = true;
+
+	ExplainBeginOutput(es);
+	ExplainQueryText(es, queryDesc);
+	ExplainPrintPlan(es, queryDesc);
+	ExplainEndOutput(es);
+
+	/* Fix JSON to output an object, as auto_explain does */
+	es->str->data[0] = '{';
+	es->str->data[es->str->len - 1] = '}';
+
+	if (compress_texts && es->str->len >= TEXT_COMPRESS_MIN_LEN)
+	{
+		data = palloc(PGLZ_MAX_OUTPUT(es->str->len));
+		clen = pglz_compress(es->str->data, es->str->len, data,
+							 PGLZ_strategy_default);
+	}
+	stored_len = (clen >= 0) ? clen : es->str->len;
+
+	if (!track_reserve_memory(MAXALIGN(stored_len)))
+		dp = InvalidDsaPointer;
+	else
+	{
+		dp = dsa_allocate_extended(htab_dsa, stored_len, DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(dp))
+			pg_atomic_fetch_sub_u64(&shared->mem_used, MAXALIGN(stored_len));
+		else
+			memcpy(dsa_get_address(htab_dsa, dp),
+				   (clen >= 0) ? data : es->str->data, stored_len);
+	}
+
+	/* The plan may be big, don't keep its copy until the end of the query */
+	if (data != NULL)
+		pfree(data);
+	if (!DsaPointerIsValid(dp))
+		return;
+
+	/* Someone could store a worse plan or remove the entry in between */
+	entry = dshash_find(htab, &key, true);
+	if (entry != NULL)
+	{
+		if (normalized_error > entry->plan_error)
+		{
+			dsa_pointer	old = entry->plan;
+			uint32		old_len = entry->plan_stored_len;
+
+			entry->plan = dp;
+			entry->plan_error = normalized_error;
+			entry->plan_len = es->str->len;
+			entry->plan_stored_len = stored_len;
+
+			/* Free the previous plan instead */
+			dp = old;
+			stored_len = old_len;
+		}
+		dshash_release_lock(htab, entry);
+	}
+
+	if (DsaPointerIsValid(dp))
+	{
+		dsa_free(htab_dsa, dp);
+		pg_atomic_fetch_sub_u64(&shared->mem_used, MAXALIGN(stored_len));
+	}
+}
+
+/*
+ * Find the counters slot of the database, take a free one if it hasn't been
+ * assigned yet. Slots are never released: the number of databases which
+ * execute queries is small enough in practice.
+ */
+static DBStats *
+db_stats_slot(Oid dbOid)
+{
+	uint32	start = murmurhash32(dbOid) % (DB_STATS_SLOTS - 1);
+	int		i;
+
+	Assert(OidIsValid(dbOid));
+
+	if (dbOid == MyDatabaseId && my_db_stats != NULL)
+		return my_db_stats;
+
+	for (i = 0; i < DB_STATS_SLOTS - 1; i++)
+	{
+		DBStats	   *slot;
+		uint32		expected = InvalidOid;
+
+		slot = &shared->db_stats[(start + i) % (DB_STATS_SLOTS - 1)].stats;
+		if (pg_atomic_read_u32(&slot->dbOid) == dbOid ||
+			pg_atomic_compare_exchange_u32(&slot->dbOid, &expected, dbOid) ||
+			expected == dbOid)
+		{
+			if (dbOid == MyDatabaseId)
+				my_db_stats = slot;
+			return slot;
+		}
+	}
+
+	/* All the slots are busy */
+	return &shared->db_stats[DB_STATS_SLOTS - 1].stats;
+}
+
+typedef struct EvictionCandidate
+{
+	DSMOptimizerTrackerKey	key;
+	double					score;
+} EvictionCandidate;
+
+static double
+eviction_score(DSMOptimizerTrackerEntry *entry)
+{
+	/* Entries of the reset generation go first */
+	if (entry_is_stale(entry->generation))
+		return -1.;
+
+	if (eviction == TRACK_EVICT_LRU)
+		return (double) entry->stats.last_exec;
+
+	return entry->stats.error_time;
+}
+
+/* Max-heap on the score: the best candidate to survive is on the top */
+static int
+eviction_cmp(Datum a, Datum b, void *arg)
+{
+	EvictionCandidate *ca = (EvictionCandidate *) DatumGetPointer(a);
+	EvictionCandidate *cb = (EvictionCandidate *) DatumGetPointer(b);
+
+	if (ca->score > cb->score)
+		return 1;
+	if (ca->score < cb->score)
+		return -1;
+	return 0;
+}
+
+/*
+ * Account a change of the entry for the next checkpoint. Caller must hold
+ * exclusive lock on the entry.
+ */
+static void
+_mark_dirty(DSMOptimizerTrackerEntry *entry)
+{
+	entry->changes++;
+	if (!entry->dirty)
+	{
+		entry->dirty = true;
+		pg_atomic_fetch_add_u32(&shared->ndirty, 1);
+	}
+}
+
+/*
+ * Remember the key of a removed entry: the next checkpoint writes a delete
+ * record, otherwise the entry would come back from the disk after a restart.
+ */
+static void
+_queue_removal(const DSMOptimizerTrackerKey *key)
+{
+	LWLockAcquire(&shared->removed_lock, LW_EXCLUSIVE);
+	if (shared->nremoved < REMOVED_MAX_KEYS)
+		memcpy(&shared->removed[shared->nremoved++], key,
+			   sizeof(DSMOptimizerTrackerKey));
+	else
+		shared->nlost++;
+	LWLockRelease(&shared->removed_lock);
+}
+
+/*
+ * Give the new entry a slot, so the eviction can sample it. Caller must hold
+ * exclusive lock on the entry. The array grows twice when it is full; if
+ * there is no memory for that, the entry just isn't sampled.
+ */
+static void
+_slot_add(DSMOptimizerTrackerEntry *entry)
+{
+	EvictionSlot   *slots;
+	uint32			slot;
+
+	entry->slot = SLOT_NONE;
+
+	LWLockAcquire(&shared->slots_lock, LW_EXCLUSIVE);
+	if (shared->free_slot != SLOT_NONE)
+	{
+		slots = dsa_get_address(htab_dsa, shared->slots);
+		slot = shared->free_slot;
+		shared->free_slot = slots[slot].next_free;
+	}
+	else
+	{
+		if (shared->nslots >= shared->max_slots)
+		{
+			uint32		max_slots = Max(shared->max_slots * 2, EVICTION_MIN_SLOTS);
+			dsa_pointer	dp;
+
+			dp = dsa_allocate_extended(htab_dsa,
+									   (Size) max_slots * sizeof(EvictionSlot),
+									   DSA_ALLOC_NO_OOM | DSA_ALLOC_HUGE);
+			if (!DsaPointerIsValid(dp))
+			{
+				LWLockRelease(&shared->slots_lock);
+				return;
+			}
+
+			if (DsaPointerIsValid(shared->slots))
+			{
+				memcpy(dsa_get_address(htab_dsa, dp),
+					   dsa_get_address(htab_dsa, shared->slots),
+					   (Size) shared->nslots * sizeof(EvictionSlot));
+				dsa_free(htab_dsa, shared->slots);
+			}
+			shared->slots = dp;
+			shared->max_slots = max_slots;
+		}
+
+		slots = dsa_get_address(htab_dsa, shared->slots);
+		slot = shared->nslots++;
+	}
+
+	slots[slot].key = entry->key;
+	slots[slot].used = true;
+	entry->slot = slot;
+	LWLockRelease(&shared->slots_lock);
+}
+
+/*
+ * Put the slot of the entry into the free list. Caller must hold exclusive
+ * lock on the entry.
+ */
+static void
+_slot_release(DSMOptimizerTrackerEntry *entry)
+{
+	EvictionSlot   *slots;
+
+	if (entry->slot == SLOT_NONE)
+		return;
+
+	LWLockAcquire(&shared->slots_lock, LW_EXCLUSIVE);
+	slots = dsa_get_address(htab_dsa, shared->slots);
+	slots[entry->slot].used = false;
+	slots[entry->slot].next_free = shared->free_slot;
+	shared->free_slot = entry->slot;
+	LWLockRelease(&shared->slots_lock);
+
+	entry->slot = SLOT_NONE;
+}
+
+/*
+ * Release resources of an entry which is going to be deleted and account its
+ * removal. Caller must hold exclusive lock on the entry.
+ */
+static void
+_release_entry(DSMOptimizerTrackerEntry *entry)
+{
+	uint32	pre;
+
+	_slot_release(entry);
+	text_store_release(entry->textid);
+	_free_entry_plan(entry);
+	_free_entry_detail(entry);
+	_queue_removal(&entry->key);
+	if (entry->dirty)
+		pg_atomic_fetch_sub_u32(&shared->ndirty, 1);
+	pg_atomic_fetch_sub_u64(&shared->mem_used, ENTRY_MEM_SIZE);
+	pre = pg_atomic_fetch_sub_u32(&shared->htab_counter, 1);
+
+	if (pre == 0)
+	{
+		/* Statistics aren't worth a server restart, just fix the counter */
+		pg_atomic_fetch_add_u32(&shared->htab_counter, 1);
+		elog(LOG, "[%s] inconsistent counter of entries", EXTENSION_NAME);
+	}
+}
+
+/*
+ * Remove an entry with all its resources. Caller must hold exclusive lock on
+ * the entry. The entry is released (deleted) on exit.
+ */
+static void
+_remove_entry(DSMOptimizerTrackerEntry *entry)
+{
+	_release_entry(entry);
+	dshash_delete_entry(htab, entry);
+}
+
+/*
+ * Throw away the least valuable entries to free memory for new ones.
+ *
+ * A random sample of EVICTION_SAMPLE entries is taken from the array of slots,
+ * and the fraction of the sample with the lowest score is deleted, so the cost
+ * doesn't depend on the size of the table. Evicting a batch of entries at once
+ * amortises it over many insertions. Plan variants and texts of the victims
+ * are freed later by the garbage collection.
+ * Only one backend evicts at a time; others don't wait and just drop their
+ * data.
+ *
+ * Returns true if some memory has been freed.
+ */
+static bool
+track_evict_entries(void)
+{
+	DSMOptimizerTrackerEntry   *entry;
+	DSMOptimizerTrackerKey	   *sample;
+	EvictionCandidate		   *candidates;
+	binaryheap				   *heap;
+	int							nsample = 0;
+	int							nvictims;
+	int							ncandidates = 0;
+	int							nevicted = 0;
+	int							i;
+
+	if (eviction == TRACK_EVICT_NONE)
+		return false;
+
+	if (!LWLockConditionalAcquire(&shared->evict_lock, LW_EXCLUSIVE))
+		return false;
+
+	sample = palloc(EVICTION_SAMPLE * sizeof(DSMOptimizerTrackerKey));
+	LWLockAcquire(&shared->slots_lock, LW_SHARED);
+	if (shared->nslots > 0)
+	{
+		EvictionSlot   *slots = dsa_get_address(htab_dsa, shared->slots);
+
+		for (i = 0; i < EVICTION_SAMPLE; i++)
+		{
+			uint32	slot;
+
+			/* A small table is taken as a whole */
+			if (shared->nslots <= EVICTION_SAMPLE)
+			{
+				if (i >= shared->nslots)
+					break;
+				slot = i;
+			}
+			else
+				slot = (uint32) pg_prng_uint64_range(&pg_global_prng_state, 0,
+													 shared->nslots - 1);
+
+			if (slots[slot].used)
+				sample[nsample++] = slots[slot].key;
+		}
+	}
+	LWLockRelease(&shared->slots_lock);
+
+	nvictims = Max(1, (int) (nsample * EVICTION_FRACTION));
+	candidates = palloc(nvictims * sizeof(EvictionCandidate));
+	heap = binaryheap_allocate(nvictims, eviction_cmp, NULL);
+
+	for (i = 0; i < nsample; i++)
+	{
+		double score;
+
+		entry = dshash_find(htab, &sample[i], false);
+		if (entry == NULL)
+			continue;
+		score = eviction_score(entry);
+		dshash_release_lock(htab, entry);
+
+		if (ncandidates < nvictims)
+		{
+			candidates[ncandidates].key = sample[i];
+			candidates[ncandidates].score = score;
+			binaryheap_add(heap, PointerGetDatum(&candidates[ncandidates]));
+			ncandidates++;
+		}
+		else
+		{
+			EvictionCandidate *top;
+
+			top = (EvictionCandidate *) DatumGetPointer(binaryheap_first(heap));
+			if (score >= top->score)
+				continue;
+
+			/* Replace the most valuable candidate by this entry */
+			top->key = sample[i];
+			top->score = score;
+			binaryheap_replace_first(heap, PointerGetDatum(top));
+		}
+	}
+
+	for (i = 0; i < ncandidates; i++)
+	{
+		entry = dshash_find(htab, &candidates[i].key, true);
+
+		/* Someone could remove the entry in between, or it is sampled twice */
+		if (entry == NULL)
+			continue;
+
+		pg_atomic_fetch_add_u64(&db_stats_slot(entry->key.dbOid)->nevicted, 1);
+		_remove_entry(entry);
+		nevicted++;
+	}
+
+	LWLockRelease(&shared->evict_lock);
+	binaryheap_free(heap);
+	pfree(candidates);
+	pfree(sample);
+
+	if (nevicted > 0)
+		track_request_gc();
+
+	pg_atomic_fetch_add_u64(&shared->nevicted, nevicted);
+	return (nevicted > 0);
+}
+
+/*
+ * Reserve memory for a new entry. Tries to evict old entries if the limit is
+ * reached.
+ */
+static bool
+track_reserve_memory(uint64 size)
+{
+	uint64	limit = (uint64) hash_mem * 1024;
+	uint64	used;
+
+	used = pg_atomic_fetch_add_u64(&shared->mem_used, size);
+	if (used + size <= limit)
+		return true;
+	pg_atomic_fetch_sub_u64(&shared->mem_used, size);
+
+	if (!track_evict_entries())
+		return false;
+
+	/* Try once more */
+	used = pg_atomic_fetch_add_u64(&shared->mem_used, size);
+	if (used + size <= limit)
+		return true;
+	pg_atomic_fetch_sub_u64(&shared->mem_used, size);
+	return false;
+}
+
+/*
+ * Order of keys in the arrays of top offenders.
+ */
+static int
+detail_key_cmp(const void *a, const void *b)
+{
+	const DSMOptimizerTrackerKey *ka = (const DSMOptimizerTrackerKey *) a;
+	const DSMOptimizerTrackerKey *kb = (const DSMOptimizerTrackerKey *) b;
+
+	if (ka->queryId != kb->queryId)
+		return (ka->queryId > kb->queryId) ? 1 : -1;
+	if (ka->dbOid != kb->dbOid)
+		return (ka->dbOid > kb->dbOid) ? 1 : -1;
+	if (ka->toplevel != kb->toplevel)
+		return ka->toplevel ? 1 : -1;
+	return 0;
+}
+
+/*
+ * Is the query one of the top offenders? Binary search without locks, so the
+ * check costs nothing to the rest of the queries.
+ */
+static bool
+detail_wanted(TrackQueryState *state)
+{
+	DSMOptimizerTrackerKey	key;
+	DSMOptimizerTrackerKey *keys;
+	uint32					current;
+	uint32					nkeys;
+
+	if (detail_entries <= 0)
+		return false;
+
+	/* Pairs with the write barriers of track_detail_refresh */
+	current = pg_atomic_read_u32(&shared->detail_current);
+	pg_read_barrier();
+	nkeys = pg_atomic_read_u32(&shared->detail_nkeys[current]);
+	if (nkeys == 0)
+		return false;
+	pg_read_barrier();
+
+	memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
+	key.dbOid = MyDatabaseId;
+	key.toplevel = state->toplevel;
+	key.queryId = state->queryId;
+
+	keys = (DSMOptimizerTrackerKey *) dsa_get_address(htab_dsa,
+													  shared->detail_keys);
+	keys += current * DETAIL_MAX_ENTRIES;
+	return bsearch(&key, keys, nkeys, sizeof(DSMOptimizerTrackerKey),
+				   detail_key_cmp) != NULL;
+}
+
+/*
+ * Replace the per-node detail of the entry by the one of the last execution.
+ * At most detail_entries entries keep the detail at once.
+ */
+static void
+_store_detail(TrackQueryState *state, ScourContext *ctx)
+{
+	DSMOptimizerTrackerKey		key;
+	DSMOptimizerTrackerEntry   *entry;
+	uint32						nnodes = ctx->ndetail;
+	Size						size = nnodes * sizeof(DetailNode);
+	dsa_pointer					dp;
+
+	if (nnodes == 0)
+		return;
+
+	if (!track_reserve_memory(MAXALIGN(size)))
+		return;
+
+	dp = dsa_allocate_extended(htab_dsa, size, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(dp))
+	{
+		pg_atomic_fetch_sub_u64(&shared->mem_used, MAXALIGN(size));
+		return;
+	}
+	memcpy(dsa_get_address(htab_dsa, dp), ctx->detail, size);
+
+	memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
+	key.dbOid = MyDatabaseId;
+	key.toplevel = state->toplevel;
+	key.queryId = state->queryId;
+
+	/* The entry might not be merged from the local buffer yet */
+	entry = dshash_find(htab, &key, true);
+	if (entry != NULL && entry_is_stale(entry->generation))
+		dshash_release_lock(htab, entry);
+	else if (entry != NULL)
+	{
+		if (DsaPointerIsValid(entry->detail))
+		{
+			dsa_pointer	old = entry->detail;
+			uint32		old_nnodes = entry->detail_nnodes;
+
+			entry->detail = dp;
+			entry->detail_nnodes = nnodes;
+			entry->detail_time = GetCurrentStatementStartTimestamp();
+
+			/* Free the previous detail instead */
+			dp = old;
+			size = old_nnodes * sizeof(DetailNode);
+		}
+		else if (pg_atomic_fetch_add_u32(&shared->detail_count, 1) <
+				 (uint32) detail_entries)
+		{
+			entry->detail = dp;
+			entry->detail_nnodes = nnodes;
+			entry->detail_time = GetCurrentStatementStartTimestamp();
+			dp = InvalidDsaPointer;
+		}
+		else
+			pg_atomic_fetch_sub_u32(&shared->detail_count, 1);
+		dshash_release_lock(htab, entry);
+	}
+
+	if (DsaPointerIsValid(dp))
+	{
+		dsa_free(htab_dsa, dp);
+		pg_atomic_fetch_sub_u64(&shared->mem_used, MAXALIGN(size));
+	}
+}
+
+static double
+detail_score(DSMOptimizerTrackerEntry *entry)
+{
+	return entry->stats.error2.mean * (double) entry->stats.nexecs;
+}
+
+/* Min-heap on the score: the weakest of the top is on the top */
+static int
+detail_cmp(Datum a, Datum b, void *arg)
+{
+	return -eviction_cmp(a, b, arg);
+}
+
+/*
+ * Recalculate the set of top offenders by error2 * nexecs and free details of
+ * the entries which have dropped out of it. Called by the background worker,
+ * at most once per DETAIL_REFRESH_INTERVAL: the scan of the whole table isn't
+ * something a backend should pay for at the end of a query.
+ */
+static void
+track_detail_refresh(void)
+{
+	dshash_seq_status			stat;
+	DSMOptimizerTrackerEntry   *entry;
+	EvictionCandidate		   *candidates;
+	DSMOptimizerTrackerKey	   *keys;
+	binaryheap				   *heap;
+	TimestampTz					now = GetCurrentTimestamp();
+	uint64						last;
+	uint32						next;
+	int							nentries = Min(detail_entries, DETAIL_MAX_ENTRIES);
+	int							ncandidates = 0;
+	int							i;
+
+	last = pg_atomic_read_u64(&shared->detail_refresh);
+	if (!TimestampDifferenceExceeds((TimestampTz) last, now,
+									DETAIL_REFRESH_INTERVAL))
+		return;
+	if (!pg_atomic_compare_exchange_u64(&shared->detail_refresh, &last,
+										(uint64) now))
+		return;
+
+	next = 1 - pg_atomic_read_u32(&shared->detail_current);
+	keys = (DSMOptimizerTrackerKey *) dsa_get_address(htab_dsa,
+													  shared->detail_keys);
+	keys += next * DETAIL_MAX_ENTRIES;
+
+	if (nentries > 0)
+	{
+		candidates = palloc(nentries * sizeof(EvictionCandidate));
+		heap = binaryheap_allocate(nentries, detail_cmp, NULL);
+
+		dshash_seq_init(&stat, htab, false);
+		while ((entry = dshash_seq_next(&stat)) != NULL)
+		{
+			double	score;
+
+			if (entry_is_stale(entry->generation))
+				continue;
+
+			score = detail_score(entry);
+			if (score <= 0.)
+				continue;
+
+			if (ncandidates < nentries)
+			{
+				candidates[ncandidates].key = entry->key;
+				candidates[ncandidates].score = score;
+				binaryheap_add(heap, PointerGetDatum(&candidates[ncandidates]));
+				ncandidates++;
+			}
+			else
+			{
+				EvictionCandidate *top;
+
+				top = (EvictionCandidate *) DatumGetPointer(binaryheap_first(heap));
+				if (score <= top->score)
+					continue;
+
+				top->key = entry->key;
+				top->score = score;
+				binaryheap_replace_first(heap, PointerGetDatum(top));
+			}
+		}
+		dshash_seq_term(&stat);
+
+		for (i = 0; i < ncandidates; i++)
+			keys[i] = candidates[i].key;
+		qsort(keys, ncandidates, sizeof(DSMOptimizerTrackerKey), detail_key_cmp);
+
+		binaryheap_free(heap);
+		pfree(candidates);
+	}
+
+	/* Keys, then their number, then the switch: see detail_wanted */
+	pg_write_barrier();
+	pg_atomic_write_u32(&shared->detail_nkeys[next], ncandidates);
+	pg_write_barrier();
+	pg_atomic_write_u32(&shared->detail_current, next);
+
+	if (pg_atomic_read_u32(&shared->detail_count) == 0)
+		return;
+
+	/* Details of the former top aren't needed anymore */
+	dshash_seq_init(&stat, htab, true);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (!DsaPointerIsValid(entry->detail))
+			continue;
+
+		if (ncandidates == 0 ||
+			bsearch(&entry->key, keys, ncandidates,
+					sizeof(DSMOptimizerTrackerKey), detail_key_cmp) == NULL)
+			_free_entry_detail(entry);
+	}
+	dshash_seq_term(&stat);
+}
+
+/*
+ * Merge statistics into the entry of the plan variant. The query entry should
+ * already exist. The plan statistics are just skipped if there is no memory.
+ */
+static void
+_merge_plan_stats(DSMOptimizerTrackerKey *key, uint64 planId,
+				  const TrackerStats *stats)
+{
+	PlanTrackerKey		pkey;
+	PlanTrackerEntry   *pentry;
+	bool				found;
+	uint32				generation = pg_atomic_read_u32(&shared->generation);
+	instr_time			start;
+
+	memset(&pkey, 0, sizeof(PlanTrackerKey));
+	memcpy(&pkey.key, key, sizeof(DSMOptimizerTrackerKey));
+	pkey.planId = planId;
+
+	lock_wait_begin(&start);
+	pentry = dshash_find(plan_htab, &pkey, true);
+	lock_wait_end(&start);
+	if (pentry == NULL)
+	{
+		if (!track_reserve_memory(PLAN_ENTRY_MEM_SIZE))
+			return;
+
+		lock_wait_begin(&start);
+		pentry = dshash_find_or_insert(plan_htab, &pkey, &found);
+		lock_wait_end(&start);
+		if (found)
+			pg_atomic_fetch_sub_u64(&shared->mem_used, PLAN_ENTRY_MEM_SIZE);
+		else
+		{
+			pentry->generation = generation;
+			tracker_stats_init(&pentry->stats);
+		}
+	}
+
+	/* Statistics of the reset generation are just thrown away */
+	if (pentry->generation != generation)
+	{
+		pentry->generation = generation;
+		tracker_stats_init(&pentry->stats);
+	}
+
+	tracker_stats_merge(&pentry->stats, stats);
+	dshash_release_lock(plan_htab, pentry);
+}
+
+/*
+ * Merge statistics into the shared entry. Insert a new entry, if needed.
+ * Returns false if memory limit was exceeded.
+ */
+static bool
+_merge_stats(DSMOptimizerTrackerKey *key, uint64 planId, const char *querytext,
+			 int len, const TrackerStats *stats)
+{
+	DSMOptimizerTrackerEntry   *entry;
+	bool						found;
+	uint64						textid;
+	uint32						generation;
+	instr_time					start;
+
+	Assert(htab != NULL && key->queryId != UINT64CONST(0));
+
+	generation = pg_atomic_read_u32(&shared->generation);
+
+	/* Fast path: updating the existed entry doesn't need memory */
+	lock_wait_begin(&start);
+	entry = dshash_find(htab, key, true);
+	lock_wait_end(&start);
+
+	if (entry == NULL)
+	{
+		if (pg_atomic_read_u32(&shared->htab_counter) == UINT32_MAX ||
+			!track_reserve_memory(ENTRY_MEM_SIZE))
+		{
+			pg_atomic_fetch_add_u64(&shared->ndropped, stats->nexecs);
+			pg_atomic_fetch_add_u64(&db_stats_slot(key->dbOid)->ndropped,
+									stats->nexecs);
+			return false;
+		}
+
+		/*
+		 * Put the query string into the text store before locking the entry.
+		 * The entry is stored even if the text memory limit is exceeded.
+		 */
+		textid = text_store_add(querytext, len);
+
+		lock_wait_begin(&start);
+		entry = dshash_find_or_insert(htab, key, &found);
+		lock_wait_end(&start);
+
+		if (found)
+		{
+			/* Concurrent backend has inserted the same key in between */
+			pg_atomic_fetch_sub_u64(&shared->mem_used, ENTRY_MEM_SIZE);
+			text_store_release(textid);
+		}
+		else
+		{
+			entry->textid = textid;
+			entry->generation = generation;
+			entry->dirty = false;
+			entry->changes = 0;
+			entry->plan = InvalidDsaPointer;
+			entry->plan_error = -1.;
+			entry->detail = InvalidDsaPointer;
+			entry->detail_nnodes = 0;
+			tracker_stats_init(&entry->stats);
+			memset(entry->window, 0, sizeof(entry->window));
+			_slot_add(entry);
+			pg_atomic_fetch_add_u32(&shared->htab_counter, 1);
+		}
+	}
+
+	/*
+	 * The entry is reset: reuse it for the new generation. The query text
+	 * stays the same for the key.
+	 */
+	if (entry->generation != generation)
+	{
+		entry->generation = generation;
+		_free_entry_plan(entry);
+		_free_entry_detail(entry);
+		tracker_stats_init(&entry->stats);
+		memset(entry->window, 0, sizeof(entry->window));
+	}
+
+	tracker_stats_merge(&entry->stats, stats);
+	window_add(entry->window, stats);
+	_mark_dirty(entry);
+	dshash_release_lock(htab, entry);
+
+	if (planId != UINT64CONST(0))
+		_merge_plan_stats(key, planId, stats);
+
+	return true;
+}
+
+/*
+ * Merge all the data accumulated in the local buffer into the shared table.
+ */
+static void
+track_flush_local(void)
+{
+	HTAB			   *buffer = local_htab;
+	HTAB			   *advice = local_advice;
+	HASH_SEQ_STATUS		hstat;
+	LocalTrackerEntry  *lentry;
+	PhaseTimer			timer;
+
+	if (buffer == NULL && advice == NULL)
+		return;
+
+	/*
+	 * Detach the buffer before merging: in the case of an error we lose its
+	 * data rather than count it twice.
+	 */
+	local_htab = NULL;
+	local_advice = NULL;
+	local_nexecs = 0;
+	local_flush_pending = false;
+	if (batch_timeout_id != MAX_TIMEOUTS && get_timeout_active(batch_timeout_id))
+		disable_timeout(batch_timeout_id, false);
+
+	track_attach_shmem();
+	track_load_fallback();
+
+	phase_begin(TRACK_PHASE_MERGE, &timer);
+	if (buffer != NULL)
+	{
+		hash_seq_init(&hstat, buffer);
+		while ((lentry = (LocalTrackerEntry *) hash_seq_search(&hstat)) != NULL)
+			(void) _merge_stats(&lentry->key.key, lentry->key.planId,
+								lentry->querytext, lentry->querytext_len,
+								&lentry->stats);
+	}
+	if (advice != NULL)
+		_merge_advice(advice);
+	phase_end(&timer);
+
+	/* Counts of the adaptive threshold age together with the buffer */
+	if (sketch_nlocal > 0)
+		sketch_flush();
+
+	MemoryContextReset(local_buffer_cxt);
+}
+
+/*
+ * The batch is old enough. Only the flag can be set in the signal handler:
+ * the merge happens at the next execution in this backend, or at its exit.
+ */
+static void
+track_batch_timeout_handler(void)
+{
+	local_flush_pending = true;
+}
+
+static void
+track_shmem_exit(int code, Datum arg)
+{
+	/*
+	 * Don't touch shared structures on an abnormal exit: we might still hold
+	 * some of their locks.
+	 */
+	if (code != 0)
+		return;
+
+	track_flush_local();
+}
+
+/*
+ * Create the memory context of the local buffer at the first use.
+ */
+static void
+track_local_buffer_init(void)
+{
+	if (local_buffer_cxt != NULL)
+		return;
+
+	local_buffer_cxt = AllocSetContextCreate(TopMemoryContext,
+											 "pg_track_optimizer local buffer",
+											 ALLOCSET_DEFAULT_SIZES);
+	before_shmem_exit(track_shmem_exit, (Datum) 0);
+	batch_timeout_id = RegisterTimeout(USER_TIMEOUT,
+									   track_batch_timeout_handler);
+}
+
+/*
+ * Accumulate the execution in the backend-local buffer. Flush the buffer if
+ * it contains enough executions or is too old. The age is watched by a timer,
+ * started by the first execution of the batch. Commit doesn't flush the
+ * buffer: in autocommit mode that would merge each statement at once, and
+ * a failure would abort the user's commit.
+ */
+static void
+_store_local(DSMOptimizerTrackerKey *key, uint64 planId, const char *querytext,
+			 int len, const TrackerStats *stats)
+{
+	LocalTrackerEntry  *lentry;
+	PlanTrackerKey		pkey;
+	bool				found;
+
+	track_local_buffer_init();
+
+	if (local_htab == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(PlanTrackerKey);
+		ctl.entrysize = sizeof(LocalTrackerEntry);
+		ctl.hcxt = local_buffer_cxt;
+		local_htab = hash_create("pg_track_optimizer local buffer", 64, &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	memset(&pkey, 0, sizeof(PlanTrackerKey));
+	memcpy(&pkey.key, key, sizeof(DSMOptimizerTrackerKey));
+	pkey.planId = planId;
+	lentry = (LocalTrackerEntry *) hash_search(local_htab, &pkey, HASH_ENTER,
+											   &found);
+	if (!found)
+	{
+		lentry->querytext = MemoryContextAlloc(local_buffer_cxt, len + 1);
+		memcpy(lentry->querytext, querytext, len);
+		lentry->querytext[len] = '\0';
+		lentry->querytext_len = len;
+		tracker_stats_init(&lentry->stats);
+	}
+	tracker_stats_merge(&lentry->stats, stats);
+	local_nexecs++;
+
+	if (local_nexecs == 1 && batch_timeout > 0)
+		enable_timeout_after(batch_timeout_id, batch_timeout);
+
+	if (local_nexecs >= batch_size || local_flush_pending || batch_timeout == 0)
+		track_flush_local();
+}
+
+/*
+ * Returns false if memory limit was exceeded.
+ */
+static bool
+store_data(QueryDesc *queryDesc, TrackQueryState *state,
+		   double normalized_error, ScourContext *ctx)
+{
+	DSMOptimizerTrackerKey		key;
+	TrackerStats				stats;
+	const char				   *querytext;
+	int							len;
+	double						weight = state->weight;
+	DBStats					   *dbstats;
+
+	Assert(htab != NULL && state->queryId != UINT64CONST(0));
+
+	/* Cluster-wide counters account every execution analysed */
+	dbstats = db_stats_slot(MyDatabaseId);
+	pg_atomic_fetch_add_u64(&dbstats->nexecs,
+							(uint64) (weight * DB_NEXECS_SCALE + 0.5));
+	pg_atomic_fetch_add_u64(&dbstats->error_time,
+						(uint64) (ctx->error2 * ctx->totaltime * weight * 1e6));
+	if (state->log_min_error >= 0 && normalized_error >= state->log_min_error)
+		pg_atomic_fetch_add_u64(&dbstats->bad_time,
+								(uint64) (ctx->totaltime * weight * 1e6));
+
+	if (!(normalized_error >= state->log_min_error ||
+		  state->track_mode == TRACK_MODE_FORCED))
+		return false;
+
+	memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
+	key.dbOid = MyDatabaseId;
+	key.toplevel = state->toplevel;
+	key.queryId = state->queryId;
+
+	/*
+	 * Statistics on the execution. Plan without assessed nodes doesn't provide
+	 * any estimation error.
+	 */
+	tracker_stats_init(&stats);
+	if (ctx->nnodes > 0)
+	{
+		rstats_add(&stats.relative_error, normalized_error, weight);
+		rstats_add(&stats.error2, ctx->error2, weight);
+	}
+	rstats_add(&stats.exec_time, ctx->totaltime, weight);
+	stats.error_time = ctx->error2 * ctx->totaltime * weight;
+	stats.assessed_nodes = ctx->nnodes;
+	stats.total_nodes = ctx->counter;
+	stats.nexecs = 1;
+	stats.est_nexecs = weight;
+	stats.last_exec = GetCurrentStatementStartTimestamp();
+	stats.worker_skew = ctx->worker_skew;
+	stats.worker_time_skew = ctx->worker_time_skew;
+	stats.workers_short = ctx->workers_short ? 1 : 0;
+	stats.parts_scanned = ctx->parts_scanned;
+	stats.parts_pruned = ctx->parts_pruned;
+
+	/* Store only the text of the statement, not the whole source string */
+	querytext = track_query_text(queryDesc, &len);
+
+	if (batch_size > 0)
+	{
+		_store_local(&key, ctx->planid, querytext, len, &stats);
+		return true;
+	}
+
+	return _merge_stats(&key, ctx->planid, querytext, len, &stats);
+}
+
+static void
+track_ExecutorEnd(QueryDesc *queryDesc)
+{
+	MemoryContext	oldcxt;
+	double			normalized_error = -1.0;
+	ScourContext	ctx;
+	TrackQueryState *state;
+	PhaseTimer		timer;
+
+	state = track_query_state_lookup(queryDesc);
+
+	if (state == NULL || !queryDesc->totaltime ||
+		queryDesc->plannedstmt->queryId != state->queryId)
+		/*
+		 * Just to remember: a stranger extension can decide somewhere in the
+		 * middle to change queryId, eflags or another global variable. So,
+		 * trust only the decision made at the start of the query.
+		 */
+		goto end;
+
+	/* The query is tracked: time to attach to the shared memory */
+	track_attach_shmem();
+
+	/* TODO: need shared state 'status' instead of assertions */
+	Assert(queryDesc->planstate->instrument &&
+			queryDesc->instrument_options & INSTRUMENT_ROWS &&
+			(!state->use_timing ||
+			 queryDesc->instrument_options & INSTRUMENT_TIMER));
+
+	/*
+	 * Make sure we operate in the per-query context, so any cruft will be
+	 * discarded later during ExecutorEnd.
+	 */
+	oldcxt = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+	/*
+	 * Make sure stats accumulation is done.  (Note: it's okay if several
+	 * levels of hook all do this.)
+	 */
+	InstrEndLoop(queryDesc->totaltime);
+
+	/* Only top offenders pay for the per-node detail */
+	ctx.detail = detail_wanted(state) ?
+					palloc(DETAIL_MAX_NODES * sizeof(DetailNode)) : NULL;
+
+	phase_begin(TRACK_PHASE_WALK, &timer);
+	normalized_error = track_prediction_estimation(queryDesc->planstate,
+												   queryDesc->totaltime->total,
+												   state->use_timing,
+												   &ctx);
+	phase_end(&timer);
+
+	if (normalized_error >= 0. && adaptive_enabled())
+		sketch_add(normalized_error);
+
+	/*
+	 * Store data in the hash table and/or print it to the log. Decision on what
+	 * to do each routine makes individually.
+	 */
+	phase_begin(TRACK_PHASE_STORE, &timer);
+	store_data(queryDesc, state, normalized_error, &ctx);
+	phase_end(&timer);
+
+	/* Without batching the advice isn't held back in the local buffer */
+	if (batch_size == 0 && local_advice != NULL)
+	{
+		HTAB   *advice = local_advice;
+
+		local_advice = NULL;
+		phase_begin(TRACK_PHASE_MERGE, &timer);
+		_merge_advice(advice);
+		phase_end(&timer);
+		hash_destroy(advice);
+	}
+	phase_begin(TRACK_PHASE_PLAN, &timer);
+	_store_plan(queryDesc, state, normalized_error);
+	if (ctx.detail != NULL)
+		_store_detail(state, &ctx);
+	phase_end(&timer);
+	phase_begin(TRACK_PHASE_EXPLAIN, &timer);
+	_explain_statement(queryDesc, state, normalized_error);
+	phase_end(&timer);
+
+	/* No locks are held here, so it is safe to collect the garbage */
+	if (gc_pending)
+	{
+		gc_pending = false;
+		track_gc();
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+end:
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * First-time initialization code. Secured by the lock on DSM registry.
+ */
+static void
+to_init_shmem(void *ptr)
+{
+	TODSMRegistry	   *state = (TODSMRegistry *) ptr;
+	int					tranche_id; /* dshash tranche */
+	int					i;
+
+	Assert(htab_dsa == NULL && htab == NULL && txt_htab == NULL);
+
+	tranche_id = LWLockNewTrancheId();
+	LWLockInitialize(&state->evict_lock, tranche_id);
+	LWLockInitialize(&state->slots_lock, tranche_id);
+	LWLockInitialize(&state->io_lock, tranche_id);
+	LWLockInitialize(&state->removed_lock, tranche_id);
+	LWLockInitialize(&state->log_lock, tranche_id);
+
+	tranche_id = LWLockNewTrancheId();
+	LWLockRegisterTranche(tranche_id, "pg_track_optimizer_tranche");
+	htab_dsa = dsa_create(tranche_id);
+	state->dsah = dsa_get_handle(htab_dsa);
+	dsa_pin(htab_dsa);
+
+	htab = dshash_create(htab_dsa, &dsh_params, 0);
+	state->dshh = dshash_get_hash_table_handle(htab);
+	txt_htab = dshash_create(htab_dsa, &txt_params, 0);
+	state->txt_dshh = dshash_get_hash_table_handle(txt_htab);
+	node_htab = dshash_create(htab_dsa, &node_params, 0);
+	state->node_dshh = dshash_get_hash_table_handle(node_htab);
+	plan_htab = dshash_create(htab_dsa, &plan_params, 0);
+	state->plan_dshh = dshash_get_hash_table_handle(plan_htab);
+	advice_htab = dshash_create(htab_dsa, &advice_params, 0);
+	state->advice_dshh = dshash_get_hash_table_handle(advice_htab);
+	pg_atomic_init_u32(&state->advice_counter, 0);
+	relation_htab = dshash_create(htab_dsa, &relation_params, 0);
+	state->relation_dshh = dshash_get_hash_table_handle(relation_htab);
+	pg_atomic_init_u32(&state->relation_counter, 0);
+	pg_atomic_init_u64(&state->txt_mem_used, 0);
+	pg_atomic_init_u32(&state->htab_counter, 0);
+	pg_atomic_init_u32(&state->generation, 0);
+	pg_atomic_init_u32(&state->flush_requested, 0);
+	pg_atomic_init_u64(&state->mem_used, 0);
+	pg_atomic_init_u64(&state->nevicted, 0);
+	pg_atomic_init_u64(&state->ndropped, 0);
+	state->slots = InvalidDsaPointer;
+	state->nslots = 0;
+	state->max_slots = 0;
+	state->free_slot = SLOT_NONE;
+	pg_atomic_init_u32(&state->gc_requested, 0);
+	pg_atomic_init_u32(&state->ndirty, 0);
+	state->delta_records = 0;
+	state->nremoved = 0;
+	state->nlost = 0;
+
+	state->log_ring = InvalidDsaPointer;
+	state->detail_keys = dsa_allocate(htab_dsa,
+						2 * DETAIL_MAX_ENTRIES * sizeof(DSMOptimizerTrackerKey));
+	pg_atomic_init_u32(&state->detail_current, 0);
+	pg_atomic_init_u32(&state->detail_nkeys[0], 0);
+	pg_atomic_init_u32(&state->detail_nkeys[1], 0);
+	pg_atomic_init_u32(&state->detail_count, 0);
+	pg_atomic_init_u64(&state->detail_refresh, 0);
+	for (i = 0; i < 2; i++)
+	{
+		int		j;
+
+		pg_atomic_init_u32(&state->sketches[i].epoch, 0);
+		pg_atomic_init_u64(&state->sketches[i].count, 0);
+		for (j = 0; j < SKETCH_NBUCKETS; j++)
+			pg_atomic_init_u64(&state->sketches[i].buckets[j], 0);
+	}
+	pg_atomic_init_u64(&state->adaptive_threshold, PG_UINT64_MAX);
+	pg_atomic_init_u64(&state->threshold_refresh, 0);
+	state->sketch_start = GetCurrentTimestamp();
+	state->log_head = 0;
+	state->log_tail = 0;
+	state->worker_proc = NULL;
+	pg_atomic_init_u64(&state->log_dropped, 0);
+	for (i = 0; i < LOG_RATE_SLOTS; i++)
+		pg_atomic_init_u64(&state->log_last[i], 0);
+	for (i = 0; i < TRACK_PHASE_COUNT; i++)
+	{
+		pg_atomic_init_u64(&state->phase_stats[i].calls, 0);
+		pg_atomic_init_u64(&state->phase_stats[i].time, 0);
+		pg_atomic_init_u64(&state->phase_stats[i].lock_calls, 0);
+		pg_atomic_init_u64(&state->phase_stats[i].lock_time, 0);
+	}
+	for (i = 0; i < DB_STATS_SLOTS; i++)
+	{
+		DBStats *slot = &state->db_stats[i].stats;
+
+		pg_atomic_init_u32(&slot->dbOid, InvalidOid);
+		pg_atomic_init_u64(&slot->nexecs, 0);
+		pg_atomic_init_u64(&slot->error_time, 0);
+		pg_atomic_init_u64(&slot->bad_time, 0);
+		pg_atomic_init_u64(&slot->ndropped, 0);
+		pg_atomic_init_u64(&slot->nevicted, 0);
+	}
+
+	/*
+	 * GetNamedDSMSegment() hasn't returned yet, but the loading routines need
+	 * the pointer to the shared state.
+	 * The background worker loads the data on its start, outside of the DSM
+	 * registry lock, and nobody waits for that.
+	 */
+	shared = state;
+	pg_atomic_init_u32(&state->load_pending, LOAD_PENDING);
+	state->load_start = GetCurrentTimestamp();
+	state->storage_standby = RecoveryInProgress();
+	if (!worker_registered)
+		track_load_storage();
+}
+
+void
+_PG_init(void)
+{
+	/*
+	 * Inform the postmaster that we want to enable query_id calculation if
+	 * compute_query_id is set to auto.
+	 */
+	EnableQueryId();
+
+	DefineCustomEnumVariable("pg_track_optimizer.mode",
+							 "Mode of the extension usage.",
+							 NULL,
+							 &track_mode,
+							 TRACK_MODE_DISABLED,
+							 format_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_track_optimizer.log_min_error",
+							 "Sets the minimum planning error above which plans will be logged.",
+							 "Zero prints all plans. -1 turns this feature off.",
+							 &log_min_error,
+							 -1.0,
+							 -1.0, INT_MAX, /* Looks like so huge error, as INT_MAX don't make a sense */
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_track_optimizer.log_min_error_quantile",
+							 "Derives log_min_error from the recent distribution of errors.",
+							 "Executions with error above this quantile are logged and stored, e.g. 0.99 means 1% worst ones. log_min_error works as the lower bound. Zero turns this feature off.",
+							 &log_min_error_quantile,
+							 0.,
+							 0., 1.,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.log_target_rate",
+							"Derives log_min_error to log about this number of plans per minute.",
+							"Together with log_min_error_quantile the higher threshold wins. Zero turns this feature off.",
+							&log_target_rate,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_track_optimizer.plan_min_error",
+							 "Store EXPLAIN of the worst execution of a query if its error exceeds this value.",
+							 "Negative value turns off storing of plans.",
+							 &plan_min_error,
+							 -1.0,
+							 -1.0, INT_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_track_optimizer.log_mode",
+							 "How to log plans of badly estimated queries.",
+							 "'async' passes plans to the background worker, available only if the library is loaded via shared_preload_libraries.",
+							 &log_mode,
+							 TRACK_LOG_SYNC,
+							 log_mode_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.log_min_interval",
+							"Minimal interval between logged plans of the same query.",
+							"Zero turns off the limit.",
+							&log_min_interval,
+							0,
+							0, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomRealVariable("pg_track_optimizer.sample_rate",
+							 "Fraction of eligible queries to be instrumented and tracked.",
+							 "Unsampled queries skip instrumentation completely. Statistics are weighted by inverse of the sampling probability.",
+							 &sample_rate,
+							 1.0,
+							 0.0, 1.0,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.adaptive_sample_limit",
+							"Number of samples of a query after which the sampling rate backs off.",
+							"Probability of sampling decreases proportionally to the number of samples already stored. Zero turns this feature off.",
+							&adaptive_sample_limit,
+							0,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_track_optimizer.instrumentation",
+							 "Level of instrumentation of tracked queries.",
+							 "'rows' doesn't read clock at plan nodes and weights node errors by their cost instead of time. 'full' also gathers buffers and WAL usage for logged plans.",
+							 &instrumentation,
+							 TRACK_INSTR_ROWS_TIMING,
+							 instrumentation_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_track_optimizer.eviction",
+							 "Which entries to evict when the hash table reaches hash_mem.",
+							 "'harm' evicts entries with the lowest time spent in badly estimated plans, 'lru' - the least recently executed, 'none' drops new queries.",
+							 &eviction,
+							 TRACK_EVICT_HARM,
+							 eviction_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.text_mem",
+							"Max size of DSM memory allocated to query texts",
+							"Texts are stored once for all the entries referring them. Texts without references are freed when the limit is reached.",
+							&text_mem,
+							4096,
+							0, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.compress_texts",
+							 "Compress long query texts in shared memory.",
+							 NULL,
+							 &compress_texts,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.normalize_texts",
+							 "Store query texts with constants replaced by parameter symbols.",
+							 NULL,
+							 &normalize_texts,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.track_nested",
+							 "Track statements executed inside functions and procedures.",
+							 "Such statements are stored separately from the same statements executed at the top level.",
+							 &track_nested,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.stats_advice",
+							 "Gather sets of columns of badly estimated scans as candidates for extended statistics.",
+							 NULL,
+							 &stats_advice,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.node_histograms",
+							 "Gather histograms of estimation errors per plan node type.",
+							 NULL,
+							 &node_histograms,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.hash_mem",
+							"Max size of DSM memory allocated to hash table entries",
+							NULL,
+							&hash_mem,
+							4096,
+							0, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.batch_size",
+							"Number of executions accumulated locally by a backend before merging into the shared table.",
+							"Zero turns off local accumulation. Local data is also merged after batch_timeout and on backend exit.",
+							&batch_size,
+							0,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.batch_timeout",
+							"Max time the locally accumulated executions may wait before merging into the shared table.",
+							NULL,
+							&batch_timeout,
+							1000,
+							0, INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.flush_interval",
+							"Interval between checkpoints of the background worker.",
+							"Zero turns off periodic checkpoints. Changes are also stored at clean shutdown.",
+							&flush_interval,
+							0,
+							0, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.flush_dirty_entries",
+							"Number of changed entries triggering a checkpoint of the background worker.",
+							"Zero turns off this trigger.",
+							&flush_dirty_entries,
+							0,
+							0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.window_interval",
+							"Length of a time bucket of the recent statistics.",
+							"Each entry keeps "CppAsString2(WINDOW_NBUCKETS)" buckets, see pg_track_optimizer_window().",
+							&window_interval,
+							300,
+							1, INT_MAX / 1000,
+							PGC_POSTMASTER,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.append_children_limit",
+							"Max number of subplans of Append and MergeAppend nodes to be assessed one by one.",
+							"Bigger Append is assessed as a whole, without its subplans. Zero means no limit.",
+							&append_children_limit,
+							0,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.aggregate_partitions",
+							 "Assess Append over partitions as one node.",
+							 "Rows of the partition subplans are summed, the subplans aren't assessed individually.",
+							 &aggregate_partitions,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.max_nodes",
+							"Max number of plan nodes to be assessed.",
+							"Zero means no limit.",
+							&max_nodes,
+							0,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_track_optimizer.detail_entries",
+							"Number of top queries keeping per-node detail of the last execution.",
+							"Queries are ranked by error2 * nexecs by the background worker, so the library must be loaded via shared_preload_libraries. Zero disables the feature.",
+							&detail_entries,
+							0,
+							0, DETAIL_MAX_ENTRIES,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.relation_stats",
+							 "Accumulate estimation errors of scans per relation.",
+							 NULL,
+							 &relation_stats,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_track_optimizer.self_instrumentation",
+							 "Measure time spent by the extension itself.",
+							 "See pg_track_optimizer_self_stats().",
+							 &self_instrumentation,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	MarkGUCPrefixReserved("pg_track_optimizer");
+
+	/* The persistence worker is available only if loaded at the server start */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		BackgroundWorker	worker;
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		/* Standby needs the storage and the log of plans too */
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, EXTENSION_NAME);
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "track_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "%s worker", EXTENSION_NAME);
+		snprintf(worker.bgw_type, BGW_MAXLEN, "%s worker", EXTENSION_NAME);
+		RegisterBackgroundWorker(&worker);
+		worker_registered = true;
+	}
+
+	prev_post_parse_analyze_hook = post_parse_analyze_hook;
+	post_parse_analyze_hook = track_post_parse_analyze;
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = explain_ExecutorStart;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = track_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = track_ExecutorFinish;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = track_ExecutorEnd;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = track_ProcessUtility;
+
+	RegisterXactCallback(track_xact_callback, NULL);
+}
+
+/* -----------------------------------------------------------------------------
+ *
+ * Per-node error histograms
+ *
+ * -------------------------------------------------------------------------- */
+
+/*
+ * Account the estimation error of a plan node in the histogram of its class.
+ */
+static void
+track_node_error(Plan *plan, double error, bool overestimated)
+{
+	NodeHistKey		key;
+	NodeHistEntry  *entry;
+	int				bucket;
+
+	Assert(node_htab != NULL);
+
+	memset(&key, 0, sizeof(NodeHistKey));
+	key.dbOid = MyDatabaseId;
+	key.nodeTag = (int32) nodeTag(plan);
+	switch (nodeTag(plan))
+	{
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			key.jointype = (int32) ((Join *) plan)->jointype;
+			break;
+		default:
+			key.jointype = -1;
+			break;
+	}
+
+	/* Number of the highest power of two not exceeding the factor of error */
+	bucket = (int) Min(error / log(2.), (double) (NODE_HIST_NBUCKETS - 1));
+
+	entry = dshash_find(node_htab, &key, false);
+	if (entry == NULL)
+	{
+		bool	found;
+		int		i;
+
+		/* A histogram is created once per node class, so it is a rare case */
+		entry = dshash_find_or_insert(node_htab, &key, &found);
+		if (!found)
+		{
+			for (i = 0; i < NODE_HIST_NBUCKETS; i++)
+				pg_atomic_init_u64(&entry->buckets[i], 0);
+			pg_atomic_init_u64(&entry->noverestimated, 0);
+			pg_atomic_init_u64(&entry->error_sum, 0);
+		}
+	}
+
+	pg_atomic_fetch_add_u64(&entry->buckets[bucket], 1);
+	if (overestimated)
+		pg_atomic_fetch_add_u64(&entry->noverestimated, 1);
+	pg_atomic_fetch_add_u64(&entry->error_sum,
+							(uint64) (error * NODE_HIST_SCALE));
+	dshash_release_lock(node_htab, entry);
+}
+
+/*
+ * Account the estimation error of a scan in the entry of its relation. Only
+ * scans of tables and materialized views are counted: ANALYZE can help them.
+ */
+static void
+track_relation_error(PlanState *pstate, double error, double relative_time,
+					 bool overestimated)
+{
+	Plan			   *plan = pstate->plan;
+	Index				scanrelid;
+	RangeTblEntry	   *rte;
+	RelationErrorKey	key;
+	RelationErrorEntry *entry;
+
+	Assert(relation_htab != NULL);
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_TidRangeScan:
+			break;
+		default:
+			return;
+	}
+
+	scanrelid = ((Scan *) plan)->scanrelid;
+	if (scanrelid == 0)
+		return;
+
+	rte = exec_rt_fetch(scanrelid, pstate->state);
+	if (rte->rtekind != RTE_RELATION ||
+		(rte->relkind != RELKIND_RELATION && rte->relkind != RELKIND_MATVIEW))
+		return;
+
+	memset(&key, 0, sizeof(RelationErrorKey));
+	key.dbOid = MyDatabaseId;
+	key.relid = rte->relid;
+
+	entry = dshash_find(relation_htab, &key, false);
+	if (entry == NULL)
+	{
+		bool	found;
+
+		if (pg_atomic_read_u32(&shared->relation_counter) >= RELATION_MAX_ENTRIES)
+			return;
+
+		entry = dshash_find_or_insert(relation_htab, &key, &found);
+		if (!found)
+		{
+			pg_atomic_init_u64(&entry->nscans, 0);
+			pg_atomic_init_u64(&entry->noverestimated, 0);
+			pg_atomic_init_u64(&entry->error_sum, 0);
+			pg_atomic_init_u64(&entry->error2_sum, 0);
+			pg_atomic_fetch_add_u32(&shared->relation_counter, 1);
+		}
+	}
+
+	pg_atomic_fetch_add_u64(&entry->nscans, 1);
+	if (overestimated)
+		pg_atomic_fetch_add_u64(&entry->noverestimated, 1);
+	pg_atomic_fetch_add_u64(&entry->error_sum,
+							(uint64) (error * NODE_HIST_SCALE));
+	pg_atomic_fetch_add_u64(&entry->error2_sum,
+							(uint64) (error * relative_time * NODE_HIST_SCALE));
+	dshash_release_lock(relation_htab, entry);
+}
+
+/* -----------------------------------------------------------------------------
+ *
+ * Extended statistics advice
+ *
+ * -------------------------------------------------------------------------- */
+
+typedef struct IndexAttnosContext
+{
+	List	   *indextlist;
+	Index		scanrelid;
+	Bitmapset  *attrs;
+} IndexAttnosContext;
+
+/*
+ * Quals of an Index Only Scan refer to columns of the index (INDEX_VAR): map
+ * them to columns of the table through the index target list.
+ */
+static bool
+index_attnos_walker(Node *node, IndexAttnosContext *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Var) && ((Var *) node)->varno == INDEX_VAR)
+	{
+		Var	   *var = (Var *) node;
+
+		if (var->varattno > 0 &&
+			var->varattno <= list_length(context->indextlist))
+		{
+			TargetEntry *tle = list_nth_node(TargetEntry, context->indextlist,
+											 var->varattno - 1);
+
+			pull_varattnos((Node *) tle->expr, context->scanrelid,
+						   &context->attrs);
+		}
+		return false;
+	}
+
+	return expression_tree_walker(node, index_attnos_walker, context);
+}
+
+/*
+ * Remember the set of columns involved in quals of a badly estimated scan.
+ * Correlation between columns of a multi-column qual is the typical source of
+ * such an error, which extended statistics can fix.
+ * The node is accounted in the local buffer: a plan may have many misestimated
+ * scans of the same columns, and the shared table is locked once per batch.
+ */
+static void
+track_advice(PlanState *pstate, double error, double relative_time)
+{
+	Plan		   *plan = pstate->plan;
+	Index			scanrelid;
+	RangeTblEntry  *rte;
+	List		   *indexquals = NIL;
+	Bitmapset	   *attrs = NULL;
+	AdviceKey		key;
+	AdviceEntry	   *entry;
+	int				x = -1;
+	bool			found;
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_TidRangeScan:
+		case T_IndexOnlyScan:
+			break;
+		case T_IndexScan:
+			indexquals = ((IndexScan *) plan)->indexqualorig;
+			break;
+		case T_BitmapHeapScan:
+			indexquals = ((BitmapHeapScan *) plan)->bitmapqualorig;
+			break;
+		default:
+			/* Not a scan of a base relation */
+			return;
+	}
+
+	scanrelid = ((Scan *) plan)->scanrelid;
+	if (scanrelid == 0)
+		return;
+
+	rte = exec_rt_fetch(scanrelid, pstate->state);
+	if (rte->rtekind != RTE_RELATION ||
+		(rte->relkind != RELKIND_RELATION && rte->relkind != RELKIND_MATVIEW))
+		return;
+
+	if (IsA(plan, IndexOnlyScan))
+	{
+		IndexOnlyScan		   *ios = (IndexOnlyScan *) plan;
+		IndexAttnosContext		context;
+
+		context.indextlist = ios->indextlist;
+		context.scanrelid = scanrelid;
+		context.attrs = NULL;
+		(void) index_attnos_walker((Node *) plan->qual, &context);
+		(void) index_attnos_walker((Node *) ios->indexqual, &context);
+		attrs = context.attrs;
+	}
+	else
+	{
+		pull_varattnos((Node *) plan->qual, scanrelid, &attrs);
+		pull_varattnos((Node *) indexquals, scanrelid, &attrs);
+	}
+
+	memset(&key, 0, sizeof(AdviceKey));
+	key.dbOid = MyDatabaseId;
+	key.relid = rte->relid;
+	while ((x = bms_next_member(attrs, x)) >= 0)
+	{
+		AttrNumber	attnum = x + FirstLowInvalidHeapAttributeNumber;
+
+		/* System columns can't be used in statistics */
+		if (attnum <= 0)
+			continue;
+
+		/* Too many columns for one statistics object */
+		if (key.natts >= STATS_MAX_DIMENSIONS)
+			return;
+
+		key.attnums[key.natts++] = attnum;
+	}
+
+	/* Single column is covered by the plain statistics */
+	if (key.natts < 2)
+		return;
+
+	track_local_buffer_init();
+	if (local_advice == NULL)
+	{
+		HASHCTL		ctl;
+
+		ctl.keysize = sizeof(AdviceKey);
+		ctl.entrysize = sizeof(AdviceEntry);
+		ctl.hcxt = local_buffer_cxt;
+		local_advice = hash_create("pg_track_optimizer local advice", 16, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (AdviceEntry *) hash_search(local_advice, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->nnodes = 0;
+		entry->error2 = 0.;
+		entry->max_error = 0.;
+	}
+	entry->nnodes++;
+	entry->error2 += error * relative_time;
+	entry->max_error = Max(entry->max_error, error);
+}
+
+/*
+ * Merge the advice accumulated in the local buffer into the shared table.
+ */
+static void
+_merge_advice(HTAB *advice)
+{
+	HASH_SEQ_STATUS	hstat;
+	AdviceEntry	   *lentry;
+
+	Assert(advice_htab != NULL);
+
+	hash_seq_init(&hstat, advice);
+	while ((lentry = (AdviceEntry *) hash_seq_search(&hstat)) != NULL)
+	{
+		AdviceEntry	   *entry;
+		bool			found;
+
+		entry = dshash_find(advice_htab, &lentry->key, true);
+		if (entry == NULL)
+		{
+			if (pg_atomic_read_u32(&shared->advice_counter) >= ADVICE_MAX_ENTRIES)
+				continue;
+
+			entry = dshash_find_or_insert(advice_htab, &lentry->key, &found);
+			if (!found)
+			{
+				entry->nnodes = 0;
+				entry->error2 = 0.;
+				entry->max_error = 0.;
+				pg_atomic_fetch_add_u32(&shared->advice_counter, 1);
+			}
+		}
+
+		entry->nnodes += lentry->nnodes;
+		entry->error2 += lentry->error2;
+		entry->max_error = Max(entry->max_error, lentry->max_error);
+		dshash_release_lock(advice_htab, entry);
+	}
+}
+
+/*
+ * Fingerprint of the plan node structure, including fingerprints of its
+ * children. Only things defining the shape of the plan are used: node types,
+ * relations, indexes, join types and strategies. Constants and estimations are
+ * ignored, so the same plan with different parameters has the same value.
+ */
+static uint64
+plan_node_fingerprint(PlanState *pstate, uint64 children)
+{
+	Plan   *plan = pstate->plan;
+	uint64	hash;
+
+	hash = hash_combine64(murmurhash64((uint64) nodeTag(plan)), children);
+
+	switch (nodeTag(plan))
+	{
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			hash = hash_combine64(hash,
+								  murmurhash64((uint64) ((Join *) plan)->jointype));
+			break;
+		case T_Agg:
+			hash = hash_combine64(hash,
+								  murmurhash64((uint64) ((Agg *) plan)->aggstrategy));
+			break;
+		case T_IndexScan:
+			hash = hash_combine64(hash,
+								  murmurhash64((uint64) ((IndexScan *) plan)->indexid));
+			break;
+		case T_IndexOnlyScan:
+			hash = hash_combine64(hash,
+								  murmurhash64((uint64) ((IndexOnlyScan *) plan)->indexid));
+			break;
+		case T_BitmapIndexScan:
+			hash = hash_combine64(hash,
+								  murmurhash64((uint64) ((BitmapIndexScan *) plan)->indexid));
+			break;
+		default:
+			break;
+	}
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapIndexScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+		case T_TidRangeScan:
+		case T_ForeignScan:
+		case T_CustomScan:
+			{
+				Index	scanrelid = ((Scan *) plan)->scanrelid;
+
+				/* Foreign and custom scans may have no base relation */
+				if (scanrelid > 0)
+				{
+					RangeTblEntry *rte = exec_rt_fetch(scanrelid, pstate->state);
+
+					hash = hash_combine64(hash, murmurhash64((uint64) rte->relid));
+				}
+			}
+			break;
+		default:
+			break;
+	}
+
+	return hash;
+}
+
+/*
+ * The plan is passed iteratively, with an explicit stack: plans over thousands
+ * of partitions would make the recursion deep. The stack is kept between
+ * queries, so in a steady state the pass doesn't allocate memory.
+ */
+typedef struct WalkFrame
+{
+	PlanState  *pstate;
+	uint64		children_hash; /* Combined fingerprints of children */
+	int			first_child; /* Position in the children array */
+	int			nchildren;
+	int			next_child; /* Next child to visit */
+	bool		leaf;
+
+	/* Append over partitions assessed as one node, see aggregate_partitions */
+	bool		aggregated;
+	double		plan_rows; /* Sums over the subplans */
+	double		real_rows;
+} WalkFrame;
+
+typedef struct WalkStack
+{
+	WalkFrame  *frames;
+	int			nframes;
+	int			maxframes;
+
+	/* Children of all the nodes on the stack */
+	PlanState **children;
+	int			nchildren;
+	int			maxchildren;
+} WalkStack;
+
+/*
+ * Calculate number of rows predicted by the optimizer and really passed through
+ * the node per loop. Returns false if the node can't be assessed.
+ */
+static bool
+node_rows(PlanState *pstate, bool leaf, ScourContext *ctx,
+		  double *plan_rows, double *real_rows)
+{
+	double	nloops;
+
+	*real_rows = 0.;
+
+	/*
+	 * Finish the node before an analysis. And only after that we can touch any
+	 * instrument fields.
+	 */
+	InstrEndLoop(pstate->instrument);
+	nloops = pstate->instrument->nloops;
+
+	if (nloops <= 0.0 ||
+		(ctx->use_timing && pstate->instrument->total == 0.0))
+		/*
+		 * Skip 'never executed' case or "0-Tuple situation" and the case of
+		 * manual switching off of the timing instrumentation
+		 */
+		return false;
+
+	/*
+	 * Calculate number of rows predicted by the optimizer and really passed
+	 * through the node. This simplistic code becomes a bit tricky in the case
 	 * of parallel workers.
 	 */
-	if (pstate->worker_instrument)
+	if (pstate->worker_instrument)
+	{
+		double	wnloops = 0.;
+		double	wntuples = 0.;
+		double	divisor = pstate->worker_instrument->num_workers;
+		double	max_tuples = 0.;
+		double	sum_tuples = 0.;
+		double	max_time = 0.;
+		double	sum_time = 0.;
+		int		nactive = 0;
+		int i;
+
+		/* XXX: Copy-pasted from the get_parallel_divisor() */
+		if (parallel_leader_participation)
+		{
+			double	leader_contribution;
+
+			leader_contribution = 1.0 - (0.3 * divisor);
+			if (leader_contribution > 0)
+				divisor += leader_contribution;
+		}
+		*plan_rows = pstate->plan->plan_rows * divisor;
+
+		/*
+		 * Skew of the work between workers. Only workers which have run the
+		 * node are counted: a worker launched too late to get any work, or not
+		 * launched at all, isn't a skew of the node (see workers_short).
+		 */
+		for (i = 0; i < pstate->worker_instrument->num_workers; i++)
+		{
+			Instrumentation *winstr = &pstate->worker_instrument->instrument[i];
+
+			if (winstr->nloops <= 0.)
+				continue;
+
+			max_tuples = Max(max_tuples, winstr->ntuples);
+			sum_tuples += winstr->ntuples;
+			max_time = Max(max_time, winstr->total);
+			sum_time += winstr->total;
+			nactive++;
+		}
+		if (sum_tuples > 0.)
+			ctx->worker_skew = Max(ctx->worker_skew,
+								   max_tuples * nactive / sum_tuples);
+		if (ctx->use_timing && sum_time > 0.)
+			ctx->worker_time_skew = Max(ctx->worker_time_skew,
+										max_time * nactive / sum_time);
+
+		for (i = 0; i < pstate->worker_instrument->num_workers; i++)
+		{
+			double t = pstate->worker_instrument->instrument[i].ntuples;
+			double l = pstate->worker_instrument->instrument[i].nloops;
+
+			if (l <= 0.0)
+			{
+				/*
+				 * Worker could start but not to process any tuples just because
+				 * of laziness. Skip such a node.
+				 */
+				continue;
+			}
+
+			wntuples += t;
+
+			/* In leaf nodes we should get into account filtered tuples */
+			if (leaf)
+				wntuples += pstate->worker_instrument->instrument[i].nfiltered1 +
+							pstate->worker_instrument->instrument[i].nfiltered2 +
+							pstate->instrument->ntuples2;
+
+			wnloops += l;
+			*real_rows += t/l;
+		}
+
+		Assert(nloops >= wnloops);
+
+		/* Calculate the part of job have made by the main process */
+		if (nloops - wnloops > 0.0)
+		{
+			double	ntuples = pstate->instrument->ntuples;
+
+			/* In leaf nodes we should get into account filtered tuples */
+			if (leaf)
+				ntuples += (pstate->instrument->nfiltered1 +
+												pstate->instrument->nfiltered2 +
+												pstate->instrument->ntuples2);
+
+			Assert(ntuples >= wntuples);
+			*real_rows += (ntuples - wntuples) / (nloops - wnloops);
+		}
+	}
+	else
+	{
+		*plan_rows = pstate->plan->plan_rows;
+		*real_rows = pstate->instrument->ntuples / nloops;
+
+		/* In leaf nodes we should get into account filtered tuples */
+		if (leaf)
+			*real_rows += (pstate->instrument->nfiltered1 +
+									pstate->instrument->nfiltered2 +
+									pstate->instrument->ntuples2) / nloops;
+	}
+
+	return true;
+}
+
+/*
+ * Assess the estimation error of a plan node. Children are already assessed.
+ * Leaf nodes take into account tuples filtered out. Append over partitions,
+ * aggregated by the walker, is assessed by rows of its subplans.
+ */
+static void
+assess_node(PlanState *pstate, bool leaf, const WalkFrame *frame,
+			ScourContext *ctx)
+{
+	double			plan_rows,
+					real_rows;
+	double			error;
+	double			relative_time;
+
+	/* Parallel plan that could not get all the planned workers */
+	if (IsA(pstate, GatherState))
+	{
+		if (((GatherState *) pstate)->nworkers_launched <
+			((Gather *) pstate->plan)->num_workers)
+			ctx->workers_short = true;
+	}
+	else if (IsA(pstate, GatherMergeState))
+	{
+		if (((GatherMergeState *) pstate)->nworkers_launched <
+			((GatherMerge *) pstate->plan)->num_workers)
+			ctx->workers_short = true;
+	}
+
+	if (!node_rows(pstate, leaf, ctx, &plan_rows, &real_rows))
+		return;
+
+	if (frame != NULL && frame->aggregated)
+	{
+		plan_rows = frame->plan_rows;
+		real_rows = frame->real_rows;
+	}
+
+	plan_rows = clamp_row_est(plan_rows);
+	real_rows = clamp_row_est(real_rows);
+
+	/*
+	 * Now, we can calculate a value of the estimation relative error has made
+	 * by the optimizer.
+	 */
+	Assert(!ctx->use_timing || pstate->instrument->total > 0.0);
+
+	error = fabs(log(real_rows / plan_rows));
+	ctx->error += error;
+	ctx->nnodes++;
+
+	if (node_histograms)
+		track_node_error(pstate->plan, error, plan_rows > real_rows);
+
+	if (ctx->use_timing)
+		relative_time = pstate->instrument->total / pstate->instrument->nloops / ctx->totaltime;
+	else if (ctx->totalcost > 0.)
+		/* Cheap proxy: share of the node cost in the cost of the whole plan */
+		relative_time = pstate->plan->total_cost / ctx->totalcost;
+	else
+		relative_time = 0.;
+	ctx->error2 += error * relative_time;
+
+	if (stats_advice && error >= ADVICE_MIN_ERROR)
+		track_advice(pstate, error, relative_time);
+
+	if (relation_stats)
+		track_relation_error(pstate, error, relative_time,
+							 plan_rows > real_rows);
+}
+
+/*
+ * Remember the node in the per-node detail. Nodes past DETAIL_MAX_NODES are
+ * skipped: the walk is post-order, so the top of a huge plan is lost, but
+ * misestimation usually starts at the bottom.
+ */
+static void
+detail_capture(PlanState *pstate, ScourContext *ctx)
+{
+	Instrumentation	   *instr = pstate->instrument;
+	DetailNode		   *node;
+
+	if (instr == NULL || ctx->ndetail >= DETAIL_MAX_NODES)
+		return;
+
+	node = &ctx->detail[ctx->ndetail++];
+	node->node_id = pstate->plan->plan_node_id;
+	node->tag = (int32) nodeTag(pstate->plan);
+	node->plan_rows = pstate->plan->plan_rows;
+	node->loops = instr->nloops;
+	node->actual_rows = (instr->nloops > 0.) ? instr->ntuples / instr->nloops : 0.;
+	node->time = instr->total * 1000.;
+}
+
+static WalkStack walk_stack = {NULL, 0, 0, NULL, 0, 0};
+
+static bool
+walk_has_child(PlanState *child, void *context)
+{
+	return true;
+}
+
+/*
+ * Is it an Append or MergeAppend over partitions of a partitioned table?
+ * Returns its subplans left after the startup pruning, the number of subplans
+ * in the plan and the subplans valid after the last runtime pruning (NULL if
+ * not known yet).
+ */
+static bool
+is_partitioned_append(PlanState *pstate, PlanState ***subplans, int *nsubplans,
+					  int *nplanned, Bitmapset **valid)
+{
+	Bitmapset  *apprelids;
+	int			x = -1;
+
+	if (IsA(pstate, AppendState))
+	{
+		AppendState *astate = (AppendState *) pstate;
+
+		apprelids = ((Append *) pstate->plan)->apprelids;
+		*subplans = astate->appendplans;
+		*nsubplans = astate->as_nplans;
+		*nplanned = list_length(((Append *) pstate->plan)->appendplans);
+		*valid = astate->as_valid_subplans_identified ?
+					astate->as_valid_subplans : NULL;
+	}
+	else if (IsA(pstate, MergeAppendState))
+	{
+		MergeAppendState *mstate = (MergeAppendState *) pstate;
+
+		apprelids = ((MergeAppend *) pstate->plan)->apprelids;
+		*subplans = mstate->mergeplans;
+		*nsubplans = mstate->ms_nplans;
+		*nplanned = list_length(((MergeAppend *) pstate->plan)->mergeplans);
+		*valid = mstate->ms_initialized ? mstate->ms_valid_subplans : NULL;
+	}
+	else
+		return false;
+
+	while ((x = bms_next_member(apprelids, x)) >= 0)
+	{
+		if (exec_rt_fetch(x, pstate->state)->relkind == RELKIND_PARTITIONED_TABLE)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Number of partitions the planner has thrown away: partitions of the
+ * partitioned table minus the planned subplans. With partitionwise join the
+ * Append covers several tables partitioned the same way, so the biggest of
+ * them is taken. Sub-partitions of a multi-level hierarchy are planned in the
+ * same Append, so for such a hierarchy it is a lower bound.
+ */
+static int
+append_plan_pruned(PlanState *pstate, int nplanned)
+{
+	Bitmapset  *apprelids;
+	int			nparts = 0;
+	int			x = -1;
+
+	apprelids = IsA(pstate, AppendState) ?
+					((Append *) pstate->plan)->apprelids :
+					((MergeAppend *) pstate->plan)->apprelids;
+
+	while ((x = bms_next_member(apprelids, x)) >= 0)
+	{
+		RangeTblEntry  *rte = exec_rt_fetch(x, pstate->state);
+		Relation		rel;
+
+		if (rte->relkind != RELKIND_PARTITIONED_TABLE)
+			continue;
+
+		/* The executor holds a lock on the table */
+		rel = RelationIdGetRelation(rte->relid);
+		if (!RelationIsValid(rel))
+			continue;
+		nparts = Max(nparts, RelationGetPartitionDesc(rel, true)->nparts);
+		RelationClose(rel);
+	}
+
+	return Max(nparts - nplanned, 0);
+}
+
+/*
+ * Sum rows of the subplans: the Append is assessed as one logical node and the
+ * subplans aren't visited. A subplan that didn't run adds nothing.
+ */
+static void
+walk_aggregate(WalkFrame *frame, PlanState **subplans, int nsubplans,
+			   int nplanned, ScourContext *ctx)
+{
+	int		i;
+
+	frame->aggregated = true;
+	frame->children_hash = murmurhash64((uint64) nplanned);
+	for (i = 0; i < nsubplans; i++)
+	{
+		bool	leaf = !planstate_tree_walker(subplans[i], walk_has_child, NULL);
+		double	plan_rows;
+		double	real_rows;
+
+		if (!node_rows(subplans[i], leaf, ctx, &plan_rows, &real_rows))
+			continue;
+
+		frame->plan_rows += plan_rows;
+		frame->real_rows += real_rows;
+	}
+}
+
+/*
+ * Count scanned and pruned partitions of the Append. With aggregate_partitions,
+ * the Append is aggregated, see walk_aggregate. Returns true in the latter case.
+ * A subplan that didn't run for another reason, like a LIMIT above the Append
+ * satisfied earlier, is neither scanned nor pruned.
+ */
+static bool
+walk_partitions(WalkFrame *frame, ScourContext *ctx)
+{
+	PlanState **subplans;
+	Bitmapset  *valid;
+	int			nsubplans;
+	int			nplanned;
+	int			nscanned = 0;
+	int			i;
+
+	if (!is_partitioned_append(frame->pstate, &subplans, &nsubplans, &nplanned,
+							   &valid))
+		return false;
+
+	for (i = 0; i < nsubplans; i++)
+	{
+		InstrEndLoop(subplans[i]->instrument);
+		if (subplans[i]->instrument->nloops > 0.)
+			nscanned++;
+	}
+
+	/* Pruned by the planner, at the executor startup and in runtime */
+	ctx->parts_scanned += nscanned;
+	ctx->parts_pruned += append_plan_pruned(frame->pstate, nplanned) +
+						 (nplanned - nsubplans) +
+						 (valid != NULL ? nsubplans - bms_num_members(valid) : 0);
+
+	if (!aggregate_partitions)
+		return false;
+
+	walk_aggregate(frame, subplans, nsubplans, nplanned, ctx);
+	return true;
+}
+
+static bool
+walk_collect_child(PlanState *child, void *context)
+{
+	WalkStack *stack = (WalkStack *) context;
+
+	if (stack->nchildren >= stack->maxchildren)
+	{
+		stack->maxchildren *= 2;
+		stack->children = repalloc(stack->children,
+								   stack->maxchildren * sizeof(PlanState *));
+	}
+	stack->children[stack->nchildren++] = child;
+
+	/* Don't go deeper: only direct children are collected */
+	return false;
+}
+
+/*
+ * Put the node on the stack and collect its children. Children of an Append
+ * or MergeAppend over more than append_children_limit subplans are not
+ * visited: such a node is aggregated, and its subplans are just counted. The
+ * same for Append over partitions with aggregate_partitions, but its subplans
+ * aren't counted. Nothing is visited after max_nodes nodes.
+ */
+static void
+walk_push(WalkStack *stack, PlanState *pstate, ScourContext *ctx)
+{
+	WalkFrame  *frame;
+	PlanState **subplans = NULL;
+	int			nplans = -1;
+
+	if (stack->nframes >= stack->maxframes)
+	{
+		stack->maxframes *= 2;
+		stack->frames = repalloc(stack->frames,
+								 stack->maxframes * sizeof(WalkFrame));
+	}
+
+	ctx->counter++;
+
+	frame = &stack->frames[stack->nframes++];
+	frame->pstate = pstate;
+	frame->children_hash = 0;
+	frame->first_child = stack->nchildren;
+	frame->next_child = 0;
+	frame->leaf = false;
+	frame->aggregated = false;
+	frame->plan_rows = 0.;
+	frame->real_rows = 0.;
+
+	if (IsA(pstate, AppendState))
+	{
+		subplans = ((AppendState *) pstate)->appendplans;
+		nplans = ((AppendState *) pstate)->as_nplans;
+	}
+	else if (IsA(pstate, MergeAppendState))
+	{
+		subplans = ((MergeAppendState *) pstate)->mergeplans;
+		nplans = ((MergeAppendState *) pstate)->ms_nplans;
+	}
+
+	if (nplans >= 0 && walk_partitions(frame, ctx))
+	{
+		/* Subplans are summarised already */
+	}
+	else if (append_children_limit > 0 && nplans > append_children_limit)
+	{
+		ctx->counter += nplans;
+		walk_aggregate(frame, subplans, nplans, nplans, ctx);
+	}
+	else
+	{
+		planstate_tree_walker(pstate, walk_collect_child, stack);
+		frame->leaf = (stack->nchildren == frame->first_child);
+
+		/* The budget is exhausted, forget the children */
+		if (max_nodes > 0 && ctx->counter >= max_nodes)
+			stack->nchildren = frame->first_child;
+	}
+
+	frame->nchildren = stack->nchildren - frame->first_child;
+}
+
+/*
+ * Assess nodes of the plan in the post-order and calculate the fingerprint of
+ * the plan: a node's fingerprint includes fingerprints of its children.
+ */
+static void
+prediction_walk(PlanState *root, ScourContext *ctx)
+{
+	WalkStack  *stack = &walk_stack;
+
+	if (stack->frames == NULL)
+	{
+		stack->maxframes = 64;
+		stack->frames = MemoryContextAlloc(TopMemoryContext,
+										   stack->maxframes * sizeof(WalkFrame));
+		stack->maxchildren = 256;
+		stack->children = MemoryContextAlloc(TopMemoryContext,
+											 stack->maxchildren * sizeof(PlanState *));
+	}
+
+	/* May be left dirty by an error in the middle of the previous pass */
+	stack->nframes = 0;
+	stack->nchildren = 0;
+
+	walk_push(stack, root, ctx);
+	while (stack->nframes > 0)
+	{
+		WalkFrame  *frame = &stack->frames[stack->nframes - 1];
+		uint64		hash;
+
+		/* The budget is exhausted: siblings collected earlier aren't visited */
+		if (max_nodes > 0 && ctx->counter >= max_nodes)
+			frame->next_child = frame->nchildren;
+
+		if (frame->next_child < frame->nchildren)
+		{
+			/* The frame pointer may be invalidated by the push */
+			walk_push(stack,
+					  stack->children[frame->first_child + frame->next_child++],
+					  ctx);
+			continue;
+		}
+
+		/* All the children have combined their fingerprints */
+		hash = plan_node_fingerprint(frame->pstate, frame->children_hash);
+		assess_node(frame->pstate, frame->leaf, frame, ctx);
+		if (ctx->detail != NULL)
+			detail_capture(frame->pstate, ctx);
+
+		stack->nchildren = frame->first_child;
+		stack->nframes--;
+
+		if (stack->nframes > 0)
+		{
+			WalkFrame *parent = &stack->frames[stack->nframes - 1];
+
+			parent->children_hash = hash_combine64(parent->children_hash, hash);
+		}
+		else
+			ctx->planid = hash_combine64(UINT64CONST(0), hash);
+	}
+}
+
+static double
+track_prediction_estimation(PlanState *pstate, double totaltime,
+							bool use_timing, ScourContext *ctx)
+{
+	ctx->error = 0.;
+	ctx->error2 = 0.;
+	ctx->totaltime = totaltime;
+	ctx->use_timing = use_timing;
+	ctx->totalcost = pstate->plan->total_cost;
+	ctx->nnodes = 0;
+	ctx->counter = 0;
+	ctx->planid = 0;
+	ctx->worker_skew = 0.;
+	ctx->worker_time_skew = 0.;
+	ctx->workers_short = false;
+	ctx->parts_scanned = 0;
+	ctx->parts_pruned = 0;
+	ctx->ndetail = 0;
+
+	Assert(totaltime > 0.);
+	prediction_walk(pstate, ctx);
+
+	/* Zero is reserved for "no plan" */
+	if (ctx->planid == UINT64CONST(0))
+		ctx->planid = UINT64CONST(1);
+	return (ctx->nnodes > 0) ? (ctx->error / ctx->nnodes) : -1.0;
+}
+
+/* -----------------------------------------------------------------------------
+ *
+ * UI routines
+ *
+ */
+
+static void
+_init_rsinfo(PG_FUNCTION_ARGS, ReturnSetInfo *rsinfo, int total_ncols)
+{
+	MemoryContext	 oldcontext;
+	TupleDesc		 tup_desc;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tup_desc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tup_desc->natts != total_ncols)
+		elog(ERROR, "incorrect number of output arguments");
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->setDesc = tup_desc;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Copy fixed-size entries of the hash table into local memory. Each partition
+ * is locked only while its entries are copied, so readers and writers of the
+ * disk don't hold dshash locks while forming tuples or doing I/O.
+ * The copy isn't a consistent snapshot of the whole table: entries of already
+ * passed partitions may change in the meantime. It is fine for statistics.
+ *
+ * Dirty flags are left as they are: a checkpoint clears them by _clear_dirty
+ * after the write has succeeded.
+ * The caller should pfree the result.
+ */
+static DSMOptimizerTrackerEntry *
+_snapshot_entries(bool only_dirty, uint32 *nentries)
+{
+	dshash_seq_status			stat;
+	DSMOptimizerTrackerEntry   *entry;
+	DSMOptimizerTrackerEntry   *snapshot;
+	Size						nalloc;
+	uint32						n = 0;
+
+	nalloc = Max(only_dirty ? pg_atomic_read_u32(&shared->ndirty) :
+						pg_atomic_read_u32(&shared->htab_counter), 64);
+	snapshot = MemoryContextAllocHuge(CurrentMemoryContext,
+									  nalloc * sizeof(DSMOptimizerTrackerEntry));
+
+	dshash_seq_init(&stat, htab, false);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		Assert(entry->key.queryId != UINT64CONST(0) &&
+			   OidIsValid(entry->key.dbOid));
+
+		if ((only_dirty && !entry->dirty) || entry_is_stale(entry->generation))
+			continue;
+
+		if (n >= nalloc)
+		{
+			nalloc *= 2;
+			snapshot = repalloc_huge(snapshot,
+									 nalloc * sizeof(DSMOptimizerTrackerEntry));
+		}
+
+		memcpy(&snapshot[n], entry, sizeof(DSMOptimizerTrackerEntry));
+		n++;
+	}
+	dshash_seq_term(&stat);
+
+	*nentries = n;
+	return snapshot;
+}
+
+/*
+ * Clear dirty flags of the entries stored by a checkpoint. An entry changed
+ * since its snapshot was taken stays dirty for the next one.
+ */
+static void
+_clear_dirty(const DSMOptimizerTrackerEntry *snapshot, uint32 nentries)
+{
+	uint32	i;
+
+	for (i = 0; i < nentries; i++)
+	{
+		DSMOptimizerTrackerEntry   *entry;
+
+		if (!snapshot[i].dirty)
+			continue;
+
+		entry = dshash_find(htab, &snapshot[i].key, true);
+		if (entry == NULL)
+			continue;
+
+		if (entry->dirty && entry->changes == snapshot[i].changes)
+		{
+			entry->dirty = false;
+			pg_atomic_fetch_sub_u32(&shared->ndirty, 1);
+		}
+		dshash_release_lock(htab, entry);
+	}
+}
+
+/*
+ * Take the queue of removed keys before a checkpoint. The keys are copied into
+ * *keys, if it isn't NULL. The queue is shortened by _forget_removals after
+ * the write: removals queued in the meantime wait for the next checkpoint.
+ * Returns number of the queued keys.
+ */
+static uint32
+_take_removals(DSMOptimizerTrackerKey **keys, uint32 *nlost)
+{
+	uint32	nremoved;
+
+	LWLockAcquire(&shared->removed_lock, LW_SHARED);
+	nremoved = shared->nremoved;
+	*nlost = shared->nlost;
+	if (keys != NULL)
+	{
+		*keys = palloc(Max(nremoved, 1) * sizeof(DSMOptimizerTrackerKey));
+		memcpy(*keys, shared->removed,
+			   nremoved * sizeof(DSMOptimizerTrackerKey));
+	}
+	LWLockRelease(&shared->removed_lock);
+
+	return nremoved;
+}
+
+static void
+_forget_removals(uint32 nremoved, uint32 nlost)
+{
+	LWLockAcquire(&shared->removed_lock, LW_EXCLUSIVE);
+	Assert(shared->nremoved >= nremoved && shared->nlost >= nlost);
+	memmove(shared->removed, shared->removed + nremoved,
+			(shared->nremoved - nremoved) * sizeof(DSMOptimizerTrackerKey));
+	shared->nremoved -= nremoved;
+	shared->nlost -= nlost;
+	LWLockRelease(&shared->removed_lock);
+}
+
+/*
+ * Number of removals the next checkpoint should write
+ */
+static uint32
+_pending_removals(void)
+{
+	uint32	n;
+
+	LWLockAcquire(&shared->removed_lock, LW_SHARED);
+	n = shared->nremoved + shared->nlost;
+	LWLockRelease(&shared->removed_lock);
+
+	return n;
+}
+
+/*
+ * Form values of the output tuple for an entry of the tracker hash table.
+ * Time values are converted from seconds to milliseconds.
+ */
+static void
+_fill_entry_values(DSMOptimizerTrackerEntry *entry, const char *querytext,
+				   Datum *values, bool *nulls)
+{
+	TrackerStats   *stats = &entry->stats;
+	int				i = 0;
+
+	Assert(entry->key.queryId != UINT64CONST(0) &&
+		   OidIsValid(entry->key.dbOid));
+
+	memset(nulls, 0, DATATBL_NCOLS);
+	values[i++] = ObjectIdGetDatum(entry->key.dbOid);
+	values[i++] = Int64GetDatum(entry->key.queryId);
+	values[i++] = BoolGetDatum(entry->key.toplevel);
+	if (querytext != NULL)
+		values[i++] = CStringGetTextDatum(querytext);
+	else
+		/* Text memory limit was reached when the entry has been added */
+		nulls[i++] = true;
+
+	/* Both error statistics always gathered together */
+	if (stats->relative_error.weight > 0.)
+	{
+		values[i++] = Float8GetDatum(stats->relative_error.mean);
+		values[i++] = Float8GetDatum(stats->error2.mean);
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+
+	values[i++] = Int32GetDatum(stats->assessed_nodes);
+	values[i++] = Int32GetDatum(stats->total_nodes);
+	values[i++] = Float8GetDatum(stats->exec_time.mean * 1000.);
+	values[i++] = Int64GetDatum(stats->nexecs);
+	values[i++] = Float8GetDatum(stats->est_nexecs);
+
+	if (stats->relative_error.weight > 0.)
+	{
+		values[i++] = Float8GetDatum(stats->relative_error.min);
+		values[i++] = Float8GetDatum(stats->relative_error.max);
+		values[i++] = Float8GetDatum(rstats_stddev(&stats->relative_error));
+		values[i++] = Float8GetDatum(stats->error2.min);
+		values[i++] = Float8GetDatum(stats->error2.max);
+		values[i++] = Float8GetDatum(rstats_stddev(&stats->error2));
+	}
+	else
+	{
+		int j;
+
+		for (j = 0; j < 6; j++)
+			nulls[i++] = true;
+	}
+
+	values[i++] = Float8GetDatum(stats->exec_time.min * 1000.);
+	values[i++] = Float8GetDatum(stats->exec_time.max * 1000.);
+	values[i++] = Float8GetDatum(rstats_stddev(&stats->exec_time) * 1000.);
+	values[i++] = Float8GetDatum(stats->exec_time.mean *
+								 stats->exec_time.weight * 1000.);
+	values[i++] = Float8GetDatum(stats->error_time * 1000.);
+
+	/* Zero skew means no parallel nodes have been seen */
+	if (stats->worker_skew > 0.)
+		values[i++] = Float8GetDatum(stats->worker_skew);
+	else
+		nulls[i++] = true;
+	if (stats->worker_time_skew > 0.)
+		values[i++] = Float8GetDatum(stats->worker_time_skew);
+	else
+		nulls[i++] = true;
+	values[i++] = Int64GetDatum(stats->workers_short);
+	values[i++] = Int32GetDatum(stats->parts_scanned);
+	values[i++] = Int32GetDatum(stats->parts_pruned);
+	Assert(i == DATATBL_NCOLS);
+}
+
+PG_FUNCTION_INFO_V1(to_show_data);
+PG_FUNCTION_INFO_V1(to_reset);
+
+Datum
+to_show_data(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo			   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum						values[DATATBL_NCOLS];
+	bool						nulls[DATATBL_NCOLS];
+	DSMOptimizerTrackerEntry   *snapshot;
+	uint32						nentries;
+	uint32						i;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, DATATBL_NCOLS);
+
+	/*
+	 * Don't hold partition locks while texts are decompressed and tuples are
+	 * formed: a monitoring tool polling the view would stall the writers.
+	 */
+	snapshot = _snapshot_entries(false, &nentries);
+
+	for (i = 0; i < nentries; i++)
+	{
+		char   *str = text_store_get(snapshot[i].textid);
+
+		_fill_entry_values(&snapshot[i], str, values, nulls);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+		if (str)
+			pfree(str);
+	}
+
+	pfree(snapshot);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_window);
+
+#define WINDOW_NCOLS	(9)
+
+/*
+ * Statistics of executions over the recent period of time. The period is
+ * rounded up to whole buckets and can't exceed the length of the ring.
+ * Entries without executions in the period aren't shown.
+ */
+Datum
+to_window(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo			   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Interval				   *period = PG_GETARG_INTERVAL_P(0);
+	Datum						values[WINDOW_NCOLS];
+	bool						nulls[WINDOW_NCOLS];
+	DSMOptimizerTrackerEntry   *snapshot;
+	uint32						nentries;
+	uint32						epoch;
+	int64						span;
+	int64						nbuckets;
+	uint32						i;
+
+	if (INTERVAL_NOT_FINITE(period))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("period must be finite")));
+
+	span = period->time + period->day * USECS_PER_DAY +
+		   (int64) period->month * DAYS_PER_MONTH * USECS_PER_DAY;
+	if (span <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("period must be positive")));
+
+	nbuckets = (span + (int64) window_interval * USECS_PER_SEC - 1) /
+									((int64) window_interval * USECS_PER_SEC);
+	nbuckets = Min(nbuckets, WINDOW_NBUCKETS);
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, WINDOW_NCOLS);
+
+	epoch = window_epoch(GetCurrentTimestamp());
+	snapshot = _snapshot_entries(false, &nentries);
+
+	for (i = 0; i < nentries; i++)
+	{
+		DSMOptimizerTrackerEntry   *entry = &snapshot[i];
+		WindowBucket				sum;
+		char					   *str;
+		int							j;
+
+		memset(&sum, 0, sizeof(WindowBucket));
+		for (j = 0; j < WINDOW_NBUCKETS; j++)
+		{
+			WindowBucket *bucket = &entry->window[j];
+
+			/* Skip outdated buckets and ones from the future after a clock shift */
+			if (bucket->nexecs == 0 || bucket->epoch > epoch ||
+				epoch - bucket->epoch >= nbuckets)
+				continue;
+
+			sum.nexecs += bucket->nexecs;
+			sum.est_nexecs += bucket->est_nexecs;
+			sum.error_weight += bucket->error_weight;
+			sum.error_sum += bucket->error_sum;
+			sum.exec_time += bucket->exec_time;
+			sum.error_time += bucket->error_time;
+		}
+
+		if (sum.nexecs == 0)
+			continue;
+
+		str = text_store_get(entry->textid);
+
+		j = 0;
+		memset(nulls, 0, sizeof(nulls));
+		values[j++] = ObjectIdGetDatum(entry->key.dbOid);
+		values[j++] = Int64GetDatum(entry->key.queryId);
+		values[j++] = BoolGetDatum(entry->key.toplevel);
+		if (str != NULL)
+			values[j++] = CStringGetTextDatum(str);
+		else
+			nulls[j++] = true;
+		values[j++] = Int64GetDatum((int64) sum.nexecs);
+		values[j++] = Float8GetDatum(sum.est_nexecs);
+		if (sum.error_weight > 0.)
+			values[j++] = Float8GetDatum(sum.error_sum / sum.error_weight);
+		else
+			nulls[j++] = true;
+		values[j++] = Float8GetDatum(sum.exec_time * 1000.);
+		values[j++] = Float8GetDatum(sum.error_time * 1000.);
+		Assert(j == WINDOW_NCOLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+		if (str)
+			pfree(str);
+	}
+
+	pfree(snapshot);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_top);
+
+typedef enum
+{
+	TOP_ORDER_ERROR2,
+	TOP_ORDER_RELATIVE_ERROR,
+	TOP_ORDER_ERROR_TIME,
+	TOP_ORDER_EXEC_TIME,
+	TOP_ORDER_TOTAL_EXEC_TIME,
+	TOP_ORDER_NEXECS,
+} TopOrder;
+
+static const struct config_enum_entry top_order_options[] = {
+	{"error2", TOP_ORDER_ERROR2, false},
+	{"relative_error", TOP_ORDER_RELATIVE_ERROR, false},
+	{"error_time", TOP_ORDER_ERROR_TIME, false},
+	{"exec_time", TOP_ORDER_EXEC_TIME, false},
+	{"total_exec_time", TOP_ORDER_TOTAL_EXEC_TIME, false},
+	{"nexecs", TOP_ORDER_NEXECS, false},
+	{NULL, 0, false}
+};
+
+typedef struct TopCandidate
+{
+	DSMOptimizerTrackerEntry	entry;
+	double						score;
+} TopCandidate;
+
+static double
+top_score(DSMOptimizerTrackerEntry *entry, TopOrder order)
+{
+	TrackerStats *stats = &entry->stats;
+
+	switch (order)
+	{
+		case TOP_ORDER_ERROR2:
+			return stats->error2.mean;
+		case TOP_ORDER_RELATIVE_ERROR:
+			return stats->relative_error.mean;
+		case TOP_ORDER_ERROR_TIME:
+			return stats->error_time;
+		case TOP_ORDER_EXEC_TIME:
+			return stats->exec_time.mean;
+		case TOP_ORDER_TOTAL_EXEC_TIME:
+			return stats->exec_time.mean * stats->exec_time.weight;
+		case TOP_ORDER_NEXECS:
+			return (double) stats->nexecs;
+	}
+
+	Assert(false);
+	return 0.;
+}
+
+/* Min-heap on the score: the first candidate to drop out is on the top */
+static int
+top_cmp(Datum a, Datum b, void *arg)
+{
+	TopCandidate *ca = (TopCandidate *) DatumGetPointer(a);
+	TopCandidate *cb = (TopCandidate *) DatumGetPointer(b);
+
+	if (ca->score < cb->score)
+		return 1;
+	if (ca->score > cb->score)
+		return -1;
+	return 0;
+}
+
+/*
+ * Show k entries with the highest value of the order_by column.
+ * A bounded heap is kept during the scan of the table, so only k entries are
+ * copied into local memory, and query texts are fetched only for them.
+ * NULL dboid means any database.
+ */
+Datum
+to_top(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo			   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum						values[DATATBL_NCOLS];
+	bool						nulls[DATATBL_NCOLS];
+	int64						k;
+	char					   *order_by;
+	const struct config_enum_entry *option;
+	TopOrder					order = TOP_ORDER_ERROR2;
+	Oid							dboid;
+	int64						min_nexecs;
+	dshash_seq_status			stat;
+	DSMOptimizerTrackerEntry   *entry;
+	TopCandidate			   *candidates;
+	binaryheap				   *heap;
+	TopCandidate			  **sorted;
+	int							capacity;
+	int							ncandidates = 0;
+	int							nresults;
+	int							i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("k and order_by must not be NULL")));
+
+	k = PG_GETARG_INT64(0);
+	order_by = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	dboid = PG_ARGISNULL(2) ? InvalidOid : PG_GETARG_OID(2);
+	min_nexecs = PG_ARGISNULL(3) ? 0 : PG_GETARG_INT64(3);
+
+	for (option = top_order_options; option->name != NULL; option++)
+	{
+		if (pg_strcasecmp(order_by, option->name) == 0)
+		{
+			order = (TopOrder) option->val;
+			break;
+		}
+	}
+	if (option->name == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized order_by value: \"%s\"", order_by),
+				 errhint("Valid values are \"error2\", \"relative_error\", \"error_time\", \"exec_time\", \"total_exec_time\" and \"nexecs\".")));
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, DATATBL_NCOLS);
+
+	/*
+	 * The table can't contain more entries than the counter says, except ones
+	 * added concurrently: the result may miss them. It is fine for statistics.
+	 */
+	capacity = (int) Min(k, (int64) pg_atomic_read_u32(&shared->htab_counter));
+	capacity = Min(capacity, (int) (MaxAllocSize / sizeof(TopCandidate)));
+	if (capacity <= 0)
+		return (Datum) 0;
+
+	candidates = palloc(capacity * sizeof(TopCandidate));
+	heap = binaryheap_allocate(capacity, top_cmp, NULL);
+
+	dshash_seq_init(&stat, htab, false);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		TopCandidate   *top;
+		double			score;
+
+		if ((OidIsValid(dboid) && entry->key.dbOid != dboid) ||
+			entry->stats.nexecs < min_nexecs ||
+			entry_is_stale(entry->generation))
+			continue;
+
+		score = top_score(entry, order);
+
+		if (ncandidates < capacity)
+		{
+			top = &candidates[ncandidates++];
+			memcpy(&top->entry, entry, sizeof(DSMOptimizerTrackerEntry));
+			top->score = score;
+			binaryheap_add(heap, PointerGetDatum(top));
+			continue;
+		}
+
+		top = (TopCandidate *) DatumGetPointer(binaryheap_first(heap));
+		if (score <= top->score)
+			continue;
+
+		/* Replace the weakest candidate by this entry */
+		memcpy(&top->entry, entry, sizeof(DSMOptimizerTrackerEntry));
+		top->score = score;
+		binaryheap_replace_first(heap, PointerGetDatum(top));
+	}
+	dshash_seq_term(&stat);
+
+	/* The heap gives candidates in ascending order: store them backwards */
+	nresults = ncandidates;
+	sorted = palloc(Max(nresults, 1) * sizeof(TopCandidate *));
+	while (!binaryheap_empty(heap))
+		sorted[--ncandidates] =
+			(TopCandidate *) DatumGetPointer(binaryheap_remove_first(heap));
+	Assert(ncandidates == 0);
+
+	for (i = 0; i < nresults; i++)
+	{
+		char   *str = text_store_get(sorted[i]->entry.textid);
+
+		_fill_entry_values(&sorted[i]->entry, str, values, nulls);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+		if (str)
+			pfree(str);
+	}
+
+	binaryheap_free(heap);
+	pfree(sorted);
+	pfree(candidates);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_plan);
+
+/*
+ * Show the stored EXPLAIN of the worst execution of the query. NULL dboid
+ * means the current database.
+ */
+Datum
+to_plan(PG_FUNCTION_ARGS)
+{
+	DSMOptimizerTrackerKey		key;
+	DSMOptimizerTrackerEntry   *entry;
+	char					   *data;
+	char					   *str;
+	uint32						len;
+	uint32						stored_len;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	track_attach_shmem();
+
+	memset(&key, 0, sizeof(DSMOptimizerTrackerKey));
+	key.queryId = (uint64) PG_GETARG_INT64(0);
+	key.dbOid = PG_ARGISNULL(1) ? MyDatabaseId : PG_GETARG_OID(1);
+	key.toplevel = PG_ARGISNULL(2) ? true : PG_GETARG_BOOL(2);
+
+	entry = dshash_find(htab, &key, false);
+	if (entry == NULL)
+		PG_RETURN_NULL();
+	if (!DsaPointerIsValid(entry->plan) || entry_is_stale(entry->generation))
+	{
+		dshash_release_lock(htab, entry);
+		PG_RETURN_NULL();
+	}
+
+	/* Copy the data out and decompress it without the lock */
+	len = entry->plan_len;
+	stored_len = entry->plan_stored_len;
+	data = palloc(stored_len);
+	memcpy(data, dsa_get_address(htab_dsa, entry->plan), stored_len);
+	dshash_release_lock(htab, entry);
+
+	if (stored_len < len)
+	{
+		str = palloc(len);
+		if (pglz_decompress(data, stored_len, str, len, true) != (int32) len)
+			elog(ERROR, "[%s] compressed plan is corrupted", EXTENSION_NAME);
+		pfree(data);
+	}
+	else
+		str = data;
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(str, len));
+}
+
+PG_FUNCTION_INFO_V1(to_plans);
+
+#define PLANS_NCOLS	(14)
+
+/*
+ * Show statistics per plan variant of each query. Entries are copied under
+ * brief partition locks, as in to_show_data().
+ */
+Datum
+to_plans(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum				values[PLANS_NCOLS];
+	bool				nulls[PLANS_NCOLS];
+	dshash_seq_status	stat;
+	PlanTrackerEntry   *pentry;
+	PlanTrackerEntry   *snapshot;
+	Size				nalloc = 64;
+	uint32				n = 0;
+	uint32				j;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, PLANS_NCOLS);
+
+	snapshot = MemoryContextAllocHuge(CurrentMemoryContext,
+									  nalloc * sizeof(PlanTrackerEntry));
+	dshash_seq_init(&stat, plan_htab, false);
+	while ((pentry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (entry_is_stale(pentry->generation))
+			continue;
+
+		if (n >= nalloc)
+		{
+			nalloc *= 2;
+			snapshot = repalloc_huge(snapshot, nalloc * sizeof(PlanTrackerEntry));
+		}
+		memcpy(&snapshot[n++], pentry, sizeof(PlanTrackerEntry));
+	}
+	dshash_seq_term(&stat);
+
+	for (j = 0; j < n; j++)
+	{
+		TrackerStats   *stats = &snapshot[j].stats;
+		int				i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = ObjectIdGetDatum(snapshot[j].key.key.dbOid);
+		values[i++] = Int64GetDatum(snapshot[j].key.key.queryId);
+		values[i++] = BoolGetDatum(snapshot[j].key.key.toplevel);
+		values[i++] = Int64GetDatum(snapshot[j].key.planId);
+		values[i++] = Int64GetDatum(stats->nexecs);
+		values[i++] = Float8GetDatum(stats->est_nexecs);
+		if (stats->relative_error.weight > 0.)
+		{
+			values[i++] = Float8GetDatum(stats->relative_error.mean);
+			values[i++] = Float8GetDatum(stats->error2.mean);
+		}
+		else
+		{
+			nulls[i++] = true;
+			nulls[i++] = true;
+		}
+		values[i++] = Float8GetDatum(stats->exec_time.mean * 1000.);
+		values[i++] = Float8GetDatum(stats->exec_time.min * 1000.);
+		values[i++] = Float8GetDatum(stats->exec_time.max * 1000.);
+		values[i++] = Float8GetDatum(stats->exec_time.mean *
+									 stats->exec_time.weight * 1000.);
+		values[i++] = Float8GetDatum(stats->error_time * 1000.);
+		values[i++] = TimestampTzGetDatum(stats->last_exec);
+		Assert(i == PLANS_NCOLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(snapshot);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_advice);
+
+#define ADVICE_NCOLS	(7)
+
+static int
+advice_cmp(const void *a, const void *b)
+{
+	const AdviceEntry *ea = (const AdviceEntry *) a;
+	const AdviceEntry *eb = (const AdviceEntry *) b;
+
+	/* Descending order of the accumulated error */
+	if (ea->error2 > eb->error2)
+		return -1;
+	if (ea->error2 < eb->error2)
+		return 1;
+	return 0;
+}
+
+/*
+ * Build CREATE STATISTICS statement for the column set. Catalog is available
+ * only for the current database. Returns NULL if the relation or one of the
+ * columns doesn't exist anymore.
+ */
+static char *
+advice_statement(AdviceKey *key)
+{
+	StringInfoData	buf;
+	char		   *relname;
+	char		   *nspname;
+	int				i;
+
+	if (key->dbOid != MyDatabaseId)
+		return NULL;
+
+	relname = get_rel_name(key->relid);
+	if (relname == NULL)
+		return NULL;
+	nspname = get_namespace_name(get_rel_namespace(key->relid));
+	if (nspname == NULL)
+		return NULL;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "CREATE STATISTICS ON ");
+	for (i = 0; i < key->natts; i++)
+	{
+		char *attname = get_attname(key->relid, key->attnums[i], true);
+
+		if (attname == NULL)
+		{
+			pfree(buf.data);
+			return NULL;
+		}
+		if (i > 0)
+			appendStringInfoString(&buf, ", ");
+		appendStringInfoString(&buf, quote_identifier(attname));
+	}
+	appendStringInfo(&buf, " FROM %s;",
+					 quote_qualified_identifier(nspname, relname));
+	return buf.data;
+}
+
+/*
+ * Suggest extended statistics for sets of columns involved in badly estimated
+ * scans, ranked by the accumulated time-weighted error.
+ */
+Datum
+to_advice(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum				values[ADVICE_NCOLS];
+	bool				nulls[ADVICE_NCOLS];
+	dshash_seq_status	stat;
+	AdviceEntry		   *entry;
+	AdviceEntry		   *snapshot;
+	Size				nalloc = 64;
+	uint32				n = 0;
+	uint32				j;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, ADVICE_NCOLS);
+
+	snapshot = palloc(nalloc * sizeof(AdviceEntry));
+	dshash_seq_init(&stat, advice_htab, false);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (n >= nalloc)
+		{
+			nalloc *= 2;
+			snapshot = repalloc(snapshot, nalloc * sizeof(AdviceEntry));
+		}
+		memcpy(&snapshot[n++], entry, sizeof(AdviceEntry));
+	}
+	dshash_seq_term(&stat);
+
+	qsort(snapshot, n, sizeof(AdviceEntry), advice_cmp);
+
+	for (j = 0; j < n; j++)
+	{
+		AdviceEntry	   *e = &snapshot[j];
+		Datum			attnums[STATS_MAX_DIMENSIONS];
+		char		   *statement;
+		int				i = 0;
+		int				k;
+
+		for (k = 0; k < e->key.natts; k++)
+			attnums[k] = Int16GetDatum(e->key.attnums[k]);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = ObjectIdGetDatum(e->key.dbOid);
+		values[i++] = ObjectIdGetDatum(e->key.relid);
+		values[i++] = PointerGetDatum(construct_array_builtin(attnums,
+															  e->key.natts,
+															  INT2OID));
+		values[i++] = Int64GetDatum(e->nnodes);
+		values[i++] = Float8GetDatum(e->error2);
+		values[i++] = Float8GetDatum(e->max_error);
+		statement = advice_statement(&e->key);
+		if (statement != NULL)
+			values[i++] = CStringGetTextDatum(statement);
+		else
+			nulls[i++] = true;
+		Assert(i == ADVICE_NCOLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(snapshot);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_relations);
+
+#define RELATIONS_NCOLS	(8)
+
+typedef struct RelationCopy
+{
+	RelationErrorKey	key;
+	uint64				nscans;
+	uint64				noverestimated;
+	uint64				error_sum;
+	uint64				error2_sum;
+} RelationCopy;
+
+/*
+ * Estimation errors per relation. Names are shown for relations of the
+ * current database only.
+ */
+Datum
+to_relations(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum				values[RELATIONS_NCOLS];
+	bool				nulls[RELATIONS_NCOLS];
+	dshash_seq_status	stat;
+	RelationErrorEntry *entry;
+	RelationCopy	   *copies;
+	Size				nalloc = 64;
+	uint32				n = 0;
+	uint32				j;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, RELATIONS_NCOLS);
+
+	/* Catalog lookups are done after the scan, without partition locks */
+	copies = palloc(nalloc * sizeof(RelationCopy));
+	dshash_seq_init(&stat, relation_htab, false);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (n >= nalloc)
+		{
+			nalloc *= 2;
+			copies = repalloc(copies, nalloc * sizeof(RelationCopy));
+		}
+		copies[n].key = entry->key;
+		copies[n].nscans = pg_atomic_read_u64(&entry->nscans);
+		copies[n].noverestimated = pg_atomic_read_u64(&entry->noverestimated);
+		copies[n].error_sum = pg_atomic_read_u64(&entry->error_sum);
+		copies[n].error2_sum = pg_atomic_read_u64(&entry->error2_sum);
+		n++;
+	}
+	dshash_seq_term(&stat);
+
+	for (j = 0; j < n; j++)
+	{
+		RelationCopy   *c = &copies[j];
+		char		   *relname = NULL;
+		int				i = 0;
+
+		if (c->key.dbOid == MyDatabaseId)
+		{
+			char   *name = get_rel_name(c->key.relid);
+			char   *nspname = get_namespace_name(get_rel_namespace(c->key.relid));
+
+			if (name != NULL && nspname != NULL)
+				relname = quote_qualified_identifier(nspname, name);
+		}
+
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = ObjectIdGetDatum(c->key.dbOid);
+		values[i++] = ObjectIdGetDatum(c->key.relid);
+		if (relname != NULL)
+			values[i++] = CStringGetTextDatum(relname);
+		else
+			nulls[i++] = true;
+		values[i++] = Int64GetDatum((int64) c->nscans);
+		values[i++] = Int64GetDatum((int64) c->noverestimated);
+		if (c->nscans > 0)
+			values[i++] = Float8GetDatum(c->error_sum / NODE_HIST_SCALE /
+										 c->nscans);
+		else
+			nulls[i++] = true;
+		values[i++] = Float8GetDatum(c->error_sum / NODE_HIST_SCALE);
+		values[i++] = Float8GetDatum(c->error2_sum / NODE_HIST_SCALE);
+		Assert(i == RELATIONS_NCOLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	pfree(copies);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_nodes);
+
+#define NODES_NCOLS	(7)
+
+static const char *
+plan_node_name(NodeTag tag)
+{
+	switch (tag)
+	{
+		case T_Result:				return "Result";
+		case T_ProjectSet:			return "ProjectSet";
+		case T_ModifyTable:			return "ModifyTable";
+		case T_Append:				return "Append";
+		case T_MergeAppend:			return "Merge Append";
+		case T_RecursiveUnion:		return "Recursive Union";
+		case T_BitmapAnd:			return "BitmapAnd";
+		case T_BitmapOr:			return "BitmapOr";
+		case T_NestLoop:			return "Nested Loop";
+		case T_MergeJoin:			return "Merge Join";
+		case T_HashJoin:			return "Hash Join";
+		case T_SeqScan:				return "Seq Scan";
+		case T_SampleScan:			return "Sample Scan";
+		case T_Gather:				return "Gather";
+		case T_GatherMerge:			return "Gather Merge";
+		case T_IndexScan:			return "Index Scan";
+		case T_IndexOnlyScan:		return "Index Only Scan";
+		case T_BitmapIndexScan:		return "Bitmap Index Scan";
+		case T_BitmapHeapScan:		return "Bitmap Heap Scan";
+		case T_TidScan:				return "Tid Scan";
+		case T_TidRangeScan:		return "Tid Range Scan";
+		case T_SubqueryScan:		return "Subquery Scan";
+		case T_FunctionScan:		return "Function Scan";
+		case T_TableFuncScan:		return "Table Function Scan";
+		case T_ValuesScan:			return "Values Scan";
+		case T_CteScan:				return "CTE Scan";
+		case T_NamedTuplestoreScan:	return "Named Tuplestore Scan";
+		case T_WorkTableScan:		return "WorkTable Scan";
+		case T_ForeignScan:			return "Foreign Scan";
+		case T_CustomScan:			return "Custom Scan";
+		case T_Material:			return "Materialize";
+		case T_Memoize:				return "Memoize";
+		case T_Sort:				return "Sort";
+		case T_IncrementalSort:		return "Incremental Sort";
+		case T_Group:				return "Group";
+		case T_Agg:					return "Aggregate";
+		case T_WindowAgg:			return "WindowAgg";
+		case T_Unique:				return "Unique";
+		case T_SetOp:				return "SetOp";
+		case T_LockRows:			return "LockRows";
+		case T_Limit:				return "Limit";
+		case T_Hash:				return "Hash";
+		default:					return "???";
+	}
+}
+
+static const char *
+join_type_name(int32 jointype)
+{
+	switch ((JoinType) jointype)
+	{
+		case JOIN_INNER:			return "Inner";
+		case JOIN_LEFT:				return "Left";
+		case JOIN_FULL:				return "Full";
+		case JOIN_RIGHT:			return "Right";
+		case JOIN_SEMI:				return "Semi";
+		case JOIN_ANTI:				return "Anti";
+		case JOIN_RIGHT_ANTI:		return "Right Anti";
+		default:					return "???";
+	}
+}
+
+/*
+ * Show histograms of estimation errors per database, plan node type and join
+ * type.
+ */
+Datum
+to_nodes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum				values[NODES_NCOLS];
+	bool				nulls[NODES_NCOLS];
+	Datum				buckets[NODE_HIST_NBUCKETS];
+	dshash_seq_status	stat;
+	NodeHistEntry	   *entry;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, NODES_NCOLS);
+
+	/* Few entries of fixed size, nothing to detoast: just scan the table */
+	dshash_seq_init(&stat, node_htab, false);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		uint64	nnodes = 0;
+		int		i;
+
+		for (i = 0; i < NODE_HIST_NBUCKETS; i++)
+		{
+			uint64 count = pg_atomic_read_u64(&entry->buckets[i]);
+
+			buckets[i] = Int64GetDatum((int64) count);
+			nnodes += count;
+		}
+
+		i = 0;
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = ObjectIdGetDatum(entry->key.dbOid);
+		values[i++] = CStringGetTextDatum(plan_node_name((NodeTag) entry->key.nodeTag));
+		if (entry->key.jointype >= 0)
+			values[i++] = CStringGetTextDatum(join_type_name(entry->key.jointype));
+		else
+			nulls[i++] = true;
+		values[i++] = Int64GetDatum((int64) nnodes);
+		values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->noverestimated));
+		if (nnodes > 0)
+			values[i++] = Float8GetDatum(pg_atomic_read_u64(&entry->error_sum) /
+										 NODE_HIST_SCALE / nnodes);
+		else
+			nulls[i++] = true;
+		values[i++] = PointerGetDatum(construct_array_builtin(buckets,
+															  NODE_HIST_NBUCKETS,
+															  INT8OID));
+		Assert(i == NODES_NCOLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+	dshash_seq_term(&stat);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_details);
+
+#define DETAILS_NCOLS	(10)
+
+typedef struct DetailCopy
+{
+	DSMOptimizerTrackerKey	key;
+	TimestampTz				time;
+	uint32					nnodes;
+	DetailNode			   *nodes;
+} DetailCopy;
+
+/*
+ * Per-node detail of the top offenders, one row per node. The details are
+ * copied under the partition locks and shown after the scan.
+ */
+Datum
+to_details(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo			   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum						values[DETAILS_NCOLS];
+	bool						nulls[DETAILS_NCOLS];
+	dshash_seq_status			stat;
+	DSMOptimizerTrackerEntry   *entry;
+	DetailCopy				   *copies;
+	int							ncopies = 0;
+	int							nalloc = 16;
+	int							i;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, DETAILS_NCOLS);
+
+	copies = palloc(nalloc * sizeof(DetailCopy));
+	dshash_seq_init(&stat, htab, false);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		DetailCopy *copy;
+		Size		size;
+
+		if (!DsaPointerIsValid(entry->detail) ||
+			entry_is_stale(entry->generation))
+			continue;
+
+		if (ncopies >= nalloc)
+		{
+			nalloc *= 2;
+			copies = repalloc(copies, nalloc * sizeof(DetailCopy));
+		}
+
+		copy = &copies[ncopies++];
+		size = entry->detail_nnodes * sizeof(DetailNode);
+		copy->key = entry->key;
+		copy->time = entry->detail_time;
+		copy->nnodes = entry->detail_nnodes;
+		copy->nodes = palloc(size);
+		memcpy(copy->nodes, dsa_get_address(htab_dsa, entry->detail), size);
+	}
+	dshash_seq_term(&stat);
+
+	for (i = 0; i < ncopies; i++)
+	{
+		uint32	n;
+
+		for (n = 0; n < copies[i].nnodes; n++)
+		{
+			DetailNode *node = &copies[i].nodes[n];
+			int			j = 0;
+
+			memset(nulls, 0, sizeof(nulls));
+			values[j++] = ObjectIdGetDatum(copies[i].key.dbOid);
+			values[j++] = Int64GetDatum(copies[i].key.queryId);
+			values[j++] = BoolGetDatum(copies[i].key.toplevel);
+			values[j++] = TimestampTzGetDatum(copies[i].time);
+			values[j++] = Int32GetDatum(node->node_id);
+			values[j++] = CStringGetTextDatum(plan_node_name((NodeTag) node->tag));
+			values[j++] = Float8GetDatum(node->plan_rows);
+			values[j++] = Float8GetDatum(node->actual_rows);
+			values[j++] = Float8GetDatum(node->loops);
+			values[j++] = Float8GetDatum(node->time);
+			Assert(j == DETAILS_NCOLS);
+
+			tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+		}
+		pfree(copies[i].nodes);
+	}
+
+	pfree(copies);
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_status);
+
+/*
+ * Show state of the hash table: number of entries, memory consumption and
+ * counters of evicted entries and dropped executions.
+ */
+Datum
+to_status(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[STATUS_NCOLS];
+	bool		nulls[STATUS_NCOLS];
+	int			i = 0;
+
+	track_attach_shmem();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[i++] = Int64GetDatum(pg_atomic_read_u32(&shared->htab_counter));
+	values[i++] = Int64GetDatum(pg_atomic_read_u64(&shared->mem_used));
+	values[i++] = Int64GetDatum((int64) hash_mem * 1024);
+	values[i++] = Int64GetDatum(pg_atomic_read_u64(&shared->nevicted));
+	values[i++] = Int64GetDatum(pg_atomic_read_u64(&shared->ndropped));
+	values[i++] = Int64GetDatum(pg_atomic_read_u64(&shared->log_dropped));
+	values[i++] = Float8GetDatum(track_log_min_error());
+	Assert(i == STATUS_NCOLS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(to_self_stats);
+
+#define SELF_STATS_NCOLS	(5)
+
+/*
+ * Time spent by the extension in each phase of its work and in lookups of the
+ * shared table, in milliseconds. Gathered only when self_instrumentation is on.
+ */
+Datum
+to_self_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum			values[SELF_STATS_NCOLS];
+	bool			nulls[SELF_STATS_NCOLS];
+	int				i;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, SELF_STATS_NCOLS);
+
+	memset(nulls, 0, sizeof(nulls));
+	for (i = 0; i < TRACK_PHASE_COUNT; i++)
+	{
+		PhaseStats *pstats = &shared->phase_stats[i];
+		int			j = 0;
+
+		values[j++] = CStringGetTextDatum(track_phase_names[i]);
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&pstats->calls));
+		values[j++] = Float8GetDatum(pg_atomic_read_u64(&pstats->time) / 1e6);
+		values[j++] = Int64GetDatum((int64) pg_atomic_read_u64(&pstats->lock_calls));
+		values[j++] = Float8GetDatum(pg_atomic_read_u64(&pstats->lock_time) / 1e6);
+		Assert(j == SELF_STATS_NCOLS);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(to_stats);
+
+/*
+ * Show cumulative counters per database, and their totals in the row with NULL
+ * dboid. Reads only the fixed-size counters, so it is cheap enough to be
+ * called by monitoring tools every second. Counters aren't reset by the
+ * pg_track_optimizer_reset().
+ */
+Datum
+to_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Datum			values[STATS_NCOLS];
+	bool			nulls[STATS_NCOLS];
+	uint64			total[STATS_NCOLS - 1];
+	int				i;
+	int				j;
+
+	track_attach_shmem();
+
+	_init_rsinfo(fcinfo, rsinfo, STATS_NCOLS);
+
+	memset(total, 0, sizeof(total));
+	for (i = 0; i < DB_STATS_SLOTS; i++)
+	{
+		DBStats	   *slot = &shared->db_stats[i].stats;
+		uint64		counters[STATS_NCOLS - 1];
+		Oid			dbOid = pg_atomic_read_u32(&slot->dbOid);
+
+		j = 0;
+		counters[j++] = pg_atomic_read_u64(&slot->nexecs);
+		counters[j++] = pg_atomic_read_u64(&slot->error_time);
+		counters[j++] = pg_atomic_read_u64(&slot->bad_time);
+		counters[j++] = pg_atomic_read_u64(&slot->ndropped);
+		counters[j++] = pg_atomic_read_u64(&slot->nevicted);
+
+		/* The shared slot has no database, skip it if it is still empty */
+		if (!OidIsValid(dbOid) && counters[0] == 0 && counters[3] == 0 &&
+			counters[4] == 0)
+			continue;
+
+		for (j = 0; j < STATS_NCOLS - 1; j++)
+			total[j] += counters[j];
+
+		/* Databases sharing the last slot are shown with zero oid */
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(dbOid);
+		values[1] = Int64GetDatum((int64) ((counters[0] + DB_NEXECS_SCALE / 2) /
+										   DB_NEXECS_SCALE));
+		values[2] = Float8GetDatum(counters[1] / 1000.);
+		values[3] = Float8GetDatum(counters[2] / 1000.);
+		values[4] = Int64GetDatum((int64) counters[3]);
+		values[5] = Int64GetDatum((int64) counters[4]);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+	nulls[0] = true;
+	values[1] = Int64GetDatum((int64) ((total[0] + DB_NEXECS_SCALE / 2) /
+									   DB_NEXECS_SCALE));
+	values[2] = Float8GetDatum(total[1] / 1000.);
+	values[3] = Float8GetDatum(total[2] / 1000.);
+	values[4] = Int64GetDatum((int64) total[3]);
+	values[5] = Int64GetDatum((int64) total[4]);
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/*
+ * Delete entries of the query, or of all the queries of the database, and
+ * their plan variants. Entries of reset generations are deleted too, so with
+ * stale_only this is the cleanup after a full reset.
+ * The tables are passed partition by partition: writers wait only for the
+ * partition currently being cleaned.
+ */
+static void
+_purge_entries(Oid dboid, uint64 queryId, bool stale_only)
+{
+	dshash_seq_status			stat;
+	DSMOptimizerTrackerEntry   *entry;
+	PlanTrackerEntry		   *pentry;
+
+#define PURGE_MATCH(generation, k) \
+	(entry_is_stale(generation) || \
+	 (!stale_only && \
+	  (!OidIsValid(dboid) || (k).dbOid == dboid) && \
+	  (queryId == UINT64CONST(0) || (k).queryId == queryId)))
+
+	dshash_seq_init(&stat, htab, true);
+	while ((entry = dshash_seq_next(&stat)) != NULL)
+	{
+		Assert(entry->key.queryId != UINT64CONST(0) &&
+			   OidIsValid(entry->key.dbOid));
+
+		if (!PURGE_MATCH(entry->generation, entry->key))
+			continue;
+
+		_release_entry(entry);
+		dshash_delete_current(&stat);
+	}
+	dshash_seq_term(&stat);
+
+	dshash_seq_init(&stat, plan_htab, true);
+	while ((pentry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (!PURGE_MATCH(pentry->generation, pentry->key.key))
+			continue;
+
+		dshash_delete_current(&stat);
+		pg_atomic_fetch_sub_u64(&shared->mem_used, PLAN_ENTRY_MEM_SIZE);
+	}
+	dshash_seq_term(&stat);
+
+#undef PURGE_MATCH
+
+	/* Free texts of the deleted entries */
+	text_store_gc();
+}
+
+/*
+ * Delete per-node histograms, statistics advice and errors per relation, all
+ * of them or of one database. They are small enough to be cleaned immediately.
+ */
+static void
+_purge_node_data(Oid dboid)
+{
+	dshash_seq_status	stat;
+	NodeHistEntry	   *hentry;
+	AdviceEntry		   *aentry;
+	RelationErrorEntry *rentry;
+
+	dshash_seq_init(&stat, node_htab, true);
+	while ((hentry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (OidIsValid(dboid) && hentry->key.dbOid != dboid)
+			continue;
+		dshash_delete_current(&stat);
+	}
+	dshash_seq_term(&stat);
+
+	dshash_seq_init(&stat, advice_htab, true);
+	while ((aentry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (OidIsValid(dboid) && aentry->key.dbOid != dboid)
+			continue;
+		dshash_delete_current(&stat);
+		pg_atomic_fetch_sub_u32(&shared->advice_counter, 1);
+	}
+	dshash_seq_term(&stat);
+
+	dshash_seq_init(&stat, relation_htab, true);
+	while ((rentry = dshash_seq_next(&stat)) != NULL)
+	{
+		if (OidIsValid(dboid) && rentry->key.dbOid != dboid)
+			continue;
+		dshash_delete_current(&stat);
+		pg_atomic_fetch_sub_u32(&shared->relation_counter, 1);
+	}
+	dshash_seq_term(&stat);
+}
+
+/*
+ * Cleanup after a reset: free entries of the reset generations and rewrite the
+ * data file, so the removed entries don't come back after a restart.
+ */
+static void
+track_reset_cleanup(void)
+{
+	if (pg_atomic_exchange_u32(&shared->flush_requested, 0) == 0)
+		return;
+
+	_purge_entries(InvalidOid, UINT64CONST(0), true);
+
+	/* The write is refused until the load: keep the request for later */
+	if (!track_write_storage(true))
+		pg_atomic_write_u32(&shared->flush_requested, 1);
+}
+
+/*
+ * Pass the cleanup to the background worker. Without the worker the calling
+ * backend does it itself.
+ */
+static void
+track_request_cleanup(void)
+{
+	PGPROC *worker;
+
+	pg_atomic_write_u32(&shared->flush_requested, 1);
+
+	LWLockAcquire(&shared->log_lock, LW_SHARED);
+	worker = shared->worker_proc;
+	LWLockRelease(&shared->log_lock);
+
+	if (worker != NULL)
+		SetLatch(&worker->procLatch);
+	else
+		track_reset_cleanup();
+}
+
+/*
+ * Ask for the garbage collection after an eviction or a failed reservation of
+ * text memory. It may be called under locks of the hash tables, so the work is
+ * deferred to the worker, or to the end of the current query without it.
+ */
+static void
+track_request_gc(void)
+{
+	PGPROC *worker;
+
+	pg_atomic_write_u32(&shared->gc_requested, 1);
+
+	LWLockAcquire(&shared->log_lock, LW_SHARED);
+	worker = shared->worker_proc;
+	LWLockRelease(&shared->log_lock);
+
+	if (worker != NULL)
+		SetLatch(&worker->procLatch);
+	else
+		gc_pending = true;
+}
+
+/*
+ * Free texts nobody references and plan variants of the queries which have
+ * been evicted. Must be called without locks on the hash tables.
+ */
+static void
+track_gc(void)
+{
+	dshash_seq_status	stat;
+	PlanTrackerEntry   *pentry;
+
+	if (pg_atomic_exchange_u32(&shared->gc_requested, 0) == 0)
+		return;
+
+	text_store_gc();
+
+	/*
+	 * The entry of the query is looked up under the partition lock of the plan
+	 * table. Nobody locks the plan table while holding a query entry, so it
+	 * can't deadlock.
+	 */
+	dshash_seq_init(&stat, plan_htab, true);
+	while ((pentry = dshash_seq_next(&stat)) != NULL)
+	{
+		DSMOptimizerTrackerEntry *entry;
+
+		entry = dshash_find(htab, &pentry->key.key, false);
+		if (entry != NULL)
+		{
+			dshash_release_lock(htab, entry);
+			continue;
+		}
+
+		dshash_delete_current(&stat);
+		pg_atomic_fetch_sub_u64(&shared->mem_used, PLAN_ENTRY_MEM_SIZE);
+	}
+	dshash_seq_term(&stat);
+}
+
+/*
+ * Reset statistics of the query (queryid), of the database (dboid), or of
+ * both. Without arguments reset everything: the current generation of entries
+ * is made invisible at once, and the memory is freed afterwards.
+ * Per-node histograms and advice are kept on the reset of a single query.
+ */
+Datum
+to_reset(PG_FUNCTION_ARGS)
+{
+	Oid		dboid = PG_ARGISNULL(0) ? InvalidOid : PG_GETARG_OID(0);
+	uint64	queryId = PG_ARGISNULL(1) ? UINT64CONST(0) :
+										(uint64) PG_GETARG_INT64(1);
+
+	track_attach_shmem();
+
+	if (!OidIsValid(dboid) && queryId == UINT64CONST(0))
+	{
+		pg_atomic_fetch_add_u32(&shared->generation, 1);
+		_purge_node_data(InvalidOid);
+	}
+	else
+	{
+		/*
+		 * Loaded entries of the reset generation are dropped, but a selective
+		 * reset can't be told apart: wait until the disk storage is loaded.
+		 */
+		track_wait_load();
+		_purge_entries(dboid, queryId, false);
+		if (queryId == UINT64CONST(0))
+			_purge_node_data(dboid);
+	}
+
+	/* Clean disk storage too */
+	track_request_cleanup();
+
+	PG_RETURN_VOID();
+}
+
+/* -----------------------------------------------------------------------------
+ *
+ * Disk operations
+ *
+ * -------------------------------------------------------------------------- */
+
+PG_FUNCTION_INFO_V1(to_flush);
+
+static const uint32 DATA_FILE_HEADER	= 12354678;
+static const uint32 DATA_FORMAT_VERSION = 12;
+
+/* Number of entries covered by one checksum of the data file */
+#define DATA_BLOCK_ENTRIES	(256)
+
+/*
+ * Layout of the data file:
+ *   DataFileHeader
+ *   DiskEntry[nentries]
+ *   pg_crc32c[nblocks] - checksums of blocks of DATA_BLOCK_ENTRIES entries
+ *   query texts, text_size bytes
+ * The file is read in bulk (mapped, if possible), a corrupted block of entries
+ * or the text section is skipped with a warning.
+ *
+ * The delta log starts with the same header (without entries) followed by
+ * records: DiskEntry, its query text and a checksum of both. A delete record
+ * is a DiskEntry with DISK_ENTRY_REMOVED flag and without a text.
+ */
+typedef struct DataFileHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint32		entry_size; /* Protects from a build with another layout */
+	uint32		block_entries;
+	uint64		nentries;
+	uint64		text_size;
+	pg_crc32c	text_crc;
+	pg_crc32c	header_crc; /* Of the fields above */
+} DataFileHeader;
+
+/*
+ * Entry as stored on the disk: only the persistent part of the shared entry.
+ */
+typedef struct DiskEntry
+{
+	DSMOptimizerTrackerKey	key;
+	uint32					text_len;
+	uint32					flags; /* DISK_ENTRY_* */
+	uint64					text_offset; /* In the text section */
+	TrackerStats			stats;
+	WindowBucket			window[WINDOW_NBUCKETS];
+} DiskEntry;
+
+#define DISK_ENTRY_REMOVED	(0x01) /* Delete record of the delta log */
+
+/*
+ * Entry read from the disk, before it is installed into the shared table.
+ */
+typedef struct LoadedEntry
+{
+	DSMOptimizerTrackerKey	key;
+	TrackerStats			stats;
+	WindowBucket			window[WINDOW_NBUCKETS];
+	char				   *text; /* NULL if no text */
+	uint32					text_len;
+} LoadedEntry;
+
+/*
+ * A standby keeps its own files: the files of the primary, copied by
+ * pg_basebackup, describe another workload. Promoted server switches to the
+ * primary's names at the next write, the data in memory stays in place.
+ */
+static const char *
+storage_file(bool standby, bool delta)
+{
+	if (standby)
+		return delta ? EXTENSION_NAME".standby.delta" :
+					   EXTENSION_NAME".standby.stat";
+	return delta ? EXTENSION_NAME".delta" : EXTENSION_NAME".stat";
+}
+
+/*
+ * Remove files of the other role after the promotion. Called under io_lock.
+ */
+static void
+_remove_standby_files(void)
+{
+	int		i;
+
+	for (i = 0; i < 2; i++)
+	{
+		const char *path = storage_file(true, i == 1);
+
+		if (unlink(path) < 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("[%s] could not remove file \"%s\": %m",
+					 EXTENSION_NAME, path)));
+	}
+}
+
+static void
+_make_header(DataFileHeader *header, uint64 nentries, uint64 text_size,
+			 pg_crc32c text_crc)
+{
+	memset(header, 0, sizeof(DataFileHeader));
+	header->magic = DATA_FILE_HEADER;
+	header->version = DATA_FORMAT_VERSION;
+	header->entry_size = sizeof(DiskEntry);
+	header->block_entries = DATA_BLOCK_ENTRIES;
+	header->nentries = nentries;
+	header->text_size = text_size;
+	header->text_crc = text_crc;
+
+	INIT_CRC32C(header->header_crc);
+	COMP_CRC32C(header->header_crc, header, offsetof(DataFileHeader, header_crc));
+	FIN_CRC32C(header->header_crc);
+}
+
+/*
+ * Check the header read from the file. Reports a warning and returns false if
+ * the file can't be used.
+ */
+static bool
+_check_header(const char *data, Size size, const char *path,
+			  DataFileHeader *header)
+{
+	pg_crc32c	crc;
+
+	if (size < sizeof(DataFileHeader))
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] file \"%s\" is too short", EXTENSION_NAME, path)));
+		return false;
+	}
+
+	memcpy(header, data, sizeof(DataFileHeader));
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, header, offsetof(DataFileHeader, header_crc));
+	FIN_CRC32C(crc);
+
+	if (header->magic != DATA_FILE_HEADER || !EQ_CRC32C(crc, header->header_crc))
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] file \"%s\" has invalid header", EXTENSION_NAME, path)));
+		return false;
+	}
+
+	if (header->version != DATA_FORMAT_VERSION ||
+		header->entry_size != sizeof(DiskEntry) ||
+		header->block_entries == 0)
 	{
-		double	wnloops = 0.;
-		double	wntuples = 0.;
-		double	divisor = pstate->worker_instrument->num_workers;
-		double	leader_contribution;
-		int i;
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] file \"%s\" has incompatible format version %u instead of %u",
+						EXTENSION_NAME, path, header->version, DATA_FORMAT_VERSION)));
+		return false;
+	}
 
-		/* XXX: Copy-pasted from the get_parallel_divisor() */
-		leader_contribution = 1.0 - (0.3 * divisor);
-		if (leader_contribution > 0)
-			divisor += leader_contribution;
-		plan_rows = pstate->plan->plan_rows * divisor;
+	return true;
+}
 
-		for (i = 0; i < pstate->worker_instrument->num_workers; i++)
-		{
-			double t = pstate->worker_instrument->instrument[i].ntuples;
-			double l = pstate->worker_instrument->instrument[i].nloops;
+/*
+ * Read the whole file into memory: map it, if possible. Returns NULL if the
+ * file doesn't exist or can't be read (with a warning).
+ */
+static char *
+_map_file(const char *path, Size *size, bool *mapped)
+{
+	int			fd;
+	struct stat	st;
+	char	   *data;
+	Size		nread = 0;
 
-			if (l <= 0.0)
-			{
-				/*
-				 * Worker could start but not to process any tuples just because
-				 * of laziness. Skip such a node.
-				 */
-				continue;
-			}
+	*mapped = false;
 
-			wntuples += t;
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("[%s] could not open file \"%s\": %m",
+							EXTENSION_NAME, path)));
+		return NULL;
+	}
 
-			/* In leaf nodes we should get into account filtered tuples */
-			if (tmp_counter == ctx->counter)
-				wntuples += pstate->worker_instrument->instrument[i].nfiltered1 +
-							pstate->worker_instrument->instrument[i].nfiltered2 +
-							pstate->instrument->ntuples2;
+	if (fstat(fd, &st) < 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("[%s] could not stat file \"%s\": %m",
+						EXTENSION_NAME, path)));
+		CloseTransientFile(fd);
+		return NULL;
+	}
+	*size = (Size) st.st_size;
 
-			wnloops += l;
-			real_rows += t/l;
+#ifndef WIN32
+	if (*size > 0)
+	{
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			*mapped = true;
+			CloseTransientFile(fd);
+			return data;
 		}
+	}
+#endif
 
-		Assert(nloops >= wnloops);
+	/* Fall back to one bulk read */
+	data = MemoryContextAllocHuge(CurrentMemoryContext, Max(*size, 1));
+	while (nread < *size)
+	{
+		ssize_t	rc = read(fd, data + nread, *size - nread);
 
-		/* Calculate the part of job have made by the main process */
-		if (nloops - wnloops > 0.0)
+		if (rc <= 0)
 		{
-			double	ntuples = pstate->instrument->ntuples;
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("[%s] could not read file \"%s\": %m",
+							EXTENSION_NAME, path)));
+			pfree(data);
+			CloseTransientFile(fd);
+			return NULL;
+		}
+		nread += rc;
+	}
 
-			/* In leaf nodes we should get into account filtered tuples */
-			if (tmp_counter == ctx->counter)
-				ntuples += (pstate->instrument->nfiltered1 +
-												pstate->instrument->nfiltered2 +
-												pstate->instrument->ntuples2);
+	CloseTransientFile(fd);
+	return data;
+}
 
-			Assert(ntuples >= wntuples);
-			real_rows += (ntuples - wntuples) / (nloops - wnloops);
+static void
+_unmap_file(char *data, Size size, bool mapped)
+{
+#ifndef WIN32
+	if (mapped)
+	{
+		munmap(data, size);
+		return;
+	}
+#endif
+	pfree(data);
+}
+
+static void
+_fill_disk_entry(DiskEntry *dentry, const DSMOptimizerTrackerEntry *entry)
+{
+	memset(dentry, 0, sizeof(DiskEntry));
+	memcpy(&dentry->key, &entry->key, sizeof(DSMOptimizerTrackerKey));
+	memcpy(&dentry->stats, &entry->stats, sizeof(TrackerStats));
+	memcpy(dentry->window, entry->window, sizeof(dentry->window));
+}
+
+/*
+ * Write the whole table into the data file. The delta log isn't needed
+ * afterwards and is removed, so this also works as a compaction of the log.
+ *
+ * Specifics of the storage procedure of dshash table:
+ * we don't block the table entirely, so we don't know how many records
+ * will be eventually stored. Hence, the file is built in memory from the
+ * snapshot and written at once.
+ * Return true in the case of success.
+ */
+static bool
+_flush_hash_table(void)
+{
+	DSMOptimizerTrackerEntry   *snapshot;
+	DiskEntry				   *entries;
+	pg_crc32c				   *crcs;
+	StringInfoData				texts;
+	DataFileHeader				header;
+	pg_crc32c					text_crc;
+	char					   *tmpfile = psprintf("%s.tmp", EXTENSION_NAME);
+	const char				   *filename;
+	const char				   *delta_filename;
+	bool						standby;
+	FILE					   *file = NULL;
+	uint32						counter = 0;
+	uint32						nremoved;
+	uint32						nlost;
+	uint32						nblocks;
+	uint32						i;
+	int							save_errno;
+
+	if (!IsUnderPostmaster)
+		return false;
+
+	/* Don't overwrite the file nobody has read yet */
+	if (pg_atomic_read_u32(&shared->load_pending) != 0)
+	{
+		elog(LOG, "[%s] data file isn't loaded yet, flush skipped",
+			 EXTENSION_NAME);
+		return false;
+	}
+
+	LWLockAcquire(&shared->io_lock, LW_EXCLUSIVE);
+
+	standby = RecoveryInProgress();
+	filename = storage_file(standby, false);
+	delta_filename = storage_file(standby, true);
+
+	/* Entries removed before the snapshot just aren't in the new file */
+	nremoved = _take_removals(NULL, &nlost);
+	snapshot = _snapshot_entries(false, &counter);
+
+	entries = MemoryContextAllocHuge(CurrentMemoryContext,
+									 Max(counter, 1) * sizeof(DiskEntry));
+	initStringInfo(&texts);
+	for (i = 0; i < counter; i++)
+	{
+		char   *str = text_store_get(snapshot[i].textid);
+
+		/*
+		 * The text might be released by the entry removal in between the
+		 * snapshot and the write. Not a big deal: the entry is stored without
+		 * a text.
+		 */
+		_fill_disk_entry(&entries[i], &snapshot[i]);
+		if (str != NULL)
+		{
+			entries[i].text_offset = texts.len;
+			entries[i].text_len = strlen(str);
+			appendBinaryStringInfo(&texts, str, entries[i].text_len);
+			pfree(str);
 		}
 	}
-	else
+
+	nblocks = (counter + DATA_BLOCK_ENTRIES - 1) / DATA_BLOCK_ENTRIES;
+	crcs = palloc(Max(nblocks, 1) * sizeof(pg_crc32c));
+	for (i = 0; i < nblocks; i++)
 	{
-		plan_rows = pstate->plan->plan_rows;
-		real_rows = pstate->instrument->ntuples / nloops;
+		uint32	first = i * DATA_BLOCK_ENTRIES;
+		uint32	n = Min(DATA_BLOCK_ENTRIES, counter - first);
 
-		/* In leaf nodes we should get into account filtered tuples */
-		if (tmp_counter == ctx->counter)
-			real_rows += (pstate->instrument->nfiltered1 +
-									pstate->instrument->nfiltered2 +
-									pstate->instrument->ntuples2) / nloops;
+		INIT_CRC32C(crcs[i]);
+		COMP_CRC32C(crcs[i], &entries[first], n * sizeof(DiskEntry));
+		FIN_CRC32C(crcs[i]);
 	}
 
-	plan_rows = clamp_row_est(plan_rows);
-	real_rows = clamp_row_est(real_rows);
+	INIT_CRC32C(text_crc);
+	COMP_CRC32C(text_crc, texts.data, texts.len);
+	FIN_CRC32C(text_crc);
+	_make_header(&header, counter, texts.len, text_crc);
+
+	file = AllocateFile(tmpfile, PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&header, sizeof(DataFileHeader), 1, file) != 1 ||
+		(counter > 0 &&
+		 (fwrite(entries, sizeof(DiskEntry), counter, file) != counter ||
+		  fwrite(crcs, sizeof(pg_crc32c), nblocks, file) != nblocks)) ||
+		(texts.len > 0 && fwrite(texts.data, texts.len, 1, file) != 1))
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+	file = NULL;
+
+	if (durable_rename(tmpfile, filename, LOG) != 0)
+	{
+		LWLockRelease(&shared->io_lock);
+		unlink(tmpfile);
+		return false;
+	}
 
 	/*
-	 * Now, we can calculate a value of the estimation relative error has made
-	 * by the optimizer.
+	 * The data file contains everything the delta log has. If the removal
+	 * is lost in a crash, the stale log only overrides some fresh records
+	 * with older ones.
 	 */
-	Assert(pstate->instrument->total > 0.0);
+	if (unlink(delta_filename) < 0 && errno != ENOENT)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("[%s] could not remove file \"%s\": %m",
+				 EXTENSION_NAME, delta_filename)));
+	shared->delta_records = 0;
+
+	if (shared->storage_standby && !standby)
+		_remove_standby_files();
+	shared->storage_standby = standby;
+
+	_clear_dirty(snapshot, counter);
+	_forget_removals(nremoved, nlost);
+	LWLockRelease(&shared->io_lock);
+
+	pfree(snapshot);
+	pfree(entries);
+	pfree(crcs);
+	pfree(texts.data);
+	pfree(tmpfile);
+	elog(LOG, "[%s] %u records stored in file %s.",
+		 EXTENSION_NAME, counter, filename);
+	return true;
 
-	ctx->error += fabs(log(real_rows / plan_rows));
-	ctx->nnodes++;
+error:
+	/* Dirty flags stay set: the next checkpoint retries */
+	save_errno = errno;
+	if (file)
+		FreeFile(file);
+	unlink(tmpfile);
+	errno = save_errno;
 
-	relative_time = pstate->instrument->total / pstate->instrument->nloops / ctx->totaltime;
-	ctx->error2 += fabs(log(real_rows / plan_rows)) * relative_time;
+	ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write %s data file \"%s\": %m",
+			 EXTENSION_NAME, tmpfile)));
+	return false;				/* keep compiler quiet */
+}
 
-	return false;
+/*
+ * Append a record of the delta log, also used by the export: the entry, its
+ * query text and a checksum of both. Entry without a text is stored with
+ * zero-length text.
+ */
+static void
+_append_record(StringInfo buf, const DSMOptimizerTrackerEntry *entry)
+{
+	DiskEntry	dentry;
+	char	   *str = text_store_get(entry->textid);
+	pg_crc32c	crc;
+
+	_fill_disk_entry(&dentry, entry);
+	dentry.text_len = (str != NULL) ? strlen(str) : 0;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &dentry, sizeof(DiskEntry));
+	if (dentry.text_len > 0)
+		COMP_CRC32C(crc, str, dentry.text_len);
+	FIN_CRC32C(crc);
+
+	appendBinaryStringInfo(buf, (char *) &dentry, sizeof(DiskEntry));
+	if (dentry.text_len > 0)
+		appendBinaryStringInfo(buf, str, dentry.text_len);
+	appendBinaryStringInfo(buf, (char *) &crc, sizeof(pg_crc32c));
+
+	if (str)
+		pfree(str);
 }
 
-static double
-track_prediction_estimation(PlanState *pstate, double totaltime, ScourContext *ctx)
+/*
+ * Append a delete record of the removed entry: the key only, no text.
+ */
+static void
+_append_removal(StringInfo buf, const DSMOptimizerTrackerKey *key)
 {
-	ctx->error = 0.;
-	ctx->error2 = 0.;
-	ctx->totaltime = totaltime;
-	ctx->nnodes = 0;
-	ctx->counter = 0;
+	DiskEntry	dentry;
+	pg_crc32c	crc;
 
-	Assert(totaltime > 0.);
-	(void) prediction_walker(pstate, (void *) ctx);
-	return (ctx->nnodes > 0) ? (ctx->error / ctx->nnodes) : -1.0;
+	memset(&dentry, 0, sizeof(DiskEntry));
+	memcpy(&dentry.key, key, sizeof(DSMOptimizerTrackerKey));
+	dentry.flags = DISK_ENTRY_REMOVED;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &dentry, sizeof(DiskEntry));
+	FIN_CRC32C(crc);
+
+	appendBinaryStringInfo(buf, (char *) &dentry, sizeof(DiskEntry));
+	appendBinaryStringInfo(buf, (char *) &crc, sizeof(pg_crc32c));
 }
 
-/* -----------------------------------------------------------------------------
- *
- * UI routines
- *
+/*
+ * Append entries changed since the last checkpoint to the delta log, preceded
+ * by delete records of the entries removed since then. A key inserted again
+ * after its removal isn't deleted: the record of the new entry replaces the
+ * stored one anyway. If too many entries were removed to remember their keys,
+ * the whole table is written instead.
+ * Return true in the case of success.
  */
-
-static void
-_init_rsinfo(PG_FUNCTION_ARGS, ReturnSetInfo *rsinfo, int total_ncols)
+static bool
+_append_delta_log(void)
 {
-	MemoryContext	 oldcontext;
-	TupleDesc		 tup_desc;
+	DSMOptimizerTrackerEntry   *snapshot;
+	DSMOptimizerTrackerKey	   *removed;
+	StringInfoData				buf;
+	const char				   *delta_filename;
+	FILE					   *file = NULL;
+	long						start = -1;
+	uint32						counter = 0;
+	uint32						nremoved;
+	uint32						nlost;
+	uint32						ndeleted = 0;
+	uint32						i;
+	int							save_errno;
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (!IsUnderPostmaster)
+		return false;
 
-	/* Switch into long-lived context to construct returned data structures */
-	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (pg_atomic_read_u32(&shared->load_pending) != 0)
+		return false;
 
-	/* Build a tuple descriptor for our result type */
-	if (get_call_result_type(fcinfo, NULL, &tup_desc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	LWLockAcquire(&shared->io_lock, LW_EXCLUSIVE);
 
-	if (tup_desc->natts != total_ncols)
-		elog(ERROR, "incorrect number of output arguments");
+	/*
+	 * Since the promotion the log of the standby doesn't match the data file
+	 * of the primary: write the whole table under the new name instead.
+	 */
+	if (shared->storage_standby && !RecoveryInProgress())
+	{
+		LWLockRelease(&shared->io_lock);
+		return _flush_hash_table();
+	}
+	delta_filename = storage_file(shared->storage_standby, true);
 
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->setDesc = tup_desc;
+	/* Removals go first, so a key removed and inserted again survives */
+	nremoved = _take_removals(&removed, &nlost);
+	if (nlost > 0)
+	{
+		LWLockRelease(&shared->io_lock);
+		pfree(removed);
+		return _flush_hash_table();
+	}
 
-	MemoryContextSwitchTo(oldcontext);
+	snapshot = _snapshot_entries(true, &counter);
+
+	initStringInfo(&buf);
+	for (i = 0; i < nremoved; i++)
+	{
+		DSMOptimizerTrackerEntry   *entry;
+
+		entry = dshash_find(htab, &removed[i], false);
+		if (entry != NULL)
+		{
+			dshash_release_lock(htab, entry);
+			continue;
+		}
+		_append_removal(&buf, &removed[i]);
+		ndeleted++;
+	}
+	for (i = 0; i < counter; i++)
+		_append_record(&buf, &snapshot[i]);
+
+	if (buf.len == 0)
+		goto done;
+
+	file = AllocateFile(delta_filename, PG_BINARY_A);
+	if (file == NULL)
+		goto error;
+
+	/* A new log starts with the same header as the data file */
+	if (fseek(file, 0, SEEK_END) != 0 || (start = ftell(file)) < 0)
+		goto error;
+	if (start == 0)
+	{
+		DataFileHeader	header;
+
+		_make_header(&header, 0, 0, 0);
+		if (fwrite(&header, sizeof(DataFileHeader), 1, file) != 1)
+			goto error;
+	}
+
+	if (fwrite(buf.data, buf.len, 1, file) != 1)
+		goto error;
+
+	if (fflush(file) != 0 || pg_fsync(fileno(file)) != 0)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	shared->delta_records += counter + ndeleted;
+	elog(DEBUG1, "[%s] %u records and %u removals appended to file %s.",
+		 EXTENSION_NAME, counter, ndeleted, delta_filename);
+
+done:
+	_clear_dirty(snapshot, counter);
+	_forget_removals(nremoved, 0);
+	LWLockRelease(&shared->io_lock);
+
+	pfree(buf.data);
+	pfree(snapshot);
+	pfree(removed);
+	return true;
+
+error:
+	/*
+	 * Dirty flags stay set and the next checkpoint retries. Cut off the torn
+	 * part, otherwise the loader would stop before the records appended later.
+	 */
+	save_errno = errno;
+	if (file)
+	{
+		if (start >= 0 && ftruncate(fileno(file), start) != 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("[%s] could not truncate file \"%s\": %m",
+					 EXTENSION_NAME, delta_filename)));
+		FreeFile(file);
+	}
+	errno = save_errno;
+
+	ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write %s delta file \"%s\": %m",
+			 EXTENSION_NAME, delta_filename)));
+	return false;				/* keep compiler quiet */
 }
 
-PG_FUNCTION_INFO_V1(to_show_data);
-PG_FUNCTION_INFO_V1(to_reset);
+/*
+ * Remember the entry read from the disk. A later record of the same key
+ * replaces the former one.
+ * Keys are compared as blobs, so the key is rebuilt field by field: padding
+ * bytes of a record coming from outside can be anything.
+ * If verify is set, the text is checked to be valid in the database encoding
+ * and dropped otherwise.
+ */
+static void
+_loaded_key(DSMOptimizerTrackerKey *key, const DiskEntry *dentry)
+{
+	memset(key, 0, sizeof(DSMOptimizerTrackerKey));
+	key->dbOid = dentry->key.dbOid;
+	key->toplevel = dentry->key.toplevel;
+	key->queryId = dentry->key.queryId;
+}
 
-Datum
-to_show_data(PG_FUNCTION_ARGS)
+static void
+_loaded_put(HTAB *loaded, const DiskEntry *dentry, const char *text,
+			bool verify)
 {
-	ReturnSetInfo			   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	Datum						values[DATATBL_NCOLS];
-	bool						nulls[DATATBL_NCOLS];
-	dshash_seq_status			stat;
-	DSMOptimizerTrackerEntry   *entry;
+	DSMOptimizerTrackerKey	key;
+	LoadedEntry			   *lentry;
+	bool					found;
 
-	track_attach_shmem();
+	_loaded_key(&key, dentry);
 
-	LWLockAcquire(&shared->lock, LW_SHARED);
-	_init_rsinfo(fcinfo, rsinfo, DATATBL_NCOLS);
+	if (verify && text != NULL && dentry->text_len > 0 &&
+		!pg_verifymbstr(text, dentry->text_len, true))
+		text = NULL;
 
-	dshash_seq_init(&stat, htab, true);
-	while ((entry = dshash_seq_next(&stat)) != NULL)
+	lentry = (LoadedEntry *) hash_search(loaded, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		lentry->text = NULL;
+		lentry->text_len = 0;
+	}
+
+	memcpy(&lentry->stats, &dentry->stats, sizeof(TrackerStats));
+	memcpy(lentry->window, dentry->window, sizeof(lentry->window));
+	if (text != NULL && dentry->text_len > 0)
 	{
-		int		i = 0;
-		char   *str;
+		if (lentry->text != NULL)
+			pfree(lentry->text);
+		lentry->text = palloc(dentry->text_len);
+		memcpy(lentry->text, text, dentry->text_len);
+		lentry->text_len = dentry->text_len;
+	}
+}
 
-		Assert(entry->key.queryId != UINT64CONST(0) &&
-			   OidIsValid(entry->key.dbOid));
+/*
+ * Apply a delete record: forget the entry read before.
+ */
+static void
+_loaded_remove(HTAB *loaded, const DiskEntry *dentry)
+{
+	DSMOptimizerTrackerKey	key;
+	LoadedEntry			   *lentry;
 
-		memset(nulls, 0, DATATBL_NCOLS);
-		values[i++] = ObjectIdGetDatum(entry->key.dbOid);
-		values[i++] = Int64GetDatum(entry->key.queryId);
-
-		/* Query string */
-		Assert(DsaPointerIsValid(entry->querytext_ptr));
-		str = (char *) dsa_get_address(htab_dsa, entry->querytext_ptr);
-		values[i++] = CStringGetTextDatum(str);
-
-		values[i++] = Float8GetDatum(entry->relative_error);
-		values[i++] = Float8GetDatum(entry->error2);
-		values[i++] = Int32GetDatum(entry->assessed_nodes);
-		values[i++] = Int32GetDatum(entry->total_nodes);
-		values[i++] = Float8GetDatum(entry->exec_time * 1000.); /* sec -> msec */
-		values[i++] = Int64GetDatum(entry->nexecs);
-		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
-		Assert(i == DATATBL_NCOLS);
-	}
-	dshash_seq_term(&stat);
-	LWLockRelease(&shared->lock);
-	return (Datum) 0;
+	_loaded_key(&key, dentry);
+	lentry = (LoadedEntry *) hash_search(loaded, &key, HASH_FIND, NULL);
+	if (lentry == NULL)
+		return;
+
+	if (lentry->text != NULL)
+		pfree(lentry->text);
+	(void) hash_search(loaded, &key, HASH_REMOVE, NULL);
 }
 
 /*
- * Reset the state of this extension to default. Show clean up all additionally
- * allocated resources and reset static and global state variables.
+ * Read the data file. Blocks of entries with a wrong checksum are skipped;
+ * if the text section is corrupted, entries are loaded without texts.
+ * Returns number of entries read.
  */
-Datum
-to_reset(PG_FUNCTION_ARGS)
+static uint64
+_load_data_file(HTAB *loaded)
 {
-	dshash_seq_status			stat;
-	DSMOptimizerTrackerEntry   *entry;
+	char		   *data;
+	Size			size;
+	bool			mapped;
+	DataFileHeader	header;
+	const char	   *entries;
+	const char	   *crcs;
+	const char	   *texts;
+	pg_crc32c		crc;
+	bool			texts_valid;
+	uint64			nblocks;
+	uint64			counter = 0;
+	uint64			nskipped = 0;
+	uint64			i;
+	const char	   *filename = storage_file(shared->storage_standby, false);
+
+	data = _map_file(filename, &size, &mapped);
+	if (data == NULL)
+		return 0;
+
+	if (!_check_header(data, size, filename, &header))
+		goto done;
+
+	nblocks = (header.nentries + header.block_entries - 1) / header.block_entries;
+	if (header.nentries > size || header.text_size > size ||
+		size != sizeof(DataFileHeader) + header.nentries * sizeof(DiskEntry) +
+				nblocks * sizeof(pg_crc32c) + header.text_size)
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] data file \"%s\" has wrong size %zu",
+						EXTENSION_NAME, filename, size)));
+		goto done;
+	}
 
-	track_attach_shmem();
+	entries = data + sizeof(DataFileHeader);
+	crcs = entries + header.nentries * sizeof(DiskEntry);
+	texts = crcs + nblocks * sizeof(pg_crc32c);
 
-	/*
-	 * Destroying shared ahsh table is a bit dangerous procedure. Without full
-	 * understanding of the dshash_destroy() technique, delete elements more
-	 * simply, one by one.
-	 */
-	dshash_seq_init(&stat, htab, true);
-	while ((entry = dshash_seq_next(&stat)) != NULL)
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, texts, header.text_size);
+	FIN_CRC32C(crc);
+	texts_valid = EQ_CRC32C(crc, header.text_crc);
+	if (!texts_valid)
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] query texts in data file \"%s\" are corrupted",
+						EXTENSION_NAME, filename)));
+
+	for (i = 0; i < nblocks; i++)
 	{
-		uint32 pre;
+		uint64		first = i * header.block_entries;
+		uint64		n = Min(header.block_entries, header.nentries - first);
+		pg_crc32c	stored;
+		uint64		j;
+
+		memcpy(&stored, crcs + i * sizeof(pg_crc32c), sizeof(pg_crc32c));
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, entries + first * sizeof(DiskEntry),
+					n * sizeof(DiskEntry));
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, stored))
+		{
+			nskipped += n;
+			continue;
+		}
 
-		Assert(entry->key.queryId != UINT64CONST(0) &&
-			   OidIsValid(entry->key.dbOid));
+		for (j = first; j < first + n; j++)
+		{
+			DiskEntry	dentry;
+			const char *text = NULL;
 
-		/* At first, free memory, allocated for the query text */
-		DsaPointerIsValid(entry->querytext_ptr);
-		dsa_free(htab_dsa, entry->querytext_ptr);
+			memcpy(&dentry, entries + j * sizeof(DiskEntry), sizeof(DiskEntry));
+			if (dentry.key.queryId == UINT64CONST(0) ||
+				!OidIsValid(dentry.key.dbOid) || dentry.flags != 0)
+			{
+				nskipped++;
+				continue;
+			}
 
-		dshash_delete_current(&stat);
-		pre = pg_atomic_fetch_sub_u32(&shared->htab_counter, 1);
+			if (texts_valid && dentry.text_len > 0 &&
+				dentry.text_offset <= header.text_size &&
+				dentry.text_len <= header.text_size - dentry.text_offset)
+				text = texts + dentry.text_offset;
 
-		if (pre <= 0)
-			/* Trigger a reboot to cleanup the state. No another solution I see */
-			elog(PANIC, "Inconsistency in the pg_track_optimizer hash table state");
+			_loaded_put(loaded, &dentry, text, false);
+			counter++;
+		}
 	}
-	dshash_seq_term(&stat);
 
-	/* Clean disk storage too */
-	(void) _flush_hash_table();
+	if (nskipped > 0)
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] " UINT64_FORMAT " corrupted records skipped in data file \"%s\"",
+						EXTENSION_NAME, nskipped, filename)));
 
-	PG_RETURN_VOID();
+done:
+	_unmap_file(data, size, mapped);
+	return counter;
 }
 
-/* -----------------------------------------------------------------------------
- *
- * Disk operations
- *
- * -------------------------------------------------------------------------- */
+/*
+ * Decode records following the header, stop at the first incomplete or
+ * corrupted one. Delete records are applied to the local log only: records
+ * coming from outside (verify is set) can't remove anything.
+ * Returns the position where the decoding stopped.
+ */
+static Size
+_parse_records(const char *data, Size size, HTAB *loaded, uint64 *counter,
+			   bool verify)
+{
+	Size	pos = sizeof(DataFileHeader);
 
-PG_FUNCTION_INFO_V1(to_flush);
+	while (pos < size)
+	{
+		DiskEntry	dentry;
+		pg_crc32c	crc;
+		pg_crc32c	stored;
+		const char *text;
 
-static const uint32 DATA_FILE_HEADER	= 12354678;
-static const uint32 DATA_FORMAT_VERSION = 1;
-
-static const DSMOptimizerTrackerEntry EOFEntry = {
-											.key.dbOid = 0,
-											.key.queryId = 0,
-											.relative_error = -2.,
-											.querytext_ptr = 0,
-											.assessed_nodes = -1,
-											.total_nodes = -1,
-											.exec_time = -1.,
-											.nexecs = -1
-											};
-#define IsEOFEntry(entry) ( \
-	(entry)->key.dbOid == EOFEntry.key.dbOid && \
-	(entry)->key.queryId == EOFEntry.key.queryId && \
-	(entry)->querytext_ptr == EOFEntry.querytext_ptr && \
-	(entry)->assessed_nodes == EOFEntry.assessed_nodes && \
-	(entry)->total_nodes == EOFEntry.total_nodes && \
-	(entry)->nexecs == EOFEntry.nexecs \
-)
+		if (size - pos < sizeof(DiskEntry) + sizeof(pg_crc32c))
+			break;
+		memcpy(&dentry, data + pos, sizeof(DiskEntry));
+		if (size - pos - sizeof(DiskEntry) - sizeof(pg_crc32c) < dentry.text_len)
+			break;
+		text = data + pos + sizeof(DiskEntry);
+		memcpy(&stored, text + dentry.text_len, sizeof(pg_crc32c));
+
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, &dentry, sizeof(DiskEntry));
+		COMP_CRC32C(crc, text, dentry.text_len);
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(crc, stored) || dentry.key.queryId == UINT64CONST(0) ||
+			!OidIsValid(dentry.key.dbOid))
+			break;
 
-#define EXTENSION_NAME "pg_track_optimizer"
-const char *filename = EXTENSION_NAME".stat";
+		pos += sizeof(DiskEntry) + dentry.text_len + sizeof(pg_crc32c);
+		if ((dentry.flags & DISK_ENTRY_REMOVED) != 0)
+		{
+			if (!verify)
+			{
+				_loaded_remove(loaded, &dentry);
+				(*counter)++;
+			}
+			continue;
+		}
+
+		_loaded_put(loaded, &dentry, text, verify);
+		(*counter)++;
+	}
+
+	return pos;
+}
 
 /*
- * Specifics of the storage procedure of dshash table:
- * we don't block the table entirely, so we don't know how many records
- * will be eventually stored.
- * Return true in the case of success.
+ * Apply records of the delta log on top of the data file. The later record of
+ * an entry wins. A truncated or torn tail of the log (the server crashed during
+ * the append) is ignored; *truncated is set then.
+ * Returns number of records applied.
  */
-static bool
-_flush_hash_table(void)
+static uint64
+_load_delta_file(HTAB *loaded, bool *truncated)
 {
-	dshash_seq_status			stat;
-	DSMOptimizerTrackerEntry   *entry;
-	char					   *tmpfile = psprintf("%s.tmp", EXTENSION_NAME);
-	FILE					   *file;
-	uint32						counter = 0;
+	char		   *data;
+	Size			size;
+	bool			mapped;
+	DataFileHeader	header;
+	Size			pos;
+	uint64			counter = 0;
+	const char	   *delta_filename = storage_file(shared->storage_standby, true);
 
-	if (!IsUnderPostmaster)
-		return false;
+	*truncated = false;
 
-	file = AllocateFile(tmpfile, PG_BINARY_W);
-	if (file == NULL)
-		goto error;
+	data = _map_file(delta_filename, &size, &mapped);
+	if (data == NULL)
+		return 0;
 
-	/* Add a header to the file for more reliable identification of the data */
-	if (fwrite(&DATA_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
-		fwrite(&DATA_FORMAT_VERSION, sizeof(uint32), 1, file) != 1)
-		goto error;
+	if (!_check_header(data, size, delta_filename, &header))
+	{
+		/* Don't append after the garbage */
+		*truncated = true;
+		goto done;
+	}
 
-	dshash_seq_init(&stat, htab, true);
-	while ((entry = dshash_seq_next(&stat)) != NULL)
+	pos = _parse_records(data, size, loaded, &counter, false);
+	if (pos < size)
 	{
-		char   *str;
-		uint32	len;
+		*truncated = true;
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] delta file \"%s\" is truncated, " UINT64_FORMAT " records applied",
+						EXTENSION_NAME, delta_filename, counter)));
+	}
 
-		Assert(entry->key.queryId != UINT64CONST(0) &&
-			   OidIsValid(entry->key.dbOid) &&
-			   DsaPointerIsValid(entry->querytext_ptr));
+done:
+	_unmap_file(data, size, mapped);
+	return counter;
+}
+
+/*
+ * Put the loaded entries into the shared table as entries of the generation.
+ * If the worker loads the data lazily, backends could already track some of
+ * the queries: merge the loaded statistics into their entries. If the table
+ * has been reset since the generation, the rest of the data is dropped.
+ */
+static uint64
+_install_loaded(HTAB *loaded, bool reserve, uint32 generation)
+{
+	HASH_SEQ_STATUS		hstat;
+	LoadedEntry		   *lentry;
+	uint64				counter = 0;
+
+	hash_seq_init(&hstat, loaded);
+	while ((lentry = (LoadedEntry *) hash_seq_search(&hstat)) != NULL)
+	{
+		DSMOptimizerTrackerEntry   *entry;
+		bool						found;
 
-		str = (char *) dsa_get_address(htab_dsa, entry->querytext_ptr);
-		len = strlen(str);
+		if (entry_is_stale(generation))
+		{
+			hash_seq_term(&hstat);
+			break;
+		}
 
 		/*
-		 * Write data into the file. It is more or less stable procedure:
-		 * I don't think someone will try to save the data on one platform and
-		 * restore it on very different another one.
+		 * The disk storage was accounted before the server start, but merged
+		 * snapshots must fit into the limit.
 		 */
-		if (fwrite(entry, sizeof(DSMOptimizerTrackerEntry), 1, file) != 1 ||
-			fwrite(&len, sizeof(uint32), 1, file) != 1 ||
-			fwrite(str, len, 1, file) != 1)
-			goto error;
+		if (reserve && !track_reserve_memory(ENTRY_MEM_SIZE))
+		{
+			pg_atomic_fetch_add_u64(&shared->ndropped, 1);
+			continue;
+		}
 
+		entry = dshash_find_or_insert(htab, &lentry->key, &found);
+		if (reserve && found)
+			pg_atomic_fetch_sub_u64(&shared->mem_used, ENTRY_MEM_SIZE);
+
+		if (!found)
+		{
+			entry->textid = (lentry->text != NULL) ?
+							text_store_add(lentry->text, lentry->text_len) : 0;
+			entry->generation = generation;
+			entry->dirty = false;
+			entry->changes = 0;
+			entry->plan = InvalidDsaPointer;
+			entry->plan_error = -1.;
+			entry->detail = InvalidDsaPointer;
+			entry->detail_nnodes = 0;
+			memcpy(&entry->stats, &lentry->stats, sizeof(TrackerStats));
+			memcpy(entry->window, lentry->window, sizeof(entry->window));
+			_slot_add(entry);
+			pg_atomic_fetch_add_u32(&shared->htab_counter, 1);
+			if (!reserve)
+				pg_atomic_fetch_add_u64(&shared->mem_used, ENTRY_MEM_SIZE);
+		}
+		else if (entry->generation != generation &&
+				 !entry_is_stale(entry->generation))
+		{
+			/* Reset in between: the entry belongs to the newer generation */
+			dshash_release_lock(htab, entry);
+			continue;
+		}
+		else
+		{
+			if (entry->generation != generation)
+			{
+				entry->generation = generation;
+				_free_entry_plan(entry);
+				_free_entry_detail(entry);
+				tracker_stats_init(&entry->stats);
+				memset(entry->window, 0, sizeof(entry->window));
+			}
+			tracker_stats_merge(&entry->stats, &lentry->stats);
+			window_merge(entry->window, lentry->window);
+			_mark_dirty(entry);
+		}
+		dshash_release_lock(htab, entry);
 		counter++;
 	}
-	dshash_seq_term(&stat);
 
-	/* As a last record write EOF record and a number of records have written */
-	if (fwrite(&EOFEntry, sizeof(DSMOptimizerTrackerEntry), 1, file) != 1 ||
-		fwrite(&counter, sizeof(uint32), 1, file) != 1)
-		goto error;
+	return counter;
+}
 
-	if (FreeFile(file))
+/*
+ * Load the data file and the delta log into the shared table. Called once,
+ * by the background worker or, if there is no worker, by the first backend
+ * attached to the shared memory. Does nothing if somebody else has taken the
+ * load already.
+ * The loader holds the io_lock, so waiting for the load is just taking it.
+ */
+static void
+track_load_storage(void)
+{
+	MemoryContext	load_cxt;
+	MemoryContext	oldcxt;
+	HASHCTL			ctl;
+	HTAB		   *loaded;
+	uint64			nentries;
+	uint64			nrecords;
+	bool			truncated;
+	uint32			expected = LOAD_PENDING;
+	uint32			generation;
+
+	LWLockAcquire(&shared->io_lock, LW_EXCLUSIVE);
+	if (!pg_atomic_compare_exchange_u32(&shared->load_pending, &expected,
+										LOAD_RUNNING))
 	{
-		file = NULL;
-		goto error;
+		LWLockRelease(&shared->io_lock);
+		return;
 	}
 
-	(void) durable_rename(tmpfile, filename, LOG);
-	pfree(tmpfile);
-	elog(LOG, "[%s] %u records stored in file %s.",
-		 EXTENSION_NAME, counter, filename);
-	return true;
+	/* Data of the disk belongs to the generation the load has started at */
+	generation = pg_atomic_read_u32(&shared->generation);
 
-error:
-	ereport(ERROR,
-			(errcode_for_file_access(),
-			 errmsg("could not write %s data file \"%s\": %m",
-			 EXTENSION_NAME, tmpfile)));
+	load_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pg_track_optimizer load",
+									 ALLOCSET_DEFAULT_SIZES);
+	oldcxt = MemoryContextSwitchTo(load_cxt);
 
-	if (file)
-		FreeFile(file);
-	unlink(tmpfile);
-	pfree(tmpfile);
-	return false;
+	PG_TRY();
+	{
+		ctl.keysize = sizeof(DSMOptimizerTrackerKey);
+		ctl.entrysize = sizeof(LoadedEntry);
+		ctl.hcxt = load_cxt;
+		loaded = hash_create("pg_track_optimizer loaded entries", 1024, &ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		nentries = _load_data_file(loaded);
+		nrecords = _load_delta_file(loaded, &truncated);
+		(void) _install_loaded(loaded, false, generation);
+
+		/* Compact the log at the next checkpoint, if it has garbage */
+		shared->delta_records = truncated ? PG_UINT64_MAX : nrecords;
+
+		elog(LOG, "[%s] " UINT64_FORMAT " records loaded from file %s, " UINT64_FORMAT " from file %s.",
+			 EXTENSION_NAME, nentries,
+			 storage_file(shared->storage_standby, false), nrecords,
+			 storage_file(shared->storage_standby, true));
+	}
+	PG_FINALLY();
+	{
+		/* Never retry: a file we failed to read is lost anyway */
+		pg_atomic_write_u32(&shared->load_pending, LOAD_DONE);
+		LWLockRelease(&shared->io_lock);
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextDelete(load_cxt);
 }
 
 /*
- * Read data file record by record and add each record into the new table
- * Provide reference to the shared area because the local pointer still not
- * initialized.
+ * The worker may be unable to start at all. If it hasn't loaded the disk
+ * storage in LOAD_WAIT_TIMEOUT seconds, the backend does it.
  */
-static bool
-_load_hash_table(TODSMRegistry *state)
+static void
+track_load_fallback(void)
 {
-	FILE					   *file;
-	uint32						header;
-	int32						pgver;
-	uint32						counter = 0;
-	DSMOptimizerTrackerEntry	disk_entry;
-	DSMOptimizerTrackerEntry   *entry;
+	if (pg_atomic_read_u32(&shared->load_pending) != LOAD_PENDING ||
+		!TimestampDifferenceExceeds(shared->load_start, GetCurrentTimestamp(),
+									LOAD_WAIT_TIMEOUT * 1000))
+		return;
+
+	elog(LOG, "[%s] the worker hasn't loaded the disk storage, the backend does it",
+		 EXTENSION_NAME);
+	track_load_storage();
+}
+
+/*
+ * Wait until the disk storage is loaded, loading it if nobody has started yet.
+ */
+static void
+track_wait_load(void)
+{
+	if (pg_atomic_read_u32(&shared->load_pending) == LOAD_DONE)
+		return;
+
+	track_load_storage();
+	LWLockAcquire(&shared->io_lock, LW_SHARED);
+	LWLockRelease(&shared->io_lock);
+}
+
+PG_FUNCTION_INFO_V1(to_export);
+PG_FUNCTION_INFO_V1(to_merge);
+
+/* Bounds of the export chunk size */
+#define EXPORT_MIN_CHUNK	(8 * 1024)
+#define EXPORT_MAX_CHUNK	(256 * 1024 * 1024)
+
+/*
+ * Export the table as a set of binary chunks. Each chunk is self-contained:
+ * the header of the delta log followed by its records, so it can be passed
+ * to pg_track_optimizer_merge() on another server independently from the
+ * others. A chunk exceeds the size only if a single record is bigger.
+ */
+Datum
+to_export(PG_FUNCTION_ARGS)
+{
+	int32						chunk_size = PG_GETARG_INT32(0);
+	ReturnSetInfo			   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	DSMOptimizerTrackerEntry   *snapshot;
+	StringInfoData				buf;
+	DataFileHeader				header;
+	uint32						nentries;
+	uint32						nrecords = 0;
+	uint32						i;
+
+	if (chunk_size < EXPORT_MIN_CHUNK || chunk_size > EXPORT_MAX_CHUNK)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("chunk size must be between %d and %d bytes",
+						EXPORT_MIN_CHUNK, EXPORT_MAX_CHUNK)));
 
 	track_attach_shmem();
 
-	file = AllocateFile(filename, PG_BINARY_R);
-	if (file == NULL)
-	{
-		if (errno != ENOENT)
-			goto read_error;
-		/* File not exists */
-		return false;
-	}
+	/* The result is a set of bytea, not of records */
+	InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
 
-	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
-		fread(&pgver, sizeof(uint32), 1, file) != 1)
-		goto read_error;
-	if (header != DATA_FILE_HEADER)
-		goto data_header_error;
-	if (pgver != DATA_FORMAT_VERSION)
-		goto data_version_error;
+	snapshot = _snapshot_entries(false, &nentries);
 
-	while (!feof(file))
+	initStringInfo(&buf);
+	appendStringInfoSpaces(&buf, VARHDRSZ + sizeof(DataFileHeader));
+	for (i = 0; i <= nentries; i++)
 	{
-		char   *str;
-		uint32	len;
-		bool	found;
+		Datum	value;
+		bool	null = false;
 
-		/* First step - read the record */
-		if (fread(&disk_entry, sizeof(DSMOptimizerTrackerEntry), 1, file) != 1)
-			goto read_error;
-
-		/* Check last record */
-		if (IsEOFEntry(&disk_entry))
+		if (i < nentries)
 		{
-			uint32 cnt;
+			_append_record(&buf, &snapshot[i]);
+			nrecords++;
+			if (buf.len < chunk_size)
+				continue;
+		}
 
-			if (fread(&cnt, sizeof(uint32), 1, file) != 1)
-				goto read_error;
+		if (nrecords == 0)
+			break;
 
-			if (cnt != counter)
-				elog(ERROR,
-					 "[%s] Incorrect number of records read: %u instead of %u",
-					 EXTENSION_NAME, counter, cnt);
+		_make_header(&header, nrecords, 0, 0);
+		memcpy(buf.data + VARHDRSZ, &header, sizeof(DataFileHeader));
+		SET_VARSIZE(buf.data, buf.len);
+		value = PointerGetDatum(buf.data);
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &null);
 
-			/* Correct finish of the load operation */
-			break;
-		}
+		resetStringInfo(&buf);
+		appendStringInfoSpaces(&buf, VARHDRSZ + sizeof(DataFileHeader));
+		nrecords = 0;
+	}
 
-		/* The case of next entry */
+	pfree(buf.data);
+	pfree(snapshot);
+	return (Datum) 0;
+}
 
-		Assert(disk_entry.key.queryId != UINT64CONST(0) &&
-			   OidIsValid(disk_entry.key.dbOid));
+/*
+ * Merge a chunk exported by pg_track_optimizer_export() into the table.
+ * Statistics of the same (dbOid, queryId, toplevel) are aggregated, new
+ * entries are added while they fit into hash_mem. Returns the number of
+ * merged entries.
+ */
+Datum
+to_merge(PG_FUNCTION_ARGS)
+{
+	bytea		   *chunk = PG_GETARG_BYTEA_PP(0);
+	const char	   *data = VARDATA_ANY(chunk);
+	Size			size = VARSIZE_ANY_EXHDR(chunk);
+	DataFileHeader	header;
+	HASHCTL			ctl;
+	HTAB		   *loaded;
+	uint64			nrecords = 0;
+	uint64			counter;
+
+	if (!_check_header(data, size, "export chunk", &header))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("[%s] invalid export chunk", EXTENSION_NAME)));
 
-		/* Load query string */
-		if (fread(&len, sizeof(uint32), 1, file) != 1)
-			goto read_error;
-		disk_entry.querytext_ptr = dsa_allocate0(htab_dsa, len + 1);
-		Assert(DsaPointerIsValid(disk_entry.querytext_ptr));
-		str = (char *) dsa_get_address(htab_dsa, disk_entry.querytext_ptr);
-		if (fread(str, len, 1, file) != 1)
-			goto read_error;
+	ctl.keysize = sizeof(DSMOptimizerTrackerKey);
+	ctl.entrysize = sizeof(LoadedEntry);
+	ctl.hcxt = CurrentMemoryContext;
+	loaded = hash_create("pg_track_optimizer merged entries", 1024, &ctl,
+						 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
-		entry = dshash_find_or_insert(htab, &disk_entry.key, &found);
-		if (found)
-			ereport(ERROR,
+	/* The chunk comes from outside: check texts before storing them */
+	if (_parse_records(data, size, loaded, &nrecords, true) != size ||
+		nrecords != header.nentries)
+		ereport(ERROR,
 				(errcode(ERRCODE_DATA_CORRUPTED),
-				 errmsg("[%s] data file \"%s\" has duplicated record with dbOid %u and queryId %ld.",
-				 EXTENSION_NAME, filename, disk_entry.key.dbOid, disk_entry.key.queryId)));
+				 errmsg("[%s] export chunk is corrupted", EXTENSION_NAME),
+				 errdetail("Decoded " UINT64_FORMAT " of " UINT64_FORMAT " records.",
+						   nrecords, header.nentries)));
 
-		/*
-		 * TODO: copy all data in one operation. At least we will not do
-		 * annoying copy DSM pointer.
-		 */
-		entry->relative_error = disk_entry.relative_error;
-		entry->error2 = disk_entry.error2;
-		entry->assessed_nodes = disk_entry.assessed_nodes;
-		entry->total_nodes = disk_entry.total_nodes;
-		entry->exec_time = disk_entry.exec_time;
-		entry->nexecs = disk_entry.nexecs;
-		entry->querytext_ptr = disk_entry.querytext_ptr;
+	track_attach_shmem();
+	counter = _install_loaded(loaded, true,
+							  pg_atomic_read_u32(&shared->generation));
 
-		dshash_release_lock(htab, entry);
-		counter++;
-	}
+	hash_destroy(loaded);
+	PG_RETURN_INT64((int64) counter);
+}
 
-	FreeFile(file);
-	pg_atomic_write_u32(&state->htab_counter, counter);
-	elog(LOG, "[%s] %u records loaded from file %s.",
-		 EXTENSION_NAME, counter, filename);
-	return true;
+/*
+ * Write the whole table (compact) or only the changed entries into the disk
+ * storage. Accounted as a flush phase.
+ */
+static bool
+track_write_storage(bool compact)
+{
+	PhaseTimer	timer;
+	bool		result;
 
-read_error:
-	ereport(ERROR,
-			(errcode_for_file_access(),
-			 errmsg("[%s] could not read file \"%s\": %m",
-			 EXTENSION_NAME, filename)));
-	goto fail;
-data_header_error:
-	ereport(ERROR,
-			(errcode(ERRCODE_DATA_CORRUPTED),
-			 errmsg("[%s] data file \"%s\" has incompatible header version %d instead of %d.",
-			 EXTENSION_NAME, filename, header, DATA_FILE_HEADER)));
-	goto fail;
-data_version_error:
-	ereport(ERROR,
-			(errcode(ERRCODE_DATA_CORRUPTED),
-			 errmsg("[%s] data file \"%s\" has incompatible postgres version %d instead of %d.",
-			 EXTENSION_NAME, filename, pgver, DATA_FORMAT_VERSION)));
-fail:
-	if (file)
-		FreeFile(file);
+	phase_begin(TRACK_PHASE_FLUSH, &timer);
+	pgstat_report_wait_start(track_wait_flush);
+	result = compact ? _flush_hash_table() : _append_delta_log();
+	pgstat_report_wait_end();
+	phase_end(&timer);
 
-	return false;
+	return result;
 }
 
 Datum
@@ -962,7 +7984,131 @@ to_flush(PG_FUNCTION_ARGS)
 {
 	track_attach_shmem();
 
-	_flush_hash_table();
+	(void) track_write_storage(true);
 
 	PG_RETURN_VOID();
 }
+
+/* -----------------------------------------------------------------------------
+ *
+ * Background worker
+ *
+ * -------------------------------------------------------------------------- */
+
+static volatile sig_atomic_t got_sigterm = false;
+
+static void
+track_worker_sigterm(SIGNAL_ARGS)
+{
+	got_sigterm = true;
+	SetLatch(MyLatch);
+}
+
+/*
+ * Write the changes accumulated since the last checkpoint. Compact the delta
+ * log into the data file if the log has grown bigger than the table itself.
+ */
+static void
+track_worker_checkpoint(void)
+{
+	uint64	delta_records;
+	uint64	threshold;
+
+	LWLockAcquire(&shared->io_lock, LW_SHARED);
+	delta_records = shared->delta_records;
+	LWLockRelease(&shared->io_lock);
+
+	threshold = Max(pg_atomic_read_u32(&shared->htab_counter),
+					DELTA_COMPACT_MIN_RECORDS);
+
+	(void) track_write_storage(delta_records +
+							   pg_atomic_read_u32(&shared->ndirty) > threshold);
+}
+
+static void
+track_worker_exit(int code, Datum arg)
+{
+	LWLockAcquire(&shared->log_lock, LW_EXCLUSIVE);
+	shared->worker_proc = NULL;
+	LWLockRelease(&shared->log_lock);
+}
+
+void
+track_worker_main(Datum main_arg)
+{
+	MemoryContext	worker_cxt;
+	TimestampTz		last_checkpoint;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, track_worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	worker_cxt = AllocSetContextCreate(TopMemoryContext,
+									   "pg_track_optimizer worker",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	/* Load the data file at the server start, not at the first query */
+	track_attach_shmem();
+	track_load_storage();
+	last_checkpoint = GetCurrentTimestamp();
+
+	/* Since this moment backends may pass plans to the worker */
+	LWLockAcquire(&shared->log_lock, LW_EXCLUSIVE);
+	shared->worker_proc = MyProc;
+	LWLockRelease(&shared->log_lock);
+	before_shmem_exit(track_worker_exit, (Datum) 0);
+
+	for (;;)
+	{
+		bool			shutdown;
+		uint32			nchanges;
+		TimestampTz		now;
+		MemoryContext	oldcxt;
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 1000L,
+						 track_wait_main);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		shutdown = got_sigterm;
+
+		oldcxt = MemoryContextSwitchTo(worker_cxt);
+		track_log_drain();
+		track_reset_cleanup();
+		track_gc();
+		track_detail_refresh();
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(worker_cxt);
+
+		nchanges = pg_atomic_read_u32(&shared->ndirty) + _pending_removals();
+		now = GetCurrentTimestamp();
+
+		/* Clean shutdown always stores the changes */
+		if (nchanges > 0 &&
+			(shutdown ||
+			 (flush_interval > 0 &&
+			  TimestampDifferenceExceeds(last_checkpoint, now,
+										 flush_interval * 1000)) ||
+			 (flush_dirty_entries > 0 && nchanges >= flush_dirty_entries)))
+		{
+			oldcxt = MemoryContextSwitchTo(worker_cxt);
+			track_worker_checkpoint();
+			MemoryContextSwitchTo(oldcxt);
+			MemoryContextReset(worker_cxt);
+			last_checkpoint = now;
+		}
+
+		if (shutdown)
+			break;
+	}
+
+	proc_exit(0);
+}
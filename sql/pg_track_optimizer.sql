@@ -21,9 +21,171 @@ ORDER BY querytext; -- Must see it.
 -- TODO: Disable storing of queries, involving the extension UI objects
 
 SELECT * FROM pto_test WHERE x < 1;
--- Must see second execution of the query in nexecs (don't mind EXPLAIN)
+-- Statement nested into EXPLAIN is tracked apart from the top-level one
 SELECT querytext,relative_error>=0,nodes_assessed,nodes_total,exec_time>0,nexecs
 FROM pg_track_optimizer()
 ORDER BY querytext;
 
+-- Sampling: the rate is a probability
+SET pg_track_optimizer.sample_rate = 1.5;
+SET pg_track_optimizer.sample_rate = -0.1;
+-- Unsampled queries aren't stored, sampled ones are weighted by 1 / rate
+SET pg_track_optimizer.sample_rate = 0;
+SELECT count(*) AS pto_unsampled FROM pto_test;
+SET pg_track_optimizer.sample_rate = 0.5;
+DO $$
+BEGIN
+  FOR i IN 1..50 LOOP
+    PERFORM count(*) AS pto_sampled FROM pto_test;
+  END LOOP;
+END $$;
+RESET pg_track_optimizer.sample_rate;
+SELECT count(*) FILTER (WHERE querytext LIKE '%pto_unsampled%') AS unsampled,
+       bool_and(est_nexecs > nexecs) FILTER (WHERE querytext LIKE '%pto_sampled%') AS weighted
+FROM pg_track_optimizer();
+
+-- Top-K queries
+SELECT count(*) FROM pg_track_optimizer_top(2, 'nexecs');
+SELECT count(*) FROM pg_track_optimizer_top(2, 'error');
+
+-- Per-node histograms
+SELECT node, nnodes > 0 AS assessed FROM pg_track_optimizer_nodes()
+WHERE node = 'Seq Scan';
+
+-- Worst plan of a query: the function scan is estimated to return 1000 rows
+SET pg_track_optimizer.plan_min_error = 0;
+SELECT count(*) FROM pg_track_optimizer_self_stats();
+SELECT pg_track_optimizer_plan(queryid)::jsonb #>> '{Plan,Node Type}' AS node
+FROM pg_track_optimizer()
+WHERE querytext LIKE 'SELECT count(*) FROM pg_track_optimizer_self_stats()%';
+RESET pg_track_optimizer.plan_min_error;
+
+-- Cluster-wide counters
+SELECT nexecs > 0 AS counted FROM pg_track_optimizer_stats() WHERE dboid IS NULL;
+
+-- Recent statistics
+SELECT count(*) > 0 AS recent FROM pg_track_optimizer_window('1 hour');
+SELECT count(*) FROM pg_track_optimizer_window('-1 hour');
+SELECT count(*) FROM pg_track_optimizer_window('infinity');
+
+-- Phases of the extension's own work
+SELECT phase FROM pg_track_optimizer_self_stats();
+
+-- Export and merge back: statistics of the same query are summed
+CREATE TEMP TABLE pto_export AS
+SELECT c FROM pg_track_optimizer_export(8192) AS c;
+SELECT sum(pg_track_optimizer_merge(c)) > 0 AS merged FROM pto_export;
+SELECT nexecs FROM pg_track_optimizer()
+WHERE querytext LIKE 'SELECT * FROM pto_test%';
+DROP TABLE pto_export;
+SELECT count(*) FROM pg_track_optimizer_export(1024);
+SELECT pg_track_optimizer_merge('\x00');
+
+-- Per-relation errors
+SELECT relname, nscans > 0 AS scanned FROM pg_track_optimizer_relations()
+WHERE relid = 'pto_test'::regclass;
+
+-- Correlated columns: advice is visible while the backend is still running
+CREATE TABLE pto_corr AS SELECT gs % 100 AS a, gs % 100 AS b
+FROM generate_series(1, 10000) AS gs;
+ANALYZE pto_corr;
+SELECT count(*) FROM pto_corr WHERE a = 1 AND b = 1;
+SELECT attnums, statement FROM pg_track_optimizer_advice()
+WHERE relid = 'pto_corr'::regclass;
+
+-- Instrumentation tier 'rows': error2 is weighted by the cost of nodes. The
+-- scan takes almost all the cost and is estimated to return 1 row of 100.
+SET pg_track_optimizer.instrumentation = 'rows';
+SELECT count(a) AS pto_rows_tier FROM pto_corr WHERE a = 1 AND b = 1;
+RESET pg_track_optimizer.instrumentation;
+SELECT abs(error2 - ln(100)) < 0.01 AS cost_weighted,
+       abs(relative_error - ln(100) / 2) < 0.01 AS mean
+FROM pg_track_optimizer() WHERE querytext LIKE '%pto_rows_tier%';
+
+-- Parallel plans: a Gather without workers is counted in workers_short, the
+-- only worker which has run the scan has no skew
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 1;
+SET max_parallel_workers = 0;
+SELECT count(a) AS pto_no_workers FROM pto_corr;
+RESET max_parallel_workers;
+SET parallel_leader_participation = off;
+SELECT count(b) AS pto_one_worker FROM pto_corr;
+RESET parallel_leader_participation;
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+SELECT substring(querytext from 'pto_[a-z_]+') AS query, worker_skew, workers_short
+FROM pg_track_optimizer()
+WHERE querytext ~ 'AS pto_(no_workers|one_worker) '
+ORDER BY query;
+
+-- Partitions: one of three is pruned by the planner, or at the executor
+-- startup for a generic plan
+CREATE TABLE pto_parts (k integer) PARTITION BY RANGE (k);
+CREATE TABLE pto_parts_1 PARTITION OF pto_parts FOR VALUES FROM (0) TO (10);
+CREATE TABLE pto_parts_2 PARTITION OF pto_parts FOR VALUES FROM (10) TO (20);
+CREATE TABLE pto_parts_3 PARTITION OF pto_parts FOR VALUES FROM (20) TO (30);
+INSERT INTO pto_parts SELECT gs % 30 FROM generate_series(1, 300) AS gs;
+ANALYZE pto_parts;
+SELECT count(*) AS pto_plan_pruned FROM pto_parts WHERE k < 20;
+SET plan_cache_mode = force_generic_plan;
+PREPARE pto_parts_prep(integer) AS
+  SELECT count(*) AS pto_startup_pruned FROM pto_parts WHERE k < $1;
+EXECUTE pto_parts_prep(20);
+DEALLOCATE pto_parts_prep;
+RESET plan_cache_mode;
+SELECT substring(querytext from 'pto_[a-z]+_pruned') AS query,
+       partitions_scanned, partitions_pruned
+FROM pg_track_optimizer()
+WHERE querytext ~ 'AS pto_(plan|startup)_pruned '
+ORDER BY query;
+DROP TABLE pto_parts;
+
+-- EXECUTE of a prepared statement is tracked as a top-level statement
+SET pg_track_optimizer.track_nested = off;
+PREPARE pto_prep AS SELECT count(*) AS pto_prepared FROM pto_test;
+EXECUTE pto_prep;
+EXECUTE pto_prep;
+SELECT toplevel, nexecs FROM pg_track_optimizer()
+WHERE querytext LIKE '%pto_prepared%';
+DEALLOCATE pto_prep;
+RESET pg_track_optimizer.track_nested;
+
+-- Limits of the plan analysis
+SET pg_track_optimizer.max_nodes = 1;
+SELECT count(*) AS pto_max_nodes FROM pto_test;
+RESET pg_track_optimizer.max_nodes;
+SET pg_track_optimizer.append_children_limit = 2;
+SELECT count(*) AS pto_limited FROM (SELECT x FROM pto_test UNION ALL
+  SELECT x FROM pto_test UNION ALL SELECT x FROM pto_test) AS u;
+RESET pg_track_optimizer.append_children_limit;
+SELECT count(*) AS pto_unlimited FROM (SELECT x FROM pto_test UNION ALL
+  SELECT x FROM pto_test UNION ALL SELECT x FROM pto_test) AS u;
+SELECT substring(querytext from 'pto_[a-z_]+') AS query, nodes_assessed, nodes_total
+FROM pg_track_optimizer()
+WHERE querytext ~ 'AS pto_(max_nodes|limited|unlimited) '
+ORDER BY query;
+
+-- Reset of a single query keeps the other entries
+SELECT pg_track_optimizer_reset(NULL, queryid) FROM pg_track_optimizer()
+WHERE querytext LIKE 'SELECT * FROM pto_test%';
+SELECT count(*) FILTER (WHERE querytext LIKE 'SELECT * FROM pto_test%') AS removed,
+       count(*) > 0 AS kept
+FROM pg_track_optimizer();
+-- Reset of the database leaves only the reset statement itself
+SELECT pg_track_optimizer_reset(oid) FROM pg_database
+WHERE datname = current_database();
+SELECT count(*) AS remained FROM pg_track_optimizer();
+
+-- Memory limit: the new query evicts the old entries to fit into hash_mem
+SET pg_track_optimizer.hash_mem = '1kB';
+SELECT count(*) AS pto_evict FROM pto_test;
+SELECT evicted > 0 AS evicted, entries < 2 AS bounded
+FROM pg_track_optimizer_status();
+RESET pg_track_optimizer.hash_mem;
+
 DROP EXTENSION pg_track_optimizer;
@@ -0,0 +1,65 @@
+# Copyright (c) 2024 Andrei Lepikhov
+#
+# This software may be modified and distributed under the terms
+# of the MIT license. See the LICENSE file for details.
+
+# Adaptive log_min_error: nothing is admitted in normal mode until the sketch
+# has enough executions, then the threshold is derived from their errors.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('adaptive');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_track_optimizer'
+compute_query_id = on
+pg_track_optimizer.mode = 'normal'
+pg_track_optimizer.log_min_error_quantile = 0.5
+});
+$node->start;
+
+# The table has correlated columns: the scan is estimated to return one row
+# instead of 100, so relative error of the query is about log(100) / 2.
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_track_optimizer;
+CREATE TABLE pto_corr AS
+  SELECT gs % 100 AS a, gs % 100 AS b FROM generate_series(1, 10000) AS gs;
+ANALYZE pto_corr;
+});
+
+is( $node->safe_psql(
+		'postgres',
+		"SELECT log_min_error = 'Infinity' FROM pg_track_optimizer_status()"),
+	't',
+	'threshold is unknown before the sketch is fed');
+
+my $query = 'SELECT count(*) FROM pto_corr WHERE a = 1 AND b = 1;';
+$node->safe_psql('postgres', $query x 10);
+is($node->safe_psql('postgres', 'SELECT count(*) FROM pg_track_optimizer()'),
+	'0', 'nothing is stored while the threshold is unknown');
+
+# Enough executions for the sketch. The threshold is refreshed at most once per
+# second, so feed it until a refresh sees them.
+$node->safe_psql('postgres', $query x 200);
+ok( $node->poll_query_until(
+		'postgres',
+		"SELECT log_min_error < 'Infinity' FROM pg_track_optimizer_status()"),
+	'threshold is derived from the sketch');
+
+is( $node->safe_psql(
+		'postgres',
+		'SELECT log_min_error > 1 AND log_min_error < 5
+		 FROM pg_track_optimizer_status()'),
+	't',
+	'threshold is the median of the errors');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,65 @@
+# Copyright (c) 2024 Andrei Lepikhov
+#
+# This software may be modified and distributed under the terms
+# of the MIT license. See the LICENSE file for details.
+
+# Logging of plans: the limit of logged plans per query and the asynchronous
+# logging by the background worker.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('log');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_track_optimizer'
+compute_query_id = on
+pg_track_optimizer.mode = 'forced'
+pg_track_optimizer.log_min_error = 0
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_track_optimizer;
+CREATE TABLE pto_log AS SELECT gs AS x FROM generate_series(1, 100) AS gs;
+ANALYZE pto_log;
+});
+
+# The plan of the same query is logged once per log_min_interval
+my $offset = -s $node->logfile;
+my $query = 'SELECT count(*) AS pto_interval FROM pto_log;';
+$node->safe_psql('postgres',
+	"SET pg_track_optimizer.log_min_interval = '1h'; " . ($query x 3));
+my $log = slurp_file($node->logfile, $offset);
+my $nlogged = () = $log =~ /Query Text: SELECT count\(\*\) AS pto_interval/g;
+is($nlogged, 1, 'plans are limited by log_min_interval');
+
+$offset = -s $node->logfile;
+$node->safe_psql('postgres', $query x 3);
+$log = slurp_file($node->logfile, $offset);
+$nlogged = () = $log =~ /Query Text: SELECT count\(\*\) AS pto_interval/g;
+is($nlogged, 3, 'plans are logged each time without the limit');
+
+# The asynchronous plan is written by the worker with the origin of the query
+$offset = -s $node->logfile;
+my ($count, $pid) = split(
+	/\n/,
+	$node->safe_psql(
+		'postgres',
+		"SET pg_track_optimizer.log_mode = 'async';
+		 SELECT count(*) AS pto_async FROM pto_log;
+		 SELECT pg_backend_pid();"));
+$node->wait_for_log(
+	qr/Query Text: SELECT count\(\*\) AS pto_async.*?DETAIL:  Query -?\d+ executed by process $pid\./s,
+	$offset);
+pass('plan is logged by the worker');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,65 @@
+# Copyright (c) 2024 Andrei Lepikhov
+#
+# This software may be modified and distributed under the terms
+# of the MIT license. See the LICENSE file for details.
+
+# A corrupted block of entries in the data file is skipped with a warning,
+# the other blocks are loaded.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('corrupted');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_track_optimizer'
+compute_query_id = on
+pg_track_optimizer.mode = 'forced'
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION pg_track_optimizer;');
+
+# More entries than one checksummed block (256 entries) holds. Queries with a
+# different number of columns have different queryids.
+$node->safe_psql('postgres',
+	join('', map { 'SELECT ' . join(', ', 1 .. $_) . ";\n" } 1 .. 300));
+my $before =
+  $node->safe_psql('postgres', 'SELECT count(*) FROM pg_track_optimizer()');
+$node->safe_psql('postgres', 'SELECT pg_track_optimizer_flush()');
+$node->stop;
+
+# Flip a byte of the first entry, just after the file header
+my $path = $node->data_dir . '/pg_track_optimizer.stat';
+open(my $file, '+<', $path) or die "could not open $path: $!";
+binmode $file;
+sysseek($file, 44, 0) or die "could not seek in $path: $!";
+my $byte;
+sysread($file, $byte, 1) == 1 or die "could not read $path: $!";
+sysseek($file, 44, 0) or die "could not seek in $path: $!";
+syswrite($file, chr(ord($byte) ^ 0xFF), 1) == 1
+  or die "could not write $path: $!";
+close($file);
+
+my $offset = -s $node->logfile;
+$node->start;
+$node->wait_for_log(
+	qr/WARNING:  \[pg_track_optimizer\] 256 corrupted records skipped in data file "pg_track_optimizer.stat"/,
+	$offset);
+pass('corrupted block is reported');
+
+ok( $node->poll_query_until(
+		'postgres', 'SELECT count(*) > 10 FROM pg_track_optimizer()'),
+	'other blocks are loaded');
+my $after =
+  $node->safe_psql('postgres', 'SELECT count(*) FROM pg_track_optimizer()');
+cmp_ok($after, '<', $before - 200, 'entries of the corrupted block are lost');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,65 @@
+# Copyright (c) 2024 Andrei Lepikhov
+#
+# This software may be modified and distributed under the terms
+# of the MIT license. See the LICENSE file for details.
+
+# A standby keeps its own data files, and after the promotion stores the data
+# under the primary's names, removing the standby files.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $primary = PostgreSQL::Test::Cluster->new('primary');
+$primary->init(allows_streaming => 1);
+$primary->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_track_optimizer'
+compute_query_id = on
+pg_track_optimizer.mode = 'forced'
+});
+$primary->start;
+$primary->safe_psql('postgres', 'CREATE EXTENSION pg_track_optimizer;');
+$primary->safe_psql('postgres', 'SELECT pg_track_optimizer_flush()');
+
+$primary->backup('backup');
+my $standby = PostgreSQL::Test::Cluster->new('standby');
+$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+
+# The file of the primary is copied by the backup. Remove it to see which
+# names the standby writes.
+my $datadir = $standby->data_dir;
+ok(-e "$datadir/pg_track_optimizer.stat", 'primary file is in the backup');
+unlink("$datadir/pg_track_optimizer.stat")
+  or die "could not remove the primary file: $!";
+$standby->start;
+
+$standby->safe_psql('postgres', 'SELECT count(*) FROM pg_class;');
+$standby->safe_psql('postgres', 'SELECT pg_track_optimizer_flush()');
+ok(-e "$datadir/pg_track_optimizer.standby.stat",
+	'standby writes its own file');
+ok(!-e "$datadir/pg_track_optimizer.stat",
+	'standby does not write the primary file');
+
+$standby->promote;
+$standby->safe_psql('postgres', 'SELECT pg_track_optimizer_flush()');
+ok(-e "$datadir/pg_track_optimizer.stat",
+	'promoted server writes the primary file');
+ok(!-e "$datadir/pg_track_optimizer.standby.stat",
+	'standby file is removed after the promotion');
+ok( !-e "$datadir/pg_track_optimizer.standby.delta",
+	'standby log is removed after the promotion');
+is( $standby->safe_psql(
+		'postgres',
+		"SELECT count(*) > 0 FROM pg_track_optimizer()
+		 WHERE querytext LIKE 'SELECT count(*) FROM pg_class%'"),
+	't',
+	'statistics of the standby stay in memory');
+
+$standby->stop;
+$primary->stop;
+
+done_testing();
@@ -0,0 +1,58 @@
+# Copyright (c) 2024 Andrei Lepikhov
+#
+# This software may be modified and distributed under the terms
+# of the MIT license. See the LICENSE file for details.
+
+# Per-node detail of the last execution is kept for the top offenders, ranked
+# by the background worker.
+
+use strict;
+use warnings FATAL => 'all';
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('details');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'pg_track_optimizer'
+compute_query_id = on
+pg_track_optimizer.mode = 'forced'
+pg_track_optimizer.detail_entries = 1
+});
+$node->start;
+
+# The scan is estimated to return one row instead of 100
+$node->safe_psql(
+	'postgres', q{
+CREATE EXTENSION pg_track_optimizer;
+CREATE TABLE pto_corr AS
+  SELECT gs % 100 AS a, gs % 100 AS b FROM generate_series(1, 10000) AS gs;
+ANALYZE pto_corr;
+});
+
+my $query = 'SELECT count(*) AS pto_detail FROM pto_corr WHERE a = 1 AND b = 1;';
+my $details = q{
+SELECT d.node_type, d.plan_rows, d.actual_rows, d.loops
+FROM pg_track_optimizer_details() AS d
+  JOIN pg_track_optimizer() AS t USING (dboid, queryid, toplevel)
+WHERE t.querytext LIKE '%pto_detail%' AND d.node_type = 'Seq Scan'
+};
+
+# The ranking is refreshed every 10 seconds, the detail is captured by the
+# next execution of the ranked query
+my $result = '';
+for (my $i = 0; $i < 3 * $PostgreSQL::Test::Utils::timeout_default; $i++)
+{
+	$node->safe_psql('postgres', $query x 10);
+	$result = $node->safe_psql('postgres', $details);
+	last if $result ne '';
+	sleep(1);
+}
+is($result, 'Seq Scan|1|100|1', 'detail of the misestimated scan is kept');
+
+$node->stop;
+
+done_testing();